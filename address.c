@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * GPU address index.
+ *
+ * Turns any gpu address back into the allocation it belongs to. Locked
+ * video memory nodes, contiguous allocations and pinned user memory are
+ * kept as address ranges, in an array sorted by start address, so a lookup
+ * is a binary search. The size and type of a node are only known at
+ * allocation time, so nodes are kept in a second array, sorted by handle,
+ * until they get freed.
+ *
+ * Both are only fed with completed ioctls, and with the frees queued up
+ * in event queues, by the wrapper and by the decoder alike, so binary
+ * traces get the same treatment. Ranges which overlap a new one are
+ * stale, and get dropped.
+ *
+ * The ioctl path does not touch the index itself, it only pushes what
+ * changed on a lock free list. The log writer thread applies those in
+ * the background, and so does a lookup, before it looks, so that it never
+ * misses what its own thread just did. Should the list grow long anyway,
+ * the thread which pushed last applies it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define ADDRESS_CONTIGUOUS (~0ULL) /* node of a contiguous range. */
+#define ADDRESS_USER (~0ULL - 1) /* node of pinned user memory. */
+
+#define ADDRESS_UPDATES_MAX 4096 /* queued up, before the pusher applies. */
+
+/* what an ioctl changed, waiting to be applied. */
+struct address_update {
+	struct address_update *next;
+	int command;
+	uint64_t node; /* or the physical address, or the user memory. */
+	uint32_t address;
+	uint32_t bytes;
+	int type;
+};
+
+struct address_range {
+	uint32_t start;
+	uint32_t size; /* 0 when unknown. */
+	uint64_t node;
+	uint64_t physical; /* contiguous: physical, user memory: logical. */
+	int type;
+};
+
+struct address_node {
+	uint64_t node;
+	uint32_t bytes;
+	uint32_t address; /* 0 while not locked. */
+	int type;
+};
+
+int wrap_address_enabled;
+
+static pthread_rwlock_t address_lock[1] = { PTHREAD_RWLOCK_INITIALIZER };
+
+/* newest first. */
+static struct address_update *address_updates;
+static unsigned int address_update_count;
+
+static struct address_range *address_ranges;
+static int address_range_count;
+static int address_range_size;
+
+static struct address_node *address_nodes;
+static int address_node_count;
+static int address_node_size;
+
+static uint32_t address_base;
+
+static void *
+address_grow(void *array, int *size, int member)
+{
+	int count = *size ? *size * 2 : 256;
+
+	array = realloc(array, count * member);
+	if (!array) {
+		fprintf(stderr, "%s: failed to grow address index\n",
+			__func__);
+		exit(-1);
+	}
+	*size = count;
+
+	return array;
+}
+
+/*
+ * First range which starts after address.
+ */
+static int
+address_range_after(uint32_t address)
+{
+	int low = 0, high = address_range_count;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (address_ranges[middle].start <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+static struct address_node *address_node_find(uint64_t node);
+
+static uint32_t
+address_range_end(struct address_range *range)
+{
+	return range->start + (range->size ? range->size : 1);
+}
+
+static void
+address_range_remove(int index)
+{
+	struct address_range *range = &address_ranges[index];
+
+	/* keep the node side in sync. */
+	if ((range->node != ADDRESS_CONTIGUOUS) &&
+	    (range->node != ADDRESS_USER)) {
+		struct address_node *entry = address_node_find(range->node);
+
+		if (entry)
+			entry->address = 0;
+	}
+
+	address_range_count--;
+	memmove(range, range + 1,
+		(address_range_count - index) * sizeof(struct address_range));
+}
+
+static void
+address_range_insert(uint32_t start, uint32_t size, uint64_t node,
+		     uint64_t physical, int type)
+{
+	struct address_range *range;
+	uint32_t end = start + (size ? size : 1);
+	int index;
+
+	/* drop everything we overlap with, it is stale. */
+	index = address_range_after(start);
+	if (index && (address_range_end(&address_ranges[index - 1]) > start))
+		index--;
+	while ((index < address_range_count) &&
+	       (address_ranges[index].start < end))
+		address_range_remove(index);
+
+	if (address_range_count == address_range_size)
+		address_ranges = address_grow(address_ranges,
+					      &address_range_size,
+					      sizeof(struct address_range));
+
+	range = &address_ranges[index];
+	memmove(range + 1, range,
+		(address_range_count - index) * sizeof(struct address_range));
+	address_range_count++;
+
+	range->start = start;
+	range->size = size;
+	range->node = node;
+	range->physical = physical;
+	range->type = type;
+}
+
+static struct address_range *
+address_range_find(uint32_t address)
+{
+	struct address_range *range;
+	int index = address_range_after(address);
+
+	if (!index)
+		return NULL;
+
+	range = &address_ranges[index - 1];
+	if (address >= address_range_end(range))
+		return NULL;
+
+	return range;
+}
+
+/*
+ * Index of the node, or where it should go.
+ */
+static int
+address_node_search(uint64_t node)
+{
+	int low = 0, high = address_node_count;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (address_nodes[middle].node < node)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+static struct address_node *
+address_node_find(uint64_t node)
+{
+	int index = address_node_search(node);
+
+	if ((index == address_node_count) ||
+	    (address_nodes[index].node != node))
+		return NULL;
+
+	return &address_nodes[index];
+}
+
+static void
+address_node_unlocked(struct address_node *entry)
+{
+	struct address_range *range;
+
+	if (!entry->address)
+		return;
+
+	range = address_range_find(entry->address);
+	if (range && (range->node == entry->node))
+		address_range_remove(range - address_ranges);
+
+	entry->address = 0;
+}
+
+static void
+address_allocated(uint64_t node, uint32_t bytes, int type)
+{
+	struct address_node *entry = address_node_find(node);
+	int index;
+
+	/* we missed a free, the kernel handed out this handle again. */
+	if (entry) {
+		address_node_unlocked(entry);
+	} else {
+		if (address_node_count == address_node_size)
+			address_nodes = address_grow(address_nodes,
+						     &address_node_size,
+						     sizeof(struct address_node));
+
+		index = address_node_search(node);
+		entry = &address_nodes[index];
+		memmove(entry + 1, entry, (address_node_count - index) *
+			sizeof(struct address_node));
+		address_node_count++;
+	}
+
+	entry->node = node;
+	entry->bytes = bytes;
+	entry->address = 0;
+	entry->type = type;
+}
+
+static void
+address_locked(uint64_t node, uint32_t address)
+{
+	struct address_node *entry = address_node_find(node);
+
+	/* not ours, or allocated before we were around. */
+	if (!entry || !address)
+		return;
+
+	if (entry->address == address)
+		return;
+
+	address_node_unlocked(entry);
+
+	address_range_insert(address, entry->bytes, node, 0, entry->type);
+	entry->address = address;
+}
+
+static void
+address_freed(uint64_t node)
+{
+	struct address_node *entry = address_node_find(node);
+
+	if (!entry)
+		return;
+
+	address_node_unlocked(entry);
+
+	address_node_count--;
+	memmove(entry, entry + 1, (address_node_count - (entry - address_nodes))
+		* sizeof(struct address_node));
+}
+
+static void
+address_contiguous(uint64_t physical, uint32_t address, uint32_t bytes)
+{
+	/* older kernels leave it to us to apply the base address. */
+	if (!address)
+		address = physical - address_base;
+
+	address_range_insert(address, bytes, ADDRESS_CONTIGUOUS, physical,
+			     gcvSURF_TYPE_UNKNOWN);
+}
+
+static void
+address_range_freed(uint64_t node, uint64_t physical)
+{
+	int i;
+
+	for (i = 0; i < address_range_count; i++)
+		if ((address_ranges[i].node == node) &&
+		    (address_ranges[i].physical == physical)) {
+			address_range_remove(i);
+			return;
+		}
+}
+
+/*
+ * Call with the lock held for writing.
+ */
+static void
+address_apply(struct address_update *update)
+{
+	switch (update->command) {
+	case gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY:
+	case gcvHAL_ALLOCATE_VIDEO_MEMORY:
+		address_allocated(update->node, update->bytes, update->type);
+		break;
+	case gcvHAL_LOCK_VIDEO_MEMORY:
+		address_locked(update->node, update->address);
+		break;
+	case gcvHAL_FREE_VIDEO_MEMORY:
+		address_freed(update->node);
+		break;
+	case gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY:
+		address_contiguous(update->node, update->address,
+				   update->bytes);
+		break;
+	case gcvHAL_FREE_CONTIGUOUS_MEMORY:
+		address_range_freed(ADDRESS_CONTIGUOUS, update->node);
+		break;
+	case gcvHAL_MAP_USER_MEMORY:
+		address_range_insert(update->address, update->bytes,
+				     ADDRESS_USER, update->node,
+				     gcvSURF_TYPE_UNKNOWN);
+		break;
+	case gcvHAL_UNMAP_USER_MEMORY:
+		address_range_freed(ADDRESS_USER, update->node);
+		break;
+	case gcvHAL_GET_BASE_ADDRESS:
+		address_base = update->address;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Applies everything which was queued up so far, oldest first.
+ */
+void
+wrap_address_drain(void)
+{
+	struct address_update *update, *next, *oldest = NULL;
+
+	if (!__atomic_load_n(&address_updates, __ATOMIC_RELAXED))
+		return;
+
+	pthread_rwlock_wrlock(address_lock);
+
+	update = __atomic_exchange_n(&address_updates, NULL, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&address_update_count, 0, __ATOMIC_RELAXED);
+
+	for (; update; update = next) {
+		next = update->next;
+		update->next = oldest;
+		oldest = update;
+	}
+
+	for (update = oldest; update; update = next) {
+		next = update->next;
+		address_apply(update);
+		free(update);
+	}
+
+	pthread_rwlock_unlock(address_lock);
+}
+
+/*
+ * Called for successfully completed ioctls only.
+ */
+void
+wrap_address_update(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+	struct address_update *update;
+
+	switch (interface->command) {
+	case gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY:
+	case gcvHAL_ALLOCATE_VIDEO_MEMORY:
+	case gcvHAL_LOCK_VIDEO_MEMORY:
+	case gcvHAL_FREE_VIDEO_MEMORY:
+	case gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY:
+	case gcvHAL_FREE_CONTIGUOUS_MEMORY:
+	case gcvHAL_MAP_USER_MEMORY:
+	case gcvHAL_UNMAP_USER_MEMORY:
+	case gcvHAL_GET_BASE_ADDRESS:
+		break;
+	default:
+		return;
+	}
+
+	update = calloc(1, sizeof(struct address_update));
+	if (!update) {
+		fprintf(stderr, "%s: failed to allocate update\n", __func__);
+		return;
+	}
+	update->command = interface->command;
+
+	switch (interface->command) {
+	case gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY:
+		update->node = interface->u.AllocateLinearVideoMemory.node;
+		update->bytes = interface->u.AllocateLinearVideoMemory.bytes;
+		update->type = interface->u.AllocateLinearVideoMemory.type;
+		break;
+	case gcvHAL_ALLOCATE_VIDEO_MEMORY:
+		update->node = interface->u.AllocateVideoMemory.node;
+		update->type = interface->u.AllocateVideoMemory.type;
+		break;
+	case gcvHAL_LOCK_VIDEO_MEMORY:
+		update->node = interface->u.LockVideoMemory.node;
+		update->address = interface->u.LockVideoMemory.address;
+		break;
+	case gcvHAL_FREE_VIDEO_MEMORY:
+		update->node = interface->u.FreeVideoMemory.node;
+		break;
+	case gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY:
+		update->node = interface->u.AllocateContiguousMemory.physical;
+		update->address = interface->u.AllocateContiguousMemory.address;
+		update->bytes = interface->u.AllocateContiguousMemory.bytes;
+		break;
+	case gcvHAL_FREE_CONTIGUOUS_MEMORY:
+		update->node = interface->u.FreeContiguousMemory.physical;
+		break;
+	case gcvHAL_MAP_USER_MEMORY:
+		update->node = interface->u.MapUserMemory.memory;
+		update->address = interface->u.MapUserMemory.address;
+		update->bytes = interface->u.MapUserMemory.size;
+		break;
+	case gcvHAL_UNMAP_USER_MEMORY:
+		update->node = interface->u.UnmapUserMemory.memory;
+		break;
+	case gcvHAL_GET_BASE_ADDRESS:
+		update->address = interface->u.GetBaseAddress.baseAddress;
+		break;
+	default:
+		break;
+	}
+
+	update->next = __atomic_load_n(&address_updates, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&address_updates, &update->next,
+					    update, 1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	if (__atomic_add_fetch(&address_update_count, 1, __ATOMIC_RELAXED) >=
+	    ADDRESS_UPDATES_MAX)
+		wrap_address_drain();
+}
+
+/*
+ * Describes the allocation which address falls into, returns -1 when
+ * nothing is known about it.
+ */
+int
+wrap_address_name(uint32_t address, char *buffer, int size)
+{
+	struct address_range *range;
+	int ret = -1;
+
+	if (!wrap_address_enabled || !address)
+		return -1;
+
+	wrap_address_drain();
+
+	pthread_rwlock_rdlock(address_lock);
+
+	range = address_range_find(address);
+	if (!range)
+		;
+	else if (range->node == ADDRESS_CONTIGUOUS)
+		ret = snprintf(buffer, size, "contiguous 0x%08llX, offset 0x%X",
+			       (unsigned long long) range->physical,
+			       address - range->start);
+	else if (range->node == ADDRESS_USER)
+		ret = snprintf(buffer, size, "user 0x%08llX, offset 0x%X",
+			       (unsigned long long) range->physical,
+			       address - range->start);
+	else
+		ret = snprintf(buffer, size, "node 0x%08llX, offset 0x%X, %s",
+			       (unsigned long long) range->node,
+			       address - range->start,
+			       viv_surface_type(range->type));
+
+	pthread_rwlock_unlock(address_lock);
+
+	return (ret < 0) ? -1 : 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Command buffer capture.
+ *
+ * COMMIT hands the kernel a gcoCMDBUF, which lives in our own address
+ * space. What gets submitted is what lies between its start offset and
+ * its current offset, plus the reserved tail, in which the kernel places
+ * its LINK back into the ring. The size of that tail is assumed, see
+ * CAPTURE_TAIL. This range is copied into the trace, right after the
+ * COMMIT itself, before the kernel gets to see it: as a blob record in
+ * binary traces, as a hex dump in text traces.
+ *
+ * The submitted bytes are also counted, per commit and per frame, so
+ * oversized submissions stand out without having to go through the
+ * trace.
+ *
+ * With VIV_WRAP_DEDUP, identical streams only get stored once, see
+ * dedup.c.
+ *
+ * With VIV_WRAP_OPCODES, the stream also gets decoded on the spot, and
+ * its opcodes, draws and state writes get logged per commit and per
+ * frame.
+ *
+ * With VIV_WRAP_DELTA, the state delta, which is also ours, is copied out
+ * and checked for redundant state writes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+/*
+ * The reserved tail is not part of gcoCMDBUF, the driver keeps its size
+ * in the gcoBUFFER which hands out command buffers, and which we can not
+ * see from here. 8 bytes, a single LINK, is what the 4.6.9 kernel needs,
+ * other kernels might reserve more, and then the end of their tail is
+ * missing from the capture.
+ */
+#define CAPTURE_TAIL 8
+#define CAPTURE_SIZES 32 /* power of two buckets. */
+
+/*
+ * The user space side of gcoCMDBUF is not part of the kernel headers.
+ * This mirrors the 4.6.9 layout, we only need what comes before free.
+ */
+struct capture_cmdbuf {
+	gctUINT32 object;
+	gctUINT64 commitCount;
+	gctUINT32 entryPipe;
+	gctUINT32 exitPipe;
+	gctBOOL using2D;
+	gctBOOL using3D;
+	gctBOOL usingFilterBlit;
+	gctBOOL usingPalette;
+	gctUINT32 physical;
+	gctUINT64 logical;
+	gctUINT32 bytes;
+	gctUINT32 startOffset;
+	gctUINT32 offset;
+	gctUINT32 free;
+};
+
+/*
+ * Same for gcsSTATE_DELTA, of a release build, up to the record array.
+ */
+struct capture_delta {
+	gctUINT id;
+	gctINT refCount;
+	gctUINT elementCount;
+	gctUINT recordCount;
+	gctUINT64 recordArray;
+};
+
+#define CAPTURE_DELTA_MAX 0x10000 /* records, sanity only. */
+
+int wrap_capture_enabled;
+int wrap_capture_opcodes;
+
+static pthread_mutex_t capture_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t capture_commits;
+static uint64_t capture_bytes;
+static uint64_t capture_max;
+static uint64_t capture_broken; /* command buffers which made no sense. */
+static uint64_t capture_dropped; /* did not fit in the log ring. */
+static uint64_t capture_sizes[CAPTURE_SIZES];
+static uint64_t capture_delta_broken;
+
+static unsigned int capture_frame;
+static uint64_t capture_frame_bytes; /* of the current frame. */
+static uint64_t capture_frame_max;
+static unsigned int capture_frame_max_frame;
+static uint64_t capture_frames; /* which submitted anything. */
+
+static unsigned int capture_opcodes_frame;
+static struct wrap_cmdstream_stats capture_opcodes_stats; /* of that frame. */
+
+static void
+capture_count(uint32_t size)
+{
+	unsigned int frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(capture_mutex);
+
+	capture_commits++;
+	capture_bytes += size;
+	if (size > capture_max)
+		capture_max = size;
+	if (size)
+		capture_sizes[31 - __builtin_clz(size)]++;
+
+	if (frame != capture_frame) {
+		capture_frame = frame;
+		capture_frame_bytes = 0;
+	}
+	if (!capture_frame_bytes)
+		capture_frames++;
+	capture_frame_bytes += size;
+	if (capture_frame_bytes > capture_frame_max) {
+		capture_frame_max = capture_frame_bytes;
+		capture_frame_max_frame = frame;
+	}
+
+	pthread_mutex_unlock(capture_mutex);
+}
+
+/*
+ * Frames are only known here, so this also happens for binary traces,
+ * rather than in vivwrap-decode.
+ */
+static void
+capture_decode(const void *logical, uint32_t size, int traced)
+{
+	unsigned int frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	struct wrap_cmdstream_stats stats;
+
+	pthread_mutex_lock(capture_mutex);
+
+	if ((frame != capture_opcodes_frame) && capture_opcodes_stats.words) {
+		wrap_log("/* viv_wrap: frame %u: ", capture_opcodes_frame);
+		wrap_cmdstream_log(&capture_opcodes_stats);
+		wrap_log(" */\n");
+		memset(&capture_opcodes_stats, 0, sizeof(capture_opcodes_stats));
+	}
+	capture_opcodes_frame = frame;
+
+	wrap_cmdstream_decode(logical, size, &stats);
+	wrap_cmdstream_add(&capture_opcodes_stats, &stats);
+
+	pthread_mutex_unlock(capture_mutex);
+
+	if (!traced)
+		return;
+
+	wrap_log("\t/* ");
+	wrap_cmdstream_log(&stats);
+	wrap_log(" */\n");
+}
+
+/*
+ * The command buffer itself, as a blob record or as a hex dump.
+ */
+static void
+capture_log(gcsHAL_INTERFACE *interface, const void *logical, uint32_t size,
+	    uint32_t tail)
+{
+	if (wrap_log_binary) {
+		struct viv_record record = {
+			.size = size + tail,
+			.type = VIV_RECORD_BLOB,
+			.command = interface->command,
+			.hardware = interface->hardwareType,
+			.flags = tail,
+		};
+
+		if (wrap_log_room(sizeof(record) +
+				  VIV_RECORD_ALIGN(size + tail)) &&
+		    !wrap_log_record(&record, logical))
+			return;
+	} else if (wrap_log_room(hook_command_buffer_length(size + tail))) {
+		hook_command_buffer(logical, size + tail);
+		return;
+	}
+
+	/* rather than a dump with holes in it, or no trace of it at all. */
+	wrap_log("\t/* command buffer of %u bytes dropped */\n", size + tail);
+	__atomic_add_fetch(&capture_dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void
+capture_cmdbuf(gcsHAL_INTERFACE *interface, int traced)
+{
+	struct capture_cmdbuf *cmdbuf;
+	const uint8_t *logical;
+	uint32_t size, tail = 0;
+
+	cmdbuf = (struct capture_cmdbuf *)
+		(uintptr_t) interface->u.Commit.commandBuffer;
+	if (!cmdbuf)
+		return;
+
+	if (!cmdbuf->logical || (cmdbuf->startOffset > cmdbuf->offset) ||
+	    (cmdbuf->offset > cmdbuf->bytes)) {
+		__atomic_add_fetch(&capture_broken, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	logical = (const uint8_t *) (uintptr_t) cmdbuf->logical;
+	logical += cmdbuf->startOffset;
+
+	size = cmdbuf->offset - cmdbuf->startOffset;
+	if ((cmdbuf->offset + CAPTURE_TAIL) <= cmdbuf->bytes)
+		tail = CAPTURE_TAIL;
+
+	capture_count(size + tail);
+
+	if (wrap_capture_enabled && traced &&
+	    (!wrap_dedup_enabled ||
+	     wrap_dedup_add(interface->hardwareType, logical, size)))
+		capture_log(interface, logical, size, tail);
+
+	/* the tail only gets filled in by the kernel, do not decode it. */
+	if (wrap_capture_opcodes)
+		capture_decode(logical, size, traced);
+
+	if (wrap_address_enabled && traced)
+		wrap_cmdstream_addresses(logical, size);
+}
+
+static void
+capture_delta(gcsHAL_INTERFACE *interface, int traced)
+{
+	struct capture_delta *delta;
+	const struct wrap_delta_record *records;
+	uint32_t count;
+	int redundant;
+
+	delta = (struct capture_delta *) (uintptr_t) interface->u.Commit.delta;
+	if (!delta)
+		return;
+
+	count = delta->recordCount;
+	records = (const struct wrap_delta_record *)
+		(uintptr_t) delta->recordArray;
+	if (!count)
+		return;
+
+	if (!records || (count > CAPTURE_DELTA_MAX)) {
+		__atomic_add_fetch(&capture_delta_broken, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (traced && wrap_log_binary) {
+		struct viv_record record = {
+			.size = count * sizeof(struct wrap_delta_record),
+			.type = VIV_RECORD_DELTA,
+			.command = interface->command,
+			.hardware = interface->hardwareType,
+		};
+
+		wrap_log_record(&record, records);
+	} else if (traced)
+		wrap_delta_log(records, count);
+
+	/* counted here only, vivwrap-decode just lists the records. */
+	pthread_mutex_lock(capture_mutex);
+	redundant = wrap_delta_apply(records, count);
+	pthread_mutex_unlock(capture_mutex);
+
+	if (traced)
+		wrap_log("\t/* %d of %u state writes redundant */\n",
+			 redundant, count);
+}
+
+/*
+ * Called right after the pre hook of a traced COMMIT, or right before an
+ * untraced one is issued. Only the counting happens for the latter.
+ */
+void
+wrap_capture_commit(void *data, int traced)
+{
+	gcsHAL_INTERFACE *interface = data;
+
+	if (wrap_capture_enabled || wrap_capture_opcodes)
+		capture_cmdbuf(interface, traced);
+
+	if (wrap_delta_enabled)
+		capture_delta(interface, traced);
+}
+
+/*
+ * Call with the mutex held.
+ */
+static void
+capture_cmdbuf_stats(void)
+{
+	int i;
+
+	wrap_log("/* viv_wrap: command buffers: %llu commits, %llu bytes, "
+		 "%llu on average, largest %llu; %llu frames, %llu bytes on "
+		 "average, largest %llu (frame %u).\n",
+		 (unsigned long long) capture_commits,
+		 (unsigned long long) capture_bytes,
+		 (unsigned long long) (capture_commits ?
+		 capture_bytes / capture_commits : 0),
+		 (unsigned long long) capture_max,
+		 (unsigned long long) capture_frames,
+		 (unsigned long long) (capture_frames ?
+		 capture_bytes / capture_frames : 0),
+		 (unsigned long long) capture_frame_max,
+		 capture_frame_max_frame);
+
+	for (i = 0; i < CAPTURE_SIZES; i++)
+		if (capture_sizes[i])
+			wrap_log(" *   %10llu - %10llu bytes: %llu\n",
+				 1ULL << i, (2ULL << i) - 1,
+				 (unsigned long long) capture_sizes[i]);
+
+	if (capture_broken)
+		wrap_log(" * %llu command buffers were not understood.\n",
+			 (unsigned long long) capture_broken);
+	if (capture_dropped)
+		wrap_log(" * %llu command buffers did not fit in the log ring "
+			 "and were not dumped.\n",
+			 (unsigned long long) capture_dropped);
+
+	wrap_log(" */\n");
+
+	if (wrap_capture_opcodes) {
+		if (capture_opcodes_stats.words) {
+			wrap_log("/* viv_wrap: frame %u: ",
+				 capture_opcodes_frame);
+			wrap_cmdstream_log(&capture_opcodes_stats);
+			wrap_log(" */\n");
+		}
+		wrap_cmdstream_report();
+	}
+}
+
+void
+viv_wrap_capture_stats(void)
+{
+	if (!wrap_capture_enabled && !wrap_capture_opcodes &&
+	    !wrap_delta_enabled)
+		return;
+
+	pthread_mutex_lock(capture_mutex);
+
+	if (wrap_capture_enabled || wrap_capture_opcodes)
+		capture_cmdbuf_stats();
+
+	if (wrap_delta_enabled) {
+		wrap_delta_report();
+		if (capture_delta_broken)
+			wrap_log("/* viv_wrap: %llu state deltas were not "
+				 "understood. */\n",
+				 (unsigned long long) capture_delta_broken);
+	}
+
+	wrap_log_commit();
+
+	pthread_mutex_unlock(capture_mutex);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Host side checks of the modules which also build for the host: the
+ * command stream decoder in check_cmdstream.c, the state delta tracker
+ * in check_delta.c and the gpu address index in check_address.c. Run
+ * through "make check".
+ */
+
+#include <stdio.h>
+
+#include "wrap.h"
+#include "check.h"
+
+int check_failed;
+
+/* the modules log their reports, we only look at the numbers. */
+int
+wrap_log(const char *format, ...)
+{
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	check_cmdstream();
+	check_delta();
+	check_address();
+
+	if (check_failed) {
+		fprintf(stderr, "%d checks failed.\n", check_failed);
+		return 1;
+	}
+
+	printf("All checks passed.\n");
+	return 0;
+}
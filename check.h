@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Shared bits of the host side checks, see check.c.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H 1
+
+#include <stdio.h>
+
+extern int check_failed;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: %s failed.\n", __func__, \
+				__LINE__, #condition); \
+			check_failed++; \
+		} \
+	} while (0)
+
+void check_cmdstream(void);
+void check_delta(void);
+void check_address(void);
+
+#endif /* CHECK_H */
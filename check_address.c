@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * GPU address index checks: locked nodes, pinned user memory which
+ * overlaps them, frees, and more updates than get queued up at once.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "wrap.h"
+#include "check.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+static int
+check_address_name(uint32_t address, const char *expected)
+{
+	char name[128];
+
+	if (wrap_address_name(address, name, sizeof(name)))
+		return !expected;
+
+	if (!expected)
+		return 0;
+
+	return !strncmp(name, expected, strlen(expected));
+}
+
+void
+check_address(void)
+{
+	gcsHAL_INTERFACE interface;
+	int i;
+
+	wrap_address_enabled = 1;
+
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY;
+	interface.u.AllocateLinearVideoMemory.node = 0x1001;
+	interface.u.AllocateLinearVideoMemory.bytes = 0x1000;
+	interface.u.AllocateLinearVideoMemory.type = gcvSURF_TEXTURE;
+	wrap_address_update(&interface);
+	interface.u.AllocateLinearVideoMemory.node = 0x1002;
+	wrap_address_update(&interface);
+
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_LOCK_VIDEO_MEMORY;
+	interface.u.LockVideoMemory.node = 0x1001;
+	interface.u.LockVideoMemory.address = 0x10000000;
+	wrap_address_update(&interface);
+	interface.u.LockVideoMemory.node = 0x1002;
+	interface.u.LockVideoMemory.address = 0x10002000;
+	wrap_address_update(&interface);
+
+	CHECK(check_address_name(0x10000010, "node 0x00001001, offset 0x10"));
+	CHECK(check_address_name(0x10002FFF, "node 0x00001002, offset 0xFFF"));
+	CHECK(check_address_name(0x10001000, NULL));
+	CHECK(check_address_name(0x10003000, NULL));
+
+	/* overlaps the tail of the first node, which is then stale. */
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_MAP_USER_MEMORY;
+	interface.u.MapUserMemory.memory = 0x7000;
+	interface.u.MapUserMemory.size = 0x1000;
+	interface.u.MapUserMemory.address = 0x10000800;
+	wrap_address_update(&interface);
+
+	CHECK(check_address_name(0x10000010, NULL));
+	CHECK(check_address_name(0x10000900, "user 0x00007000, offset 0x100"));
+	CHECK(check_address_name(0x10002010, "node 0x00001002, offset 0x10"));
+
+	/* and a node locked over it evicts the user range again. */
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_LOCK_VIDEO_MEMORY;
+	interface.u.LockVideoMemory.node = 0x1001;
+	interface.u.LockVideoMemory.address = 0x10001000;
+	wrap_address_update(&interface);
+
+	CHECK(check_address_name(0x10000900, NULL));
+	CHECK(check_address_name(0x10001010, "node 0x00001001, offset 0x10"));
+	CHECK(check_address_name(0x10002010, "node 0x00001002, offset 0x10"));
+
+	/* freed nodes are gone. */
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_FREE_VIDEO_MEMORY;
+	interface.u.FreeVideoMemory.node = 0x1002;
+	wrap_address_update(&interface);
+
+	CHECK(check_address_name(0x10002010, NULL));
+	CHECK(check_address_name(0x10001010, "node 0x00001001, offset 0x10"));
+
+	/* more relocks than get queued up, only the last one counts. */
+	memset(&interface, 0, sizeof(interface));
+	interface.command = gcvHAL_LOCK_VIDEO_MEMORY;
+	interface.u.LockVideoMemory.node = 0x1001;
+	for (i = 0; i < 10000; i++) {
+		interface.u.LockVideoMemory.address = 0x20000000 + i * 0x1000;
+		wrap_address_update(&interface);
+	}
+
+	CHECK(check_address_name(0x10001010, NULL));
+	CHECK(check_address_name(0x20000000 + 9998 * 0x1000, NULL));
+	CHECK(check_address_name(0x20000000 + 9999 * 0x1000 + 0x10,
+				 "node 0x00001001, offset 0x10"));
+}
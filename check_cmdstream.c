@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Front end command stream decoder checks: fixed command streams, and
+ * the opcode and length accounting which comes out.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "wrap.h"
+#include "check.h"
+
+#define LOAD_STATE(address, count) \
+	(0x08000000 | (((count) & 0x3FF) << 16) | (address))
+#define DRAW_2D(count, data) \
+	(0x20000000 | (((data) & 0x7FF) << 16) | (((count) & 0xFF) << 8))
+#define DRAW_PRIMITIVES 0x28000000
+#define NOP 0x18000000
+#define END 0x10000000
+
+void
+check_cmdstream(void)
+{
+	struct wrap_cmdstream_stats stats;
+	uint32_t words[2048];
+	int count, ret;
+
+	/* 1 state, padded to 64 bits, and a draw. */
+	count = 0;
+	words[count++] = LOAD_STATE(0x0E03, 1);
+	words[count++] = 3;
+	words[count++] = DRAW_PRIMITIVES;
+	words[count++] = 0;
+	words[count++] = 3;
+	words[count++] = 0;
+	words[count++] = END;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(!ret);
+	CHECK(stats.words == 8);
+	CHECK(stats.states == 1);
+	CHECK(stats.draws == 1);
+	CHECK(stats.opcodes[0x01] == 1);
+	CHECK(stats.opcodes[0x02] == 1);
+	CHECK(stats.opcodes[0x05] == 1);
+	CHECK(!stats.broken);
+
+	/* a count of 0 means 1024 states, no padding needed. */
+	count = 0;
+	words[count++] = LOAD_STATE(0x1000, 0);
+	memset(&words[count], 0, 1024 * 4);
+	count += 1024;
+	words[count++] = 0; /* padding. */
+	words[count++] = NOP;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(!ret);
+	CHECK(stats.states == 1024);
+	CHECK(stats.opcodes[0x01] == 1);
+	CHECK(stats.opcodes[0x03] == 1);
+	CHECK(!stats.broken);
+
+	/* 2 rectangles of 2 words each, after 2 words of header. */
+	count = 0;
+	words[count++] = DRAW_2D(2, 0);
+	words[count++] = 0;
+	memset(&words[count], 0, 4 * 4);
+	count += 4;
+	words[count++] = NOP;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(!ret);
+	CHECK(stats.draws == 1);
+	CHECK(stats.opcodes[0x04] == 1);
+	CHECK(stats.opcodes[0x03] == 1);
+
+	/* and a count of 0 means 256 of them. */
+	count = 0;
+	words[count++] = DRAW_2D(0, 0);
+	words[count++] = 0;
+	memset(&words[count], 0, 512 * 4);
+	count += 512;
+	words[count++] = END;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(!ret);
+	CHECK(stats.draws == 1);
+	CHECK(stats.opcodes[0x02] == 1);
+	CHECK(!stats.broken);
+
+	/* 1 rectangle and 3 data words, padded to 64 bits. */
+	count = 0;
+	words[count++] = DRAW_2D(1, 3);
+	words[count++] = 0;
+	memset(&words[count], 0, 6 * 4);
+	count += 6;
+	words[count++] = NOP;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(!ret);
+	CHECK(stats.draws == 1);
+	CHECK(stats.opcodes[0x04] == 1);
+	CHECK(stats.opcodes[0x03] == 1);
+	CHECK(!stats.broken);
+
+	/* payload runs past the end. */
+	count = 0;
+	words[count++] = LOAD_STATE(0x0E00, 4);
+	words[count++] = 1;
+	words[count++] = 2;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(ret == -1);
+	CHECK(stats.broken == 1);
+	CHECK(!stats.opcodes[0x01]);
+
+	/* not an opcode. */
+	count = 0;
+	words[count++] = 0xF8000000;
+	words[count++] = 0;
+
+	ret = wrap_cmdstream_decode(words, count * 4, &stats);
+	CHECK(ret == -1);
+	CHECK(stats.broken == 1);
+}
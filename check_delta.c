@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * State delta tracker checks: which records count as redundant, with
+ * masked writes to bits which were never written before.
+ */
+
+#include <stdint.h>
+
+#include "wrap.h"
+#include "check.h"
+
+void
+check_delta(void)
+{
+	static const struct wrap_delta_record first[] = {
+		{ 0x0100, 0, 0x00000005 },
+		{ 0x0101, 0, 0x12345678 },
+		{ 0x0102, 0x000000FF, 0x00000012 }, /* never seen. */
+	};
+	static const struct wrap_delta_record second[] = {
+		{ 0x0100, 0, 0x00000005 }, /* same. */
+		{ 0x0100, ~0U, 0x00000005 }, /* full mask, same. */
+		{ 0x0101, 0x0000FF00, 0xFFFF56FF }, /* masked, same. */
+		{ 0x0101, 0x000000FF, 0x00000000 }, /* masked, differs. */
+		{ 0x0102, 0x0000FF00, 0x00000000 }, /* masked, never written. */
+		{ 0x0100, 0, 0x00000006 },
+	};
+	static const struct wrap_delta_record third[] = {
+		{ 0x0101, 0, 0x12345600 }, /* the merged value. */
+		{ 0x0102, 0, 0x00000012 }, /* top half never written. */
+		{ 0xFFFFF, 0, 0 }, /* out of range, skipped. */
+	};
+	static const struct wrap_delta_record fourth[] = {
+		{ 0x0102, 0xFFFF0000, 0x00000000 }, /* now known, same. */
+		{ 0x0103, 0x0000FFFF, 0x00000000 }, /* never written. */
+	};
+
+	CHECK(wrap_delta_apply(first, 3) == 0);
+	CHECK(wrap_delta_apply(second, 6) == 3);
+	CHECK(wrap_delta_apply(third, 3) == 1);
+	CHECK(wrap_delta_apply(fourth, 2) == 1);
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Front end command stream decoder.
+ *
+ * Walks captured command buffers, command by command, and counts opcodes,
+ * draws and state writes. The opcode lives in the top 5 bits of the
+ * first word, every command is a multiple of 64 bits long. Only the
+ * command headers get looked at, the payload of a LOAD_STATE is skipped
+ * in one go, and its registers are counted with a plain loop over a flat
+ * array, which the compiler vectorizes.
+ *
+ * Separately, state values and LINK and CALL targets which point into a
+ * known allocation can be listed, see address.c. A state value which only
+ * happens to look like such an address gets listed too.
+ *
+ * Also built into vivwrap-check, callers serialize.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wrap.h"
+
+#define CMDSTREAM_LOAD_STATE 0x01
+#define CMDSTREAM_END 0x02
+#define CMDSTREAM_NOP 0x03
+#define CMDSTREAM_DRAW_2D 0x04
+#define CMDSTREAM_DRAW_PRIMITIVES 0x05
+#define CMDSTREAM_DRAW_INDEXED_PRIMITIVES 0x06
+#define CMDSTREAM_WAIT 0x07
+#define CMDSTREAM_LINK 0x08
+#define CMDSTREAM_STALL 0x09
+#define CMDSTREAM_CALL 0x0A
+#define CMDSTREAM_RETURN 0x0B
+#define CMDSTREAM_DRAW_INSTANCED 0x0C
+#define CMDSTREAM_CHIP_SELECT 0x0D
+
+#define CMDSTREAM_REGISTERS 0x10000
+#define CMDSTREAM_RANKED 16
+
+static const char *cmdstream_names[CMDSTREAM_OPCODES] = {
+	[CMDSTREAM_LOAD_STATE] = "LOAD_STATE",
+	[CMDSTREAM_END] = "END",
+	[CMDSTREAM_NOP] = "NOP",
+	[CMDSTREAM_DRAW_2D] = "DRAW_2D",
+	[CMDSTREAM_DRAW_PRIMITIVES] = "DRAW_PRIMITIVES",
+	[CMDSTREAM_DRAW_INDEXED_PRIMITIVES] = "DRAW_INDEXED_PRIMITIVES",
+	[CMDSTREAM_WAIT] = "WAIT",
+	[CMDSTREAM_LINK] = "LINK",
+	[CMDSTREAM_STALL] = "STALL",
+	[CMDSTREAM_CALL] = "CALL",
+	[CMDSTREAM_RETURN] = "RETURN",
+	[CMDSTREAM_DRAW_INSTANCED] = "DRAW_INSTANCED",
+	[CMDSTREAM_CHIP_SELECT] = "CHIP_SELECT",
+};
+
+/* totals, over everything decoded. */
+static struct wrap_cmdstream_stats cmdstream_total;
+static uint32_t *cmdstream_registers;
+
+/*
+ * Length of the command in words, 0 when we do not know it.
+ */
+static uint32_t
+cmdstream_length(uint32_t header)
+{
+	uint32_t count;
+
+	switch (header >> 27) {
+	case CMDSTREAM_LOAD_STATE:
+		count = (header >> 16) & 0x3FF;
+		if (!count)
+			count = 1024;
+		/* header and payload, padded to 64 bits. */
+		return (count + 2) & ~1;
+	case CMDSTREAM_DRAW_2D:
+		count = (header >> 8) & 0xFF;
+		if (!count)
+			count = 256;
+		/* header, rectangles, and data words padded to 64 bits. */
+		return 2 + 2 * count + ((((header >> 16) & 0x7FF) + 1) & ~1);
+	case CMDSTREAM_DRAW_PRIMITIVES:
+	case CMDSTREAM_CALL:
+	case CMDSTREAM_DRAW_INSTANCED:
+		return 4;
+	case CMDSTREAM_DRAW_INDEXED_PRIMITIVES:
+		return 6;
+	case CMDSTREAM_END:
+	case CMDSTREAM_NOP:
+	case CMDSTREAM_WAIT:
+	case CMDSTREAM_LINK:
+	case CMDSTREAM_STALL:
+	case CMDSTREAM_RETURN:
+	case CMDSTREAM_CHIP_SELECT:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static void
+cmdstream_states(uint32_t header, struct wrap_cmdstream_stats *stats)
+{
+	uint32_t address = header & 0xFFFF, count, i;
+
+	count = (header >> 16) & 0x3FF;
+	if (!count)
+		count = 1024;
+
+	stats->states += count;
+
+	if (!cmdstream_registers)
+		return;
+
+	/* the 16 bit address wraps, which no sane driver relies on. */
+	if ((address + count) > CMDSTREAM_REGISTERS)
+		count = CMDSTREAM_REGISTERS - address;
+
+	for (i = 0; i < count; i++)
+		cmdstream_registers[address + i]++;
+}
+
+/*
+ * Decodes size bytes worth of commands, and adds them to stats as well
+ * as to the totals. Returns -1 when the stream did not make sense.
+ */
+int
+wrap_cmdstream_decode(const void *data, uint32_t size,
+		      struct wrap_cmdstream_stats *stats)
+{
+	const uint32_t *words = data;
+	uint32_t count = size / 4, i = 0;
+	int ret = 0;
+
+	if (!cmdstream_registers)
+		cmdstream_registers = calloc(CMDSTREAM_REGISTERS,
+					     sizeof(uint32_t));
+
+	memset(stats, 0, sizeof(*stats));
+	stats->words = count;
+
+	while (i < count) {
+		uint32_t header = words[i], opcode = header >> 27;
+		uint32_t length = cmdstream_length(header);
+
+		if (!length || ((i + length) > count)) {
+			stats->broken++;
+			ret = -1;
+			break;
+		}
+
+		stats->opcodes[opcode]++;
+
+		switch (opcode) {
+		case CMDSTREAM_LOAD_STATE:
+			cmdstream_states(header, stats);
+			break;
+		case CMDSTREAM_DRAW_2D:
+		case CMDSTREAM_DRAW_PRIMITIVES:
+		case CMDSTREAM_DRAW_INDEXED_PRIMITIVES:
+		case CMDSTREAM_DRAW_INSTANCED:
+			stats->draws++;
+			break;
+		default:
+			break;
+		}
+
+		i += length;
+	}
+
+	wrap_cmdstream_add(&cmdstream_total, stats);
+
+	return ret;
+}
+
+/*
+ * One line for every gpu address in the stream which the address index
+ * knows about.
+ */
+void
+wrap_cmdstream_addresses(const void *data, uint32_t size)
+{
+	const uint32_t *words = data;
+	uint32_t count = size / 4, i = 0, j;
+	char what[32];
+
+	while (i < count) {
+		uint32_t header = words[i], opcode = header >> 27;
+		uint32_t length = cmdstream_length(header);
+
+		if (!length || ((i + length) > count))
+			return;
+
+		switch (opcode) {
+		case CMDSTREAM_LOAD_STATE: {
+			uint32_t address = header & 0xFFFF;
+			uint32_t states = (header >> 16) & 0x3FF;
+
+			if (!states)
+				states = 1024;
+
+			for (j = 0; j < states; j++) {
+				snprintf(what, sizeof(what), "state 0x%05X =",
+					 ((address + j) & 0xFFFF) << 2);
+				hook_address_comment(what, words[i + 1 + j]);
+			}
+			break;
+		}
+		case CMDSTREAM_LINK:
+			hook_address_comment("LINK to", words[i + 1]);
+			break;
+		case CMDSTREAM_CALL:
+			hook_address_comment("CALL to", words[i + 1]);
+			break;
+		default:
+			break;
+		}
+
+		i += length;
+	}
+}
+
+void
+wrap_cmdstream_add(struct wrap_cmdstream_stats *total,
+		   struct wrap_cmdstream_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < CMDSTREAM_OPCODES; i++)
+		total->opcodes[i] += stats->opcodes[i];
+	total->words += stats->words;
+	total->states += stats->states;
+	total->draws += stats->draws;
+	total->broken += stats->broken;
+}
+
+/*
+ * A single line, without the comment markers.
+ */
+void
+wrap_cmdstream_log(struct wrap_cmdstream_stats *stats)
+{
+	int i, first = 1;
+
+	wrap_log("%llu words, %llu draws, %llu states:",
+		 (unsigned long long) stats->words,
+		 (unsigned long long) stats->draws,
+		 (unsigned long long) stats->states);
+
+	for (i = 0; i < CMDSTREAM_OPCODES; i++) {
+		if (!stats->opcodes[i])
+			continue;
+
+		wrap_log("%s %s %llu", first ? "" : ",", cmdstream_names[i],
+			 (unsigned long long) stats->opcodes[i]);
+		first = 0;
+	}
+
+	if (stats->broken)
+		wrap_log(", not understood %llu",
+			 (unsigned long long) stats->broken);
+}
+
+static int
+cmdstream_register_compare(const void *a, const void *b)
+{
+	uint32_t count_a = cmdstream_registers[*(const uint32_t *) a];
+	uint32_t count_b = cmdstream_registers[*(const uint32_t *) b];
+
+	if (count_a > count_b)
+		return -1;
+	if (count_a < count_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Opcode totals and the most written registers, the caller commits.
+ */
+void
+wrap_cmdstream_report(void)
+{
+	uint32_t *ranked;
+	int i, count = 0;
+
+	if (!cmdstream_total.words)
+		return;
+
+	wrap_log("/* viv_wrap: command stream: ");
+	wrap_cmdstream_log(&cmdstream_total);
+	wrap_log(".\n");
+
+	ranked = malloc(CMDSTREAM_REGISTERS * sizeof(uint32_t));
+	if (ranked && cmdstream_registers) {
+		for (i = 0; i < CMDSTREAM_REGISTERS; i++)
+			if (cmdstream_registers[i])
+				ranked[count++] = i;
+
+		qsort(ranked, count, sizeof(uint32_t),
+		      cmdstream_register_compare);
+
+		if (count)
+			wrap_log(" * %d registers written, most often:\n",
+				 count);
+		for (i = 0; (i < count) && (i < CMDSTREAM_RANKED); i++)
+			wrap_log(" *   0x%05X: %u\n", ranked[i] << 2,
+				 cmdstream_registers[ranked[i]]);
+	}
+	free(ranked);
+
+	wrap_log(" */\n");
+}
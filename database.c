@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Kernel database sampler.
+ *
+ * The kernel keeps its own books on every process: video memory, non
+ * paged and contiguous memory, split up further per video memory pool,
+ * and how long the gpu was idle. Every VIV_WRAP_DATABASE_MS, a thread of
+ * ours asks for these, for our own process, straight on the galcore fd,
+ * and logs them. This gives the kernel side view of the footprint,
+ * right next to the trace.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+int wrap_database_ms;
+
+static pthread_mutex_t database_start_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_t database_thread;
+static int database_started;
+static int database_running;
+static int database_stop;
+static int database_atfork_registered;
+
+#define DATABASE_INFO(info) \
+	(unsigned long long) (info).counters.bytes, \
+	(unsigned long long) (info).counters.maxBytes
+
+/*
+ * Returns -1 when the kernel does not know these queries, 1 when galcore
+ * is not open right now.
+ */
+static int
+database_sample(uint64_t *idle)
+{
+	gcsHAL_INTERFACE database, vidmem;
+	uint64_t now;
+	int ret;
+
+	memset(&database, 0, sizeof(database));
+	database.command = gcvHAL_DATABASE;
+	database.u.Database.validProcessID = gcvTRUE;
+	database.u.Database.processID = getpid();
+
+	memset(&vidmem, 0, sizeof(vidmem));
+	vidmem.command = gcvHAL_VIDMEM_DATABASE;
+	vidmem.u.VidMemDatabase.validProcessID = gcvTRUE;
+	vidmem.u.VidMemDatabase.processID = getpid();
+
+	now = wrap_time();
+
+	ret = wrap_galcore_query(&database);
+	if (ret)
+		return ret;
+
+	/* older kernels do not split up video memory. */
+	if (wrap_galcore_query(&vidmem))
+		vidmem.command = 0;
+
+	/* one line per sample, current/max bytes. */
+	wrap_log("/* viv_wrap: kernel database @%llu.%09llus: vidMem %llu/%llu, "
+		 "nonPaged %llu/%llu, contiguous %llu/%llu",
+		 (unsigned long long) now / 1000000000,
+		 (unsigned long long) now % 1000000000,
+		 DATABASE_INFO(database.u.Database.vidMem),
+		 DATABASE_INFO(database.u.Database.nonPaged),
+		 DATABASE_INFO(database.u.Database.contiguous));
+	if (vidmem.command)
+		wrap_log(", vidMemResv %llu/%llu, vidMemCont %llu/%llu, "
+			 "vidMemVirt %llu/%llu",
+			 DATABASE_INFO(vidmem.u.VidMemDatabase.vidMemResv),
+			 DATABASE_INFO(vidmem.u.VidMemDatabase.vidMemCont),
+			 DATABASE_INFO(vidmem.u.VidMemDatabase.vidMemVirt));
+	wrap_log(", gpu idle %llu (+%llu) */\n",
+		 (unsigned long long) database.u.Database.gpuIdle.time,
+		 (unsigned long long) (*idle ?
+		 database.u.Database.gpuIdle.time - *idle : 0));
+	wrap_log_commit();
+
+	*idle = database.u.Database.gpuIdle.time;
+
+	return 0;
+}
+
+static void *
+database_sampler(void *data)
+{
+	uint64_t idle = 0, next;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/* give the application the time to attach first. */
+	next = wrap_time() + wrap_database_ms * 1000000ULL;
+
+	while (!__atomic_load_n(&database_stop, __ATOMIC_ACQUIRE)) {
+		uint64_t now = wrap_time();
+
+		/* sleep in short steps, so that we stop quickly. */
+		if (now < next) {
+			uint64_t wait = (next - now) / 1000;
+
+			usleep((wait > 100000) ? 100000 : wait);
+			continue;
+		}
+		next += wrap_database_ms * 1000000ULL;
+
+		/* galcore not being there (yet) is fine. */
+		if (database_sample(&idle) < 0) {
+			fprintf(stderr, "viv_wrap: kernel database queries "
+				"failed, no longer sampling.\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Only the forking thread survives, the sampler gets started again with
+ * the next open of galcore.
+ */
+static void
+database_atfork_child(void)
+{
+	pthread_mutex_init(database_start_mutex, NULL);
+	database_started = 0;
+	database_running = 0;
+	database_stop = 0;
+}
+
+/*
+ * Called once galcore is open.
+ */
+void
+wrap_database_start(void)
+{
+	if (!wrap_database_ms)
+		return;
+
+	pthread_mutex_lock(database_start_mutex);
+
+	if (!database_started) {
+		int ret = pthread_create(&database_thread, NULL,
+					 database_sampler, NULL);
+
+		if (ret)
+			fprintf(stderr, "%s: failed to create sampler: %s\n",
+				__func__, strerror(ret));
+		else
+			database_running = 1;
+
+		if (!database_atfork_registered) {
+			pthread_atfork(NULL, NULL, database_atfork_child);
+			database_atfork_registered = 1;
+		}
+
+		database_started = 1;
+	}
+
+	pthread_mutex_unlock(database_start_mutex);
+}
+
+void
+wrap_database_init(void)
+{
+	wrap_database_ms = wrap_getenv_int("VIV_WRAP_DATABASE_MS", 0);
+	if (wrap_database_ms < 0)
+		wrap_database_ms = 0;
+}
+
+/*
+ * The sampler is not started again after this.
+ */
+void
+wrap_database_close(void)
+{
+	pthread_mutex_lock(database_start_mutex);
+
+	if (database_running) {
+		__atomic_store_n(&database_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(database_thread, NULL);
+		database_running = 0;
+	}
+	database_started = 1;
+
+	pthread_mutex_unlock(database_start_mutex);
+}
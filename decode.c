@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Host side tool which renders a binary vivwrap trace as the same text
+ * that the wrapper itself would have produced.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+int
+wrap_log(const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	ret = vprintf(format, args);
+	va_end(args);
+
+	return ret;
+}
+
+/*
+ * The blob store, as written next to the trace by VIV_WRAP_DEDUP.
+ */
+struct decode_blob {
+	uint64_t hash;
+	uint32_t size;
+	const void *data;
+};
+
+static char *decode_store;
+static struct decode_blob *decode_blobs;
+static int decode_blob_count;
+
+static int
+decode_blob_compare(const void *a, const void *b)
+{
+	const struct decode_blob *blob_a = a;
+	const struct decode_blob *blob_b = b;
+
+	if (blob_a->hash < blob_b->hash)
+		return -1;
+	if (blob_a->hash > blob_b->hash)
+		return 1;
+	return 0;
+}
+
+static void
+decode_store_load(const char *trace)
+{
+	struct viv_record_file *header;
+	char *filename;
+	FILE *file;
+	long size, offset;
+
+	filename = malloc(strlen(trace) + 7);
+	if (!filename)
+		return;
+	sprintf(filename, "%s.blobs", trace);
+
+	file = fopen(filename, "r");
+	free(filename);
+	if (!file)
+		return;
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+
+	decode_store = malloc(size);
+	decode_blobs = malloc((size / sizeof(struct viv_blob)) *
+			      sizeof(struct decode_blob));
+	if (!decode_store || !decode_blobs ||
+	    (size < sizeof(struct viv_record_file)) ||
+	    (fread(decode_store, size, 1, file) != 1)) {
+		fprintf(stderr, "%s: failed to read blob store\n", __func__);
+		fclose(file);
+		return;
+	}
+	fclose(file);
+
+	header = (struct viv_record_file *) decode_store;
+	if (memcmp(header->magic, VIV_BLOB_MAGIC, sizeof(VIV_BLOB_MAGIC)) ||
+	    (header->version != VIV_RECORD_VERSION) ||
+	    (header->header_size != sizeof(struct viv_blob))) {
+		fprintf(stderr, "%s: not a usable blob store\n", __func__);
+		return;
+	}
+
+	for (offset = sizeof(struct viv_record_file);
+	     (offset + sizeof(struct viv_blob)) <= size;) {
+		struct viv_blob *blob =
+			(struct viv_blob *) (decode_store + offset);
+
+		offset += sizeof(struct viv_blob);
+		if ((offset + blob->size) > size) {
+			fprintf(stderr, "%s: truncated blob store\n",
+				__func__);
+			break;
+		}
+
+		decode_blobs[decode_blob_count].hash = blob->hash;
+		decode_blobs[decode_blob_count].size = blob->size;
+		decode_blobs[decode_blob_count].data = decode_store + offset;
+		decode_blob_count++;
+
+		offset += VIV_RECORD_ALIGN(blob->size);
+	}
+
+	qsort(decode_blobs, decode_blob_count, sizeof(struct decode_blob),
+	      decode_blob_compare);
+}
+
+static void
+decode_blob_ref(struct viv_blob_ref *ref)
+{
+	struct decode_blob key = { .hash = ref->hash }, *blob = NULL;
+
+	hook_command_buffer_ref(ref);
+
+	if (decode_blob_count)
+		blob = bsearch(&key, decode_blobs, decode_blob_count,
+			       sizeof(struct decode_blob), decode_blob_compare);
+	if (!blob || (blob->size != ref->size))
+		return;
+
+	/* only the first time around, the rest is just as before. */
+	if (ref->count == 1)
+		hook_command_buffer(blob->data, blob->size);
+}
+
+static int
+decode_ioctl(struct viv_record *record, void *payload)
+{
+	gcsHAL_INTERFACE interface;
+	struct wrap_command *entry;
+	const char *hardware;
+
+	if (record->command >= command_table_count) {
+		fprintf(stderr, "%s: unknown command %d\n", __func__,
+			record->command);
+		return -1;
+	}
+	entry = &command_table[record->command];
+
+	hardware = viv_hardware_type(record->hardware);
+	if (!hardware) {
+		fprintf(stderr, "%s: unknown hardware type %d\n",
+			entry->name, record->hardware);
+		return -1;
+	}
+
+	memset(&interface, 0, sizeof(interface));
+	if (record->size > sizeof(interface.u)) {
+		fprintf(stderr, "%s: record too large: %d\n", entry->name,
+			record->size);
+		return -1;
+	}
+	memcpy(&interface.u, payload, record->size);
+
+	/* so that later addresses can be looked up. */
+	interface.command = entry->command;
+
+	if ((record->type == VIV_RECORD_PRE) &&
+	    (record->flags & VIV_RECORD_FLAG_DEFERRED)) {
+		wrap_log("\tdeferred ");
+		if (entry->pre(entry->name, hardware, &interface.u))
+			wrap_log("%s(%s);\n", entry->name, hardware);
+
+		/* queued frees, as the wrapper applies them. */
+		wrap_address_update(&interface);
+		return 0;
+	}
+
+	if (record->type == VIV_RECORD_PRE)
+		return entry->pre(entry->name, hardware, &interface.u);
+
+	interface.status = record->status;
+	if (!record->ret && (record->status >= 0))
+		wrap_address_update(&interface);
+
+	if (entry->post(entry->name, hardware, &interface.u, record->ret))
+		return -1;
+
+	hook_timing(record->timestamp, record->duration);
+	return 0;
+}
+
+static void
+decode_record(struct viv_record *record, void *payload)
+{
+	switch (record->type) {
+	case VIV_RECORD_PRE:
+	case VIV_RECORD_POST:
+		if (decode_ioctl(record, payload))
+			fprintf(stderr, "%s: failed to decode %s record.\n",
+				__func__, (record->type == VIV_RECORD_PRE) ?
+				"pre" : "post");
+		break;
+	case VIV_RECORD_TEXT:
+		fwrite(payload, record->size, 1, stdout);
+		break;
+	case VIV_RECORD_BLOB:
+		/* the opcode counts follow as text. */
+		if (record->command == gcvHAL_COMMIT)
+			hook_command_buffer(payload, record->size);
+		break;
+	case VIV_RECORD_BLOB_REF:
+		if (record->size >= sizeof(struct viv_blob_ref))
+			decode_blob_ref(payload);
+		break;
+	case VIV_RECORD_DELTA:
+		/* the redundant count follows as text. */
+		wrap_delta_log(payload, record->size /
+			       sizeof(struct wrap_delta_record));
+		break;
+	default:
+		fprintf(stderr, "%s: unknown record type %d\n",
+			__func__, record->type);
+		break;
+	}
+}
+
+static int
+decode_header(struct viv_record_file *header)
+{
+	if ((header->version != VIV_RECORD_VERSION) ||
+	    (header->header_size != sizeof(struct viv_record))) {
+		fprintf(stderr, "%s: unsupported trace version %d\n", __func__,
+			header->version);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+decode_stream(FILE *file)
+{
+	struct viv_record record;
+	char *payload = NULL;
+	int payload_size = 0;
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		int size = VIV_RECORD_ALIGN(record.size);
+
+		if (size > payload_size) {
+			payload = realloc(payload, size);
+			if (!payload) {
+				fprintf(stderr, "%s: failed to allocate %d "
+					"bytes\n", __func__, size);
+				return -1;
+			}
+			payload_size = size;
+		}
+
+		if (size && (fread(payload, size, 1, file) != 1)) {
+			fprintf(stderr, "%s: truncated record\n", __func__);
+			break;
+		}
+
+		decode_record(&record, payload);
+	}
+
+	free(payload);
+
+	return 0;
+}
+
+/*
+ * Memory mapped traces can end in a torn state, everything up to
+ * committed is complete, and we carry on past it for as long as the
+ * frames make sense.
+ */
+static int
+decode_map(FILE *file)
+{
+	struct viv_record_mmap *map;
+	struct stat stat;
+	uint64_t offset, end;
+
+	if (fstat(fileno(file), &stat)) {
+		fprintf(stderr, "%s: failed to stat trace: %s\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+
+	map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to map trace: %s\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+
+	end = map->reserved;
+	if (end > map->size)
+		end = map->size;
+	if (end > stat.st_size)
+		end = stat.st_size;
+
+	for (offset = map->data;
+	     (offset + sizeof(struct viv_record_frame)) <= end;) {
+		struct viv_record_frame *frame =
+			(struct viv_record_frame *) ((char *) map + offset);
+		struct viv_record *record = (struct viv_record *) (frame + 1);
+
+		if ((frame->length < (sizeof(struct viv_record_frame) +
+				      sizeof(struct viv_record))) ||
+		    ((offset + frame->length) > end)) {
+			fprintf(stderr, "%s: torn record at 0x%llX, stopping.\n",
+				__func__, (unsigned long long) offset);
+			break;
+		}
+
+		if (frame->commit != VIV_RECORD_COMMITTED)
+			fprintf(stderr, "%s: incomplete record at 0x%llX.\n",
+				__func__, (unsigned long long) offset);
+		else
+			decode_record(record, record + 1);
+
+		offset += frame->length;
+	}
+
+	fprintf(stderr, "%s: %llu of %llu bytes committed, %u records "
+		"dropped.\n", __func__, (unsigned long long) map->committed,
+		(unsigned long long) map->size, map->dropped);
+
+	munmap(map, stat.st_size);
+
+	return 0;
+}
+
+static int
+decode(FILE *file)
+{
+	struct viv_record_file header;
+
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		fprintf(stderr, "%s: failed to read file header\n", __func__);
+		return -1;
+	}
+
+	if (!memcmp(header.magic, VIV_RECORD_MAGIC, sizeof(VIV_RECORD_MAGIC))) {
+		if (decode_header(&header))
+			return -1;
+		return decode_stream(file);
+	}
+
+	if (!memcmp(header.magic, VIV_RECORD_MMAP_MAGIC,
+		    sizeof(VIV_RECORD_MMAP_MAGIC))) {
+		if (decode_header(&header))
+			return -1;
+		if (file == stdin) {
+			fprintf(stderr, "%s: mapped traces can not be read "
+				"from stdin.\n", __func__);
+			return -1;
+		}
+		return decode_map(file);
+	}
+
+	fprintf(stderr, "%s: not a vivwrap trace\n", __func__);
+	return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *file;
+	int ret;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [trace]\n", argv[0]);
+		return -1;
+	}
+
+	if (argc == 2) {
+		file = fopen(argv[1], "r");
+		if (!file) {
+			fprintf(stderr, "Error: failed to open %s: %s\n",
+				argv[1], strerror(errno));
+			return -1;
+		}
+		decode_store_load(argv[1]);
+	} else
+		file = stdin;
+
+	wrap_address_enabled = 1;
+
+	ret = decode(file);
+
+	if (file != stdin)
+		fclose(file);
+
+	return ret;
+}
@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Deduplication of captured command buffers.
+ *
+ * Every captured command stream gets hashed, 64 bits at a time. A stream
+ * which was not seen before gets written to a side file, the blob store,
+ * which sits next to the log with .blobs appended to its name. The trace
+ * itself only gets a reference: hash, size and how many times this
+ * stream was submitted so far. A UI which keeps on submitting the same
+ * frame then only costs a reference per commit.
+ *
+ * A hash which is already known, but for a stream of a different size, is
+ * a collision, and such a stream gets logged in full instead.
+ *
+ * New streams get copied, and the log writer thread writes them to the
+ * store, so the committing thread never blocks on it. Should a write
+ * fail, the store is cut back to the last complete stream and closed,
+ * and whatever did not make it, as well as every new stream after that,
+ * gets logged in full again. References which were already logged for a
+ * stream which never made it to the store are left dangling.
+ *
+ * The reserved tail is left out here, it holds whatever the kernel put
+ * there last time, and would make identical streams differ.
+ *
+ * Frames in which every single commit was a repeat are counted, those
+ * could have been skipped altogether.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define DEDUP_RANKED 16
+
+struct dedup_entry {
+	uint64_t hash; /* 0 when empty. */
+	uint32_t size;
+	uint32_t count;
+	unsigned int first_frame;
+	unsigned int last_frame;
+	int failed; /* never made it to the store. */
+};
+
+/* a new stream, waiting for the writer. */
+struct dedup_pending {
+	struct dedup_pending *next;
+	uint64_t hash;
+	uint32_t size;
+	char data[];
+};
+
+int wrap_dedup_enabled;
+
+static pthread_mutex_t dedup_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+/* the store is only touched with this held, never with the mutex. */
+static pthread_mutex_t dedup_write_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static int dedup_fd = -1;
+static off_t dedup_written; /* up to the end of the last complete stream. */
+
+static struct dedup_pending *dedup_pending;
+static struct dedup_pending **dedup_pending_last = &dedup_pending;
+static int dedup_broken; /* the store failed. */
+
+static struct dedup_entry *dedup_table;
+static unsigned int dedup_size; /* a power of two. */
+static unsigned int dedup_count;
+
+static uint64_t dedup_submissions;
+static uint64_t dedup_bytes; /* submitted. */
+static uint64_t dedup_stored; /* bytes written to the store. */
+static uint64_t dedup_collisions; /* same hash, different size. */
+static uint64_t dedup_unstored; /* logged in full, as the store failed. */
+
+static unsigned int dedup_frame;
+static int dedup_frame_new; /* something new was submitted. */
+static int dedup_frame_seen; /* anything was submitted. */
+static uint64_t dedup_frames;
+static uint64_t dedup_static;
+
+static uint64_t
+dedup_hash(const void *data, uint32_t size)
+{
+	const uint8_t *bytes = data;
+	uint64_t hash = 0xCBF29CE484222325ULL, word;
+	uint32_t i;
+
+	for (i = 0; (i + 8) <= size; i += 8) {
+		memcpy(&word, bytes + i, 8);
+		hash ^= word;
+		hash *= 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+
+	if (i < size) {
+		word = 0;
+		memcpy(&word, bytes + i, size - i);
+		hash ^= word;
+		hash *= 0x100000001B3ULL;
+	}
+
+	hash ^= size;
+	hash *= 0x9E3779B97F4A7C15ULL;
+	hash ^= hash >> 32;
+
+	/* 0 marks an empty slot. */
+	if (!hash)
+		hash = 1;
+
+	return hash;
+}
+
+static struct dedup_entry *
+dedup_slot(struct dedup_entry *table, unsigned int size, uint64_t hash)
+{
+	unsigned int index = hash & (size - 1);
+
+	while (table[index].hash && (table[index].hash != hash))
+		index = (index + 1) & (size - 1);
+
+	return &table[index];
+}
+
+static int
+dedup_grow(void)
+{
+	unsigned int size = dedup_size ? dedup_size * 2 : 1024, i;
+	struct dedup_entry *table = calloc(size, sizeof(struct dedup_entry));
+
+	if (!table) {
+		fprintf(stderr, "%s: failed to grow table\n", __func__);
+		return -1;
+	}
+
+	for (i = 0; i < dedup_size; i++)
+		if (dedup_table[i].hash)
+			*dedup_slot(table, size, dedup_table[i].hash) =
+				dedup_table[i];
+
+	free(dedup_table);
+	dedup_table = table;
+	dedup_size = size;
+
+	return 0;
+}
+
+static int
+dedup_write(const void *data, int size)
+{
+	const char *buffer = data;
+
+	while (size) {
+		int ret = write(dedup_fd, buffer, size);
+
+		if (ret <= 0) {
+			if ((ret == -1) && (errno == EINTR))
+				continue;
+			fprintf(stderr, "%s: failed to write blob store: %s\n",
+				__func__, ret ? strerror(errno) : "short write");
+			return -1;
+		}
+
+		buffer += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Call with the write mutex held.
+ */
+static int
+dedup_store(struct dedup_pending *pending)
+{
+	static const char padding[8];
+	struct viv_blob blob = {
+		.hash = pending->hash,
+		.size = pending->size,
+	};
+	uint32_t size = pending->size;
+
+	if (dedup_fd == -1)
+		return -1;
+
+	if (dedup_write(&blob, sizeof(blob)) ||
+	    dedup_write(pending->data, size) ||
+	    dedup_write(padding, VIV_RECORD_ALIGN(size) - size))
+		return -1;
+
+	dedup_written += sizeof(blob) + VIV_RECORD_ALIGN(size);
+	return 0;
+}
+
+/*
+ * Call with the write mutex held. Cuts off the torn stream, and gives up
+ * on the store altogether.
+ */
+static void
+dedup_fail(uint64_t hash)
+{
+	struct dedup_entry *entry;
+
+	if (dedup_fd != -1) {
+		if (ftruncate(dedup_fd, dedup_written))
+			fprintf(stderr, "%s: failed to truncate blob store: "
+				"%s\n", __func__, strerror(errno));
+		close(dedup_fd);
+		dedup_fd = -1;
+		fprintf(stderr, "viv_wrap: blob store failed, logging "
+			"command buffers in full.\n");
+	}
+
+	pthread_mutex_lock(dedup_mutex);
+	dedup_broken = 1;
+	entry = dedup_slot(dedup_table, dedup_size, hash);
+	if (entry->hash)
+		entry->failed = 1;
+	pthread_mutex_unlock(dedup_mutex);
+}
+
+/*
+ * Called by the log writer thread, and at close.
+ */
+void
+wrap_dedup_flush(void)
+{
+	struct dedup_pending *pending;
+
+	if (!__atomic_load_n(&dedup_pending, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(dedup_write_mutex);
+
+	pthread_mutex_lock(dedup_mutex);
+	pending = dedup_pending;
+	dedup_pending = NULL;
+	dedup_pending_last = &dedup_pending;
+	pthread_mutex_unlock(dedup_mutex);
+
+	while (pending) {
+		struct dedup_pending *next = pending->next;
+
+		if (!dedup_store(pending)) {
+			pthread_mutex_lock(dedup_mutex);
+			dedup_stored += pending->size;
+			pthread_mutex_unlock(dedup_mutex);
+		} else
+			dedup_fail(pending->hash);
+
+		free(pending);
+		pending = next;
+	}
+
+	pthread_mutex_unlock(dedup_write_mutex);
+}
+
+/*
+ * Call with the mutex held.
+ */
+static void
+dedup_frame_update(unsigned int frame, int new)
+{
+	if (frame != dedup_frame) {
+		if (dedup_frame_seen) {
+			dedup_frames++;
+			if (!dedup_frame_new)
+				dedup_static++;
+		}
+
+		dedup_frame = frame;
+		dedup_frame_new = 0;
+		dedup_frame_seen = 0;
+	}
+
+	dedup_frame_seen = 1;
+	if (new)
+		dedup_frame_new = 1;
+}
+
+/*
+ * Takes the place of the blob or hex dump of a captured command buffer.
+ * Returns -1 when the caller has to log the command buffer itself.
+ */
+int
+wrap_dedup_add(int hardware, const void *data, uint32_t size)
+{
+	unsigned int frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	uint64_t hash = dedup_hash(data, size);
+	struct dedup_entry *entry;
+	struct viv_blob_ref ref;
+
+	pthread_mutex_lock(dedup_mutex);
+
+	if (((dedup_count + 1) * 2) > dedup_size)
+		dedup_grow();
+
+	if (!dedup_size) {
+		pthread_mutex_unlock(dedup_mutex);
+		return -1;
+	}
+
+	entry = dedup_slot(dedup_table, dedup_size, hash);
+	if (entry->hash && (entry->size != size)) {
+		dedup_collisions++;
+		pthread_mutex_unlock(dedup_mutex);
+		return -1;
+	}
+
+	if (entry->failed || (!entry->hash && dedup_broken)) {
+		dedup_unstored++;
+		pthread_mutex_unlock(dedup_mutex);
+		return -1;
+	}
+
+	if (!entry->hash) {
+		struct dedup_pending *pending =
+			malloc(sizeof(struct dedup_pending) + size);
+
+		if (!pending) {
+			pthread_mutex_unlock(dedup_mutex);
+			return -1;
+		}
+
+		pending->next = NULL;
+		pending->hash = hash;
+		pending->size = size;
+		memcpy(pending->data, data, size);
+		*dedup_pending_last = pending;
+		dedup_pending_last = &pending->next;
+
+		entry->hash = hash;
+		entry->size = size;
+		entry->first_frame = frame;
+		dedup_count++;
+	}
+
+	dedup_frame_update(frame, !entry->count);
+
+	entry->count++;
+	entry->last_frame = frame;
+
+	dedup_submissions++;
+	dedup_bytes += size;
+
+	ref.hash = hash;
+	ref.size = size;
+	ref.count = entry->count;
+
+	pthread_mutex_unlock(dedup_mutex);
+
+	if (wrap_log_binary) {
+		struct viv_record record = {
+			.size = sizeof(ref),
+			.type = VIV_RECORD_BLOB_REF,
+			.command = gcvHAL_COMMIT,
+			.hardware = hardware,
+		};
+
+		wrap_log_record(&record, &ref);
+	} else
+		hook_command_buffer_ref(&ref);
+
+	return 0;
+}
+
+static int
+dedup_compare(const void *a, const void *b)
+{
+	const struct dedup_entry *entry_a = *(struct dedup_entry * const *) a;
+	const struct dedup_entry *entry_b = *(struct dedup_entry * const *) b;
+
+	if (entry_a->count > entry_b->count)
+		return -1;
+	if (entry_a->count < entry_b->count)
+		return 1;
+	return 0;
+}
+
+void
+viv_wrap_dedup_stats(void)
+{
+	struct dedup_entry **ranked;
+	unsigned int i, count = 0;
+
+	if (!wrap_dedup_enabled)
+		return;
+
+	pthread_mutex_lock(dedup_mutex);
+
+	wrap_log("/* viv_wrap: command buffer store: %llu submissions, %u "
+		 "unique, %llu bytes submitted, %llu bytes stored; %llu of "
+		 "%llu frames only submitted repeats.\n",
+		 (unsigned long long) dedup_submissions, dedup_count,
+		 (unsigned long long) dedup_bytes,
+		 (unsigned long long) dedup_stored,
+		 (unsigned long long) dedup_static,
+		 (unsigned long long) dedup_frames);
+
+	if (dedup_collisions)
+		wrap_log(" * %llu hash collisions, logged as they were.\n",
+			 (unsigned long long) dedup_collisions);
+	if (dedup_broken)
+		wrap_log(" * the store failed, %llu submissions were logged as "
+			 "they were.\n", (unsigned long long) dedup_unstored);
+
+	ranked = malloc(dedup_count * sizeof(struct dedup_entry *));
+	if (ranked) {
+		for (i = 0; i < dedup_size; i++)
+			if (dedup_table[i].hash && (dedup_table[i].count > 1))
+				ranked[count++] = &dedup_table[i];
+
+		qsort(ranked, count, sizeof(struct dedup_entry *),
+		      dedup_compare);
+
+		if (count)
+			wrap_log(" * submitted repeatedly:\n");
+		for (i = 0; (i < count) && (i < DEDUP_RANKED); i++)
+			wrap_log(" *   0x%016llX, 0x%X bytes: %u times, frames "
+				 "%u - %u\n",
+				 (unsigned long long) ranked[i]->hash,
+				 ranked[i]->size, ranked[i]->count,
+				 ranked[i]->first_frame, ranked[i]->last_frame);
+	}
+	free(ranked);
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	pthread_mutex_unlock(dedup_mutex);
+}
+
+/*
+ * Only at exit, the frame in flight gets counted, and the store written
+ * out and closed.
+ */
+void
+wrap_dedup_close(void)
+{
+	if (!wrap_dedup_enabled)
+		return;
+
+	pthread_mutex_lock(dedup_mutex);
+	if (dedup_frame_seen) {
+		dedup_frame_update(dedup_frame + 1, 0);
+		dedup_frame_seen = 0;
+	}
+	pthread_mutex_unlock(dedup_mutex);
+
+	wrap_dedup_flush();
+
+	viv_wrap_dedup_stats();
+
+	pthread_mutex_lock(dedup_write_mutex);
+	if (dedup_fd != -1) {
+		close(dedup_fd);
+		dedup_fd = -1;
+	}
+	pthread_mutex_unlock(dedup_write_mutex);
+}
+
+void
+wrap_dedup_init(void)
+{
+	struct viv_record_file header = {
+		.magic = VIV_BLOB_MAGIC,
+		.version = VIV_RECORD_VERSION,
+		.header_size = sizeof(struct viv_blob),
+	};
+	char *log, *filename;
+
+	wrap_dedup_enabled = wrap_getenv_int("VIV_WRAP_DEDUP", 0);
+	if (!wrap_dedup_enabled)
+		return;
+
+	log = getenv("VIV_WRAP_LOG");
+	if (!log)
+		log = "/tmp/viv_wrap.log";
+
+	filename = malloc(strlen(log) + 7);
+	if (!filename) {
+		fprintf(stderr, "%s: failed to allocate filename\n", __func__);
+		wrap_dedup_enabled = 0;
+		return;
+	}
+	sprintf(filename, "%s.blobs", log);
+
+	dedup_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644);
+	if (dedup_fd == -1) {
+		fprintf(stderr, "Error: failed to open blob store %s: %s\n",
+			filename, strerror(errno));
+		wrap_dedup_enabled = 0;
+		free(filename);
+		return;
+	}
+
+	printf("viv_wrap: command buffer store in %s.\n", filename);
+	free(filename);
+
+	if (dedup_write(&header, sizeof(header))) {
+		close(dedup_fd);
+		dedup_fd = -1;
+		wrap_dedup_enabled = 0;
+		return;
+	}
+	dedup_written = sizeof(header);
+
+	/* so that there is a writer thread to fill the store. */
+	wrap_log_start();
+}
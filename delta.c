@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * State delta tracking.
+ *
+ * With every COMMIT, user space hands the kernel a gcsSTATE_DELTA: the
+ * states it changed since the last one, which the kernel then merges
+ * into the context buffer. Here, we keep our own copy of every state, and
+ * count the records which set a state to the value it already had. Masked
+ * records only touch the masked bits, just like in the kernel.
+ *
+ * We only know the bits which were written at some point, the rest of a
+ * state is whatever the context buffer started out with. A record only
+ * counts as redundant when every bit it touches is known.
+ *
+ * Shared by the wrapper and vivwrap-decode, callers serialize.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wrap.h"
+
+#define DELTA_STATES 0x10000
+#define DELTA_RANKED 16
+
+struct delta_state {
+	uint32_t value;
+	uint32_t known; /* mask of the bits which were written. */
+	uint32_t writes;
+	uint32_t redundant;
+};
+
+int wrap_delta_enabled;
+
+static struct delta_state *delta_states;
+
+static uint64_t delta_commits;
+static uint64_t delta_records;
+static uint64_t delta_redundant;
+
+/*
+ * Returns how many of the records were redundant.
+ */
+int
+wrap_delta_apply(const struct wrap_delta_record *records, uint32_t count)
+{
+	uint32_t i;
+	int redundant = 0;
+
+	if (!delta_states) {
+		delta_states = calloc(DELTA_STATES, sizeof(struct delta_state));
+		if (!delta_states) {
+			fprintf(stderr, "%s: failed to allocate states\n",
+				__func__);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		struct delta_state *state;
+		uint32_t mask = records[i].mask;
+
+		if (records[i].address >= DELTA_STATES)
+			continue;
+		state = &delta_states[records[i].address];
+
+		if (!mask)
+			mask = ~0U;
+
+		if (((state->known & mask) == mask) &&
+		    !((state->value ^ records[i].data) & mask)) {
+			state->redundant++;
+			redundant++;
+		}
+
+		state->value = (state->value & ~mask) |
+			(records[i].data & mask);
+		state->known |= mask;
+		state->writes++;
+	}
+
+	delta_commits++;
+	delta_records += count;
+	delta_redundant += redundant;
+
+	return redundant;
+}
+
+/*
+ * The records themselves, four to a line, followed by the values which
+ * are known gpu addresses.
+ */
+void
+wrap_delta_log(const struct wrap_delta_record *records, uint32_t count)
+{
+	uint32_t i;
+
+	wrap_log("\t/* state delta, %u records:\n", count);
+
+	for (i = 0; i < count; i++) {
+		const struct wrap_delta_record *record = &records[i];
+
+		if (!(i & 3))
+			wrap_log("\t *");
+
+		if (!record->mask || (record->mask == ~0U))
+			wrap_log(" 0x%05X = 0x%08X;", record->address << 2,
+				 record->data);
+		else
+			wrap_log(" 0x%05X = 0x%08X & 0x%08X;",
+				 record->address << 2, record->data,
+				 record->mask);
+
+		if (((i & 3) == 3) || (i == (count - 1)))
+			wrap_log("\n");
+	}
+
+	wrap_log("\t */\n");
+
+	/* masked writes are never addresses. */
+	for (i = 0; i < count; i++) {
+		char what[32];
+
+		if (records[i].mask && (records[i].mask != ~0U))
+			continue;
+
+		snprintf(what, sizeof(what), "state 0x%05X =",
+			 records[i].address << 2);
+		hook_address_comment(what, records[i].data);
+	}
+}
+
+static int
+delta_compare(const void *a, const void *b)
+{
+	uint32_t count_a = delta_states[*(const uint32_t *) a].redundant;
+	uint32_t count_b = delta_states[*(const uint32_t *) b].redundant;
+
+	if (count_a > count_b)
+		return -1;
+	if (count_a < count_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Redundant writes in total and per state, the caller commits.
+ */
+void
+wrap_delta_report(void)
+{
+	uint32_t *ranked;
+	int i, count = 0;
+
+	if (!delta_commits)
+		return;
+
+	wrap_log("/* viv_wrap: state deltas: %llu commits, %llu records, "
+		 "%llu redundant (%llu%%), %llu bytes of redundant records.\n",
+		 (unsigned long long) delta_commits,
+		 (unsigned long long) delta_records,
+		 (unsigned long long) delta_redundant,
+		 (unsigned long long) (delta_records ?
+		 delta_redundant * 100 / delta_records : 0),
+		 (unsigned long long) delta_redundant *
+		 sizeof(struct wrap_delta_record));
+
+	ranked = malloc(DELTA_STATES * sizeof(uint32_t));
+	if (ranked && delta_states) {
+		for (i = 0; i < DELTA_STATES; i++)
+			if (delta_states[i].redundant)
+				ranked[count++] = i;
+
+		qsort(ranked, count, sizeof(uint32_t), delta_compare);
+
+		if (count)
+			wrap_log(" * %d states rewritten with the same value, "
+				 "most often:\n", count);
+		for (i = 0; (i < count) && (i < DELTA_RANKED); i++) {
+			struct delta_state *state = &delta_states[ranked[i]];
+
+			wrap_log(" *   0x%05X: %u of %u writes\n",
+				 ranked[i] << 2, state->redundant,
+				 state->writes);
+		}
+	}
+	free(ranked);
+
+	wrap_log(" */\n");
+}
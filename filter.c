@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Command filter.
+ *
+ * VIV_WRAP_FILTER is a comma separated list of command names, as they
+ * appear in the log. Listed commands are traced, commands prefixed with a
+ * '-' are not. When only exclusions are given, everything else is traced.
+ * hw=<type> limits tracing to the given hardware type(s). For instance:
+ *
+ *     VIV_WRAP_FILTER="COMMIT,ATTACH,-USER_SIGNAL,hw=3D"
+ *
+ * This gets turned into one byte per command, with a bit per hardware
+ * type, once, so the ioctl path only has to look up a single bit.
+ *
+ * VIV_WRAP_SAMPLE then thins out what is left, per command: either one in
+ * N calls, or at most M calls per second, for instance:
+ *
+ *     VIV_WRAP_SAMPLE="LOCK_VIDEO_MEMORY=100,USER_SIGNAL=50/s"
+ *
+ * Commands without a policy are not sampled. All calls to sampled
+ * commands are counted, and the totals are logged at exit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wrap.h"
+
+#define FILTER_HARDWARE_ALL 0x1E /* hardware types 1-4 */
+
+unsigned char *wrap_filter;
+
+struct wrap_sample {
+	unsigned int every; /* 1 in every N calls. */
+	unsigned int rate; /* at most this many calls per second. */
+
+	unsigned int count; /* calls this second, for rate. */
+	uint64_t second;
+
+	uint64_t calls;
+	uint64_t traced;
+};
+
+struct wrap_sample *wrap_sample;
+
+static int
+filter_command(const char *name)
+{
+	int i;
+
+	for (i = 0; i < command_table_count; i++)
+		if (!strcasecmp(name, command_table[i].name))
+			return i;
+
+	return -1;
+}
+
+static int
+filter_hardware(const char *name)
+{
+	int i;
+
+	for (i = 1; i < 5; i++)
+		if (!strcasecmp(name, viv_hardware_type(i)))
+			return 1 << i;
+
+	return 0;
+}
+
+void
+wrap_filter_init(void)
+{
+	char *string = getenv("VIV_WRAP_FILTER"), *copy, *token, *save;
+	unsigned char hardware = 0, initial = FILTER_HARDWARE_ALL;
+	int count = 0, i;
+
+	if (!string || !string[0])
+		return;
+
+	copy = strdup(string);
+	wrap_filter = calloc(command_table_count, 1);
+	if (!copy || !wrap_filter) {
+		fprintf(stderr, "%s: failed to allocate filter\n", __func__);
+		exit(-1);
+	}
+
+	/* listing any command means that only those get traced. */
+	for (token = strtok_r(copy, ",", &save); token;
+	     token = strtok_r(NULL, ",", &save))
+		if ((token[0] != '-') && strncasecmp(token, "hw=", 3))
+			initial = 0;
+	strcpy(copy, string);
+
+	for (i = 0; i < command_table_count; i++)
+		wrap_filter[i] = initial;
+
+	for (token = strtok_r(copy, ",", &save); token;
+	     token = strtok_r(NULL, ",", &save)) {
+		int command;
+
+		if (!strncasecmp(token, "hw=", 3)) {
+			int bit = filter_hardware(token + 3);
+
+			if (!bit)
+				fprintf(stderr, "viv_wrap: filter: unknown "
+					"hardware type \"%s\"\n", token + 3);
+			hardware |= bit;
+			continue;
+		}
+
+		command = filter_command(token[0] == '-' ? token + 1 : token);
+		if (command == -1) {
+			fprintf(stderr, "viv_wrap: filter: unknown command "
+				"\"%s\"\n", token);
+			continue;
+		}
+
+		if (token[0] == '-')
+			wrap_filter[command] = 0;
+		else
+			wrap_filter[command] = FILTER_HARDWARE_ALL;
+	}
+
+	if (hardware)
+		for (i = 0; i < command_table_count; i++)
+			wrap_filter[i] &= hardware;
+
+	for (i = 0; i < command_table_count; i++)
+		if (wrap_filter[i])
+			count++;
+
+	printf("viv_wrap: filter \"%s\": tracing %d of %d commands.\n",
+	       string, count, command_table_count);
+
+	free(copy);
+}
+
+/*
+ * Only called for traced commands, when sampling is enabled.
+ */
+int
+wrap_sample_traced(int command)
+{
+	struct wrap_sample *sample;
+	uint64_t calls;
+
+	if (command >= command_table_count)
+		return 1;
+
+	sample = &wrap_sample[command];
+	if (!sample->every && !sample->rate)
+		return 1;
+
+	calls = __atomic_fetch_add(&sample->calls, 1, __ATOMIC_RELAXED);
+
+	if (sample->every) {
+		if (calls % sample->every)
+			return 0;
+	} else {
+		uint64_t now = wrap_time() / 1000000000;
+		uint64_t second = __atomic_load_n(&sample->second,
+						  __ATOMIC_RELAXED);
+
+		/* whoever wins the race starts the new second. */
+		if ((second != now) &&
+		    __atomic_compare_exchange_n(&sample->second, &second, now,
+						0, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			__atomic_store_n(&sample->count, 0, __ATOMIC_RELAXED);
+
+		if (__atomic_fetch_add(&sample->count, 1, __ATOMIC_RELAXED) >=
+		    sample->rate)
+			return 0;
+	}
+
+	__atomic_fetch_add(&sample->traced, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+void
+wrap_sample_init(void)
+{
+	char *string = getenv("VIV_WRAP_SAMPLE"), *copy, *token, *save;
+
+	if (!string || !string[0])
+		return;
+
+	copy = strdup(string);
+	wrap_sample = calloc(command_table_count, sizeof(struct wrap_sample));
+	if (!copy || !wrap_sample) {
+		fprintf(stderr, "%s: failed to allocate sampling\n", __func__);
+		exit(-1);
+	}
+
+	for (token = strtok_r(copy, ",", &save); token;
+	     token = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(token, '='), *end;
+		unsigned long number;
+		int command;
+
+		if (!value) {
+			fprintf(stderr, "viv_wrap: sample: missing policy for "
+				"\"%s\"\n", token);
+			continue;
+		}
+		*value++ = 0;
+
+		command = filter_command(token);
+		if (command == -1) {
+			fprintf(stderr, "viv_wrap: sample: unknown command "
+				"\"%s\"\n", token);
+			continue;
+		}
+
+		number = strtoul(value, &end, 0);
+		if (!number || (*end && strcmp(end, "/s"))) {
+			fprintf(stderr, "viv_wrap: sample: invalid policy "
+				"\"%s\" for %s\n", value, token);
+			continue;
+		}
+
+		if (*end)
+			wrap_sample[command].rate = number;
+		else
+			wrap_sample[command].every = number;
+	}
+
+	free(copy);
+}
+
+/*
+ * Calls to sampled commands are counted exactly, log the totals.
+ */
+void
+wrap_sample_report(void)
+{
+	int i;
+
+	if (!wrap_sample)
+		return;
+
+	wrap_log("/* viv_wrap: sampling:\n");
+
+	for (i = 0; i < command_table_count; i++) {
+		struct wrap_sample *sample = &wrap_sample[i];
+
+		if (sample->every)
+			wrap_log(" * %s: %llu calls, %llu traced (1 in %u)\n",
+				 command_table[i].name,
+				 (unsigned long long) sample->calls,
+				 (unsigned long long) sample->traced,
+				 sample->every);
+		else if (sample->rate)
+			wrap_log(" * %s: %llu calls, %llu traced (%u/s)\n",
+				 command_table[i].name,
+				 (unsigned long long) sample->calls,
+				 (unsigned long long) sample->traced,
+				 sample->rate);
+	}
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+}
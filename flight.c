@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Flight recorder.
+ *
+ * Each thread keeps its last few ioctls in a small ring of fixed size
+ * binary records, nothing gets formatted or written out. Only when
+ * something interesting happens, the rings of all threads are dumped, in
+ * timestamp order, to the log.
+ *
+ * Dumps are triggered by SIGUSR1, by fatal signals, by ioctls which fail,
+ * or by calling viv_wrap_flight_dump(). Dumping only uses async signal
+ * safe calls, and never waits for the traced threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define FLIGHT_PAYLOAD_MAX sizeof(((gcsHAL_INTERFACE *) 0)->u)
+#define FLIGHT_DUMP_THREADS 64
+#define FLIGHT_DUMP_BUFFER (64 * 1024)
+#define FLIGHT_ERROR_HOLDOFF 1000000000ULL /* ns */
+
+struct flight_slot {
+	unsigned int sequence; /* odd while being written. */
+	struct viv_record record;
+	char payload[FLIGHT_PAYLOAD_MAX];
+};
+
+struct wrap_flight {
+	unsigned int count; /* a power of two. */
+	unsigned int head;
+
+	struct flight_slot slots[];
+};
+
+int wrap_flight_size;
+
+static int flight_fd = -1;
+static int flight_dumping;
+static uint64_t flight_error_last;
+
+static const int flight_fatal_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+};
+static struct sigaction
+flight_fatal_old[sizeof(flight_fatal_signals) / sizeof(int)];
+
+static struct wrap_flight *
+flight_get(struct wrap_thread *thread)
+{
+	struct wrap_flight *flight = thread->flight;
+
+	if (flight)
+		return flight;
+
+	flight = calloc(1, sizeof(struct wrap_flight) +
+			wrap_flight_size * sizeof(struct flight_slot));
+	if (!flight) {
+		fprintf(stderr, "%s: failed to allocate flight recorder\n",
+			__func__);
+		exit(-1);
+	}
+	flight->count = wrap_flight_size;
+
+	__atomic_store_n(&thread->flight, flight, __ATOMIC_RELEASE);
+
+	return flight;
+}
+
+/*
+ * Only ever called by the thread owning the ring.
+ */
+void
+wrap_flight_record(struct viv_record *record, const void *data)
+{
+	struct wrap_thread *thread = wrap_thread_get();
+	struct wrap_flight *flight = flight_get(thread);
+	struct flight_slot *slot;
+	unsigned int sequence, size = record->size;
+
+	if (size > FLIGHT_PAYLOAD_MAX)
+		size = FLIGHT_PAYLOAD_MAX;
+
+	slot = &flight->slots[flight->head & (flight->count - 1)];
+
+	sequence = slot->sequence;
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->record = *record;
+	if (!slot->record.timestamp)
+		slot->record.timestamp = wrap_time();
+	slot->record.size = size;
+	slot->record.tid = thread->tid;
+	memcpy(slot->payload, data, size);
+
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&flight->head, flight->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Dumping.
+ *
+ */
+static char flight_buffer[FLIGHT_DUMP_BUFFER];
+static int flight_buffer_used;
+
+static void
+flight_buffer_flush(void)
+{
+	char *buffer = flight_buffer;
+	int size = flight_buffer_used;
+
+	while (size > 0) {
+		int ret = write(flight_fd, buffer, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		buffer += ret;
+		size -= ret;
+	}
+
+	flight_buffer_used = 0;
+}
+
+/*
+ * Only whole records end up in a single write(), so that this can share
+ * the (O_APPEND) log with the writer thread.
+ */
+static void
+flight_buffer_record(struct viv_record *record, const void *payload)
+{
+	int length = sizeof(struct viv_record) + VIV_RECORD_ALIGN(record->size);
+
+	if ((flight_buffer_used + length) > FLIGHT_DUMP_BUFFER)
+		flight_buffer_flush();
+
+	memcpy(flight_buffer + flight_buffer_used, record,
+	       sizeof(struct viv_record));
+	memcpy(flight_buffer + flight_buffer_used + sizeof(struct viv_record),
+	       payload, record->size);
+	memset(flight_buffer + flight_buffer_used + sizeof(struct viv_record) +
+	       record->size, 0, VIV_RECORD_ALIGN(record->size) - record->size);
+
+	flight_buffer_used += length;
+}
+
+static void
+flight_buffer_text(const char *text)
+{
+	struct viv_record record = {
+		.timestamp = wrap_time(),
+		.size = strlen(text),
+		.type = VIV_RECORD_TEXT,
+	};
+
+	flight_buffer_record(&record, text);
+}
+
+/*
+ * Copies out the slot at index, returns -1 when it was, or got,
+ * overwritten.
+ */
+static int
+flight_slot_copy(struct wrap_flight *flight, unsigned int index,
+		 struct flight_slot *copy)
+{
+	struct flight_slot *slot = &flight->slots[index & (flight->count - 1)];
+	unsigned int sequence;
+
+	sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1)
+		return -1;
+
+	memcpy(copy, slot, sizeof(struct flight_slot));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+		return -1;
+
+	if ((__atomic_load_n(&flight->head, __ATOMIC_ACQUIRE) - index) >
+	    flight->count)
+		return -1;
+
+	return 0;
+}
+
+struct flight_cursor {
+	struct wrap_flight *flight;
+	unsigned int index;
+	unsigned int end;
+	int valid;
+	struct flight_slot slot;
+};
+
+static struct flight_cursor flight_cursors[FLIGHT_DUMP_THREADS];
+
+static void
+flight_cursor_next(struct flight_cursor *cursor)
+{
+	cursor->valid = 0;
+
+	while (cursor->index != cursor->end) {
+		int ret = flight_slot_copy(cursor->flight, cursor->index,
+					   &cursor->slot);
+
+		cursor->index++;
+		if (!ret) {
+			cursor->valid = 1;
+			return;
+		}
+	}
+}
+
+/*
+ * Merges the rings of all threads by timestamp.
+ */
+static void
+flight_dump_threads(void)
+{
+	struct wrap_thread *thread;
+	int count = 0, i;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		struct wrap_flight *flight =
+			__atomic_load_n(&thread->flight, __ATOMIC_ACQUIRE);
+		struct flight_cursor *cursor;
+		unsigned int head;
+
+		if (!flight)
+			continue;
+
+		if (count == FLIGHT_DUMP_THREADS) {
+			flight_buffer_text("/* viv_wrap: too many threads, "
+					   "flight dump is incomplete. */\n");
+			break;
+		}
+
+		head = __atomic_load_n(&flight->head, __ATOMIC_ACQUIRE);
+
+		cursor = &flight_cursors[count];
+		cursor->flight = flight;
+		cursor->end = head;
+		if (head > flight->count)
+			cursor->index = head - flight->count;
+		else
+			cursor->index = 0;
+
+		flight_cursor_next(cursor);
+		count++;
+	}
+
+	while (1) {
+		struct flight_cursor *oldest = NULL;
+
+		for (i = 0; i < count; i++) {
+			struct flight_cursor *cursor = &flight_cursors[i];
+
+			if (!cursor->valid)
+				continue;
+
+			if (!oldest || (cursor->slot.record.timestamp <
+					oldest->slot.record.timestamp))
+				oldest = cursor;
+		}
+
+		if (!oldest)
+			break;
+
+		flight_buffer_record(&oldest->slot.record,
+				     oldest->slot.payload);
+		flight_cursor_next(oldest);
+	}
+}
+
+void
+viv_wrap_flight_dump(const char *reason)
+{
+	char text[128];
+	int busy = 0;
+
+	if (flight_fd == -1)
+		return;
+
+	/* someone else is already dumping, that will do. */
+	if (!__atomic_compare_exchange_n(&flight_dumping, &busy, 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* no snprintf, this is called from signal handlers. */
+	strcpy(text, "/* viv_wrap: flight recorder dump: ");
+	strncat(text, reason, sizeof(text) - strlen(text) - 5);
+	strcat(text, " */\n");
+	flight_buffer_text(text);
+
+	flight_dump_threads();
+
+	flight_buffer_text("/* viv_wrap: flight recorder dump done. */\n");
+	flight_buffer_flush();
+
+	__atomic_store_n(&flight_dumping, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Failing ioctls might come in bursts, dump only once in a while.
+ */
+void
+wrap_flight_error(int command, int ioctl_ret, int status)
+{
+	uint64_t now = wrap_time();
+	uint64_t last = __atomic_load_n(&flight_error_last, __ATOMIC_RELAXED);
+
+	if (last && ((now - last) < FLIGHT_ERROR_HOLDOFF))
+		return;
+
+	if (!__atomic_compare_exchange_n(&flight_error_last, &last, now, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	viv_wrap_flight_dump("ioctl error");
+}
+
+static void
+flight_signal_user(int signum)
+{
+	int errno_saved = errno;
+
+	viv_wrap_flight_dump("SIGUSR1");
+
+	errno = errno_saved;
+}
+
+static const char *
+flight_signal_name(int signum)
+{
+	switch (signum) {
+	case SIGSEGV:
+		return "SIGSEGV";
+	case SIGBUS:
+		return "SIGBUS";
+	case SIGILL:
+		return "SIGILL";
+	case SIGFPE:
+		return "SIGFPE";
+	case SIGABRT:
+		return "SIGABRT";
+	default:
+		return "fatal signal";
+	}
+}
+
+static void
+flight_signal_fatal(int signum)
+{
+	int i;
+
+	viv_wrap_flight_dump(flight_signal_name(signum));
+
+	/* hand it back to whoever was there before, and let it happen. */
+	for (i = 0; i < (sizeof(flight_fatal_signals) / sizeof(int)); i++)
+		if (flight_fatal_signals[i] == signum)
+			sigaction(signum, &flight_fatal_old[i], NULL);
+
+	raise(signum);
+}
+
+void
+wrap_flight_init(void)
+{
+	struct viv_record_file header = {
+		.magic = VIV_RECORD_MAGIC,
+		.version = VIV_RECORD_VERSION,
+		.header_size = sizeof(struct viv_record),
+	};
+	struct sigaction action;
+	char *filename;
+	int size, i;
+
+	size = wrap_getenv_int("VIV_WRAP_FLIGHT", 0);
+	if (size <= 0)
+		return;
+
+	/* round up to a power of two. */
+	while (size & (size - 1))
+		size += size & -size;
+	wrap_flight_size = size;
+
+	/* the dumps are binary, and so is whatever else gets logged. */
+	wrap_log_binary = 1;
+
+	filename = getenv("VIV_WRAP_LOG");
+	if (!filename)
+		filename = "/tmp/viv_wrap.log";
+
+	flight_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			 O_CLOEXEC, 0644);
+	if (flight_fd == -1) {
+		fprintf(stderr, "Error: failed to open wrap log %s: %s\n",
+			filename, strerror(errno));
+		wrap_flight_size = 0;
+		return;
+	}
+
+	if (write(flight_fd, &header, sizeof(header)) != sizeof(header))
+		fprintf(stderr, "%s: failed to write header: %s\n", __func__,
+			strerror(errno));
+
+	printf("viv_wrap: flight recorder of %d ioctls per thread, dumping "
+	       "to %s.\n", size, filename);
+
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	action.sa_handler = flight_signal_user;
+	sigaction(SIGUSR1, &action, NULL);
+
+	action.sa_flags = SA_NODEFER;
+	action.sa_handler = flight_signal_fatal;
+	for (i = 0; i < (sizeof(flight_fatal_signals) / sizeof(int)); i++)
+		sigaction(flight_fatal_signals[i], &action,
+			  &flight_fatal_old[i]);
+}
@@ -0,0 +1,944 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The hooks which turn galcore ioctls into readable text. These are shared
+ * between the wrapper and vivwrap-decode, which renders binary traces.
+ */
+
+#include <stdio.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+const char *
+viv_hardware_type(int type)
+{
+	switch(type) {
+	case 1:
+		return "3D";
+	case 2:
+		return "2D";
+	case 3:
+		return "2D/3D";
+	case 4:
+		return "VG";
+	default:
+		return NULL;
+	}
+}
+
+const char *
+viv_pool_type(int pool)
+{
+	static const char *names[gcvPOOL_NUMBER_OF_POOLS] = {
+		[gcvPOOL_UNKNOWN] = "UNKNOWN",
+		[gcvPOOL_DEFAULT] = "DEFAULT",
+		[gcvPOOL_LOCAL] = "LOCAL",
+		[gcvPOOL_LOCAL_INTERNAL] = "LOCAL_INTERNAL",
+		[gcvPOOL_LOCAL_EXTERNAL] = "LOCAL_EXTERNAL",
+		[gcvPOOL_UNIFIED] = "UNIFIED",
+		[gcvPOOL_SYSTEM] = "SYSTEM",
+		[gcvPOOL_VIRTUAL] = "VIRTUAL",
+		[gcvPOOL_USER] = "USER",
+		[gcvPOOL_CONTIGUOUS] = "CONTIGUOUS",
+		[gcvPOOL_DEFAULT_FORCE_CONTIGUOUS] = "FORCE_CONTIGUOUS",
+		[gcvPOOL_DEFAULT_FORCE_CONTIGUOUS_CACHEABLE] =
+			"FORCE_CONTIGUOUS_CACHEABLE",
+	};
+
+	if ((pool < 0) || (pool >= gcvPOOL_NUMBER_OF_POOLS))
+		return "INVALID";
+
+	return names[pool];
+}
+
+const char *
+viv_surface_type(int type)
+{
+	static const char *names[gcvSURF_NUM_TYPES] = {
+		[gcvSURF_TYPE_UNKNOWN] = "UNKNOWN",
+		[gcvSURF_INDEX] = "INDEX",
+		[gcvSURF_VERTEX] = "VERTEX",
+		[gcvSURF_TEXTURE] = "TEXTURE",
+		[gcvSURF_RENDER_TARGET] = "RENDER_TARGET",
+		[gcvSURF_DEPTH] = "DEPTH",
+		[gcvSURF_BITMAP] = "BITMAP",
+		[gcvSURF_TILE_STATUS] = "TILE_STATUS",
+		[gcvSURF_IMAGE] = "IMAGE",
+		[gcvSURF_MASK] = "MASK",
+		[gcvSURF_SCISSOR] = "SCISSOR",
+		[gcvSURF_HIERARCHICAL_DEPTH] = "HIERARCHICAL_DEPTH",
+	};
+
+	/* the upper bits are flags. */
+	type &= 0xFF;
+	if (type >= gcvSURF_NUM_TYPES)
+		return "INVALID";
+
+	return names[type];
+}
+
+/*
+ * Follows every post hook: when the actual ioctl was issued and how long
+ * the kernel took to return.
+ */
+void
+hook_timing(uint64_t timestamp, uint64_t duration)
+{
+	wrap_log("\t/* @%llu.%09llus, took %llu.%03lluus */\n",
+		 (unsigned long long) timestamp / 1000000000,
+		 (unsigned long long) timestamp % 1000000000,
+		 (unsigned long long) duration / 1000,
+		 (unsigned long long) duration % 1000);
+}
+
+/*
+ * The allocation a gpu address falls into, as a comment to follow the
+ * address with, or nothing when it is not known.
+ */
+static const char *
+hook_address(uint32_t address, char *buffer, int size)
+{
+	char name[64];
+
+	if (wrap_address_name(address, name, sizeof(name)))
+		return "";
+
+	snprintf(buffer, size, " /* %s */", name);
+	return buffer;
+}
+
+/*
+ * The same, as a line of its own, for addresses found in command streams
+ * and state deltas.
+ */
+void
+hook_address_comment(const char *what, uint32_t address)
+{
+	char name[64];
+
+	if (wrap_address_name(address, name, sizeof(name)))
+		return;
+
+	wrap_log("\t/* %s 0x%08X: %s */\n", what, address, name);
+}
+
+/*
+ * Upper bound of the length of the hex dump below, in bytes.
+ */
+uint32_t
+hook_command_buffer_length(uint32_t size)
+{
+	/* header, "\t * 000000:" plus 8 words per line, and the trailer. */
+	return 48 + ((size + 31) / 32) * (11 + 8 * 9 + 1) + 8;
+}
+
+/*
+ * Hex dump of a captured command buffer, 8 words to a line.
+ */
+void
+hook_command_buffer(const void *data, uint32_t size)
+{
+	const uint32_t *words = data;
+	uint32_t count = size / 4, i;
+
+	wrap_log("\t/* command buffer, 0x%X bytes:\n", size);
+
+	for (i = 0; i < count; i += 8) {
+		uint32_t j, end = (count - i) < 8 ? count - i : 8;
+		char line[128];
+		int length;
+
+		length = snprintf(line, sizeof(line), "\t * %06X:", i * 4);
+		for (j = 0; j < end; j++)
+			length += snprintf(line + length, sizeof(line) - length,
+					   " %08X", words[i + j]);
+		wrap_log("%s\n", line);
+	}
+
+	wrap_log("\t */\n");
+}
+
+/*
+ * A command buffer which lives in the blob store.
+ */
+void
+hook_command_buffer_ref(const struct viv_blob_ref *ref)
+{
+	wrap_log("\t/* command buffer 0x%016llX, 0x%X bytes, submission %u "
+		 "*/\n", (unsigned long long) ref->hash, ref->size,
+		 ref->count);
+}
+
+static int
+hook_unknown_pre(const char *command, const char *hardware, void *data)
+{
+	return -1;
+}
+
+static int
+hook_unknown_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	return -1;
+}
+
+static int
+hook_empty_pre(const char *command, const char *hardware, void *data)
+{
+	return 0;
+}
+
+#if 0
+static int
+hook_empty_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	return 0;
+}
+#endif
+
+static int
+hook_GetBaseAddress_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_GET_BASE_ADDRESS *address = data;
+
+	wrap_log("%s = 0x%08X;\n", command, address->baseAddress);
+
+	return 0;
+}
+
+static int
+hook_Version_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_VERSION *version = data;
+
+	wrap_log("%s = %d.%d.%d.%d;\n", command, version->major, version->minor,
+		 version->patch, version->build);
+
+	return 0;
+}
+
+static int
+hook_ChipInfo_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_CHIP_INFO *info = data;
+	int i;
+
+	wrap_log("%s[%d] = {\n", command, info->count);
+	for (i = 0; i < info->count; i++) {
+		if (hardware)
+			wrap_log("\t%s, /* %d */\n", hardware, i);
+		else
+			wrap_log("\tNULL, /* %d */\n", hardware, i);
+	}
+
+	wrap_log("};\n");
+
+	return 0;
+}
+
+static int
+hook_QueryVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_QUERY_VIDEO_MEMORY *memory = data;
+
+	wrap_log("%s = {\n", command);
+	wrap_log("\t.internalPhysical = 0x%08lX,\n", memory->internalPhysical);
+	wrap_log("\t.internalSize = %lld,\n", memory->internalSize);
+	wrap_log("\t.externalPhysical = 0x%08lX,\n", memory->externalPhysical);
+	wrap_log("\t.externalSize = %lld,\n", memory->externalSize);
+	wrap_log("\t.contiguousPhysical = 0x%08lX,\n", memory->contiguousPhysical);
+	wrap_log("\t.contiguousSize = %lld,\n", memory->contiguousSize);
+	wrap_log("};\n");
+
+	return 0;
+}
+
+static int
+hook_QueryChipIdentity_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_QUERY_CHIP_IDENTITY *identity = data;
+
+	wrap_log("%s(%s) = {\n", command, hardware);
+	wrap_log("\t.chipModel = %d,\n", identity->chipModel);
+	wrap_log("\t.chipRevision = 0x%08lX,\n", identity->chipRevision);
+	wrap_log("\t.chipFeatures = 0x%08lX,\n", identity->chipFeatures);
+	wrap_log("\t.chipMinorFeatures = 0x%08lX,\n", identity->chipMinorFeatures);
+	wrap_log("\t.chipMinorFeatures1 = 0x%08lX,\n", identity->chipMinorFeatures1);
+	wrap_log("\t.chipMinorFeatures2 = 0x%08lX,\n", identity->chipMinorFeatures2);
+	wrap_log("\t.chipMinorFeatures3 = 0x%08lX,\n", identity->chipMinorFeatures3);
+	wrap_log("\t.chipMinorFeatures4 = 0x%08lX,\n", identity->chipMinorFeatures4);
+	wrap_log("\t.streamCount = 0x%08lX,\n", identity->streamCount);
+	wrap_log("\t.registerMax = 0x%08lX,\n", identity->registerMax);
+	wrap_log("\t.threadCount = 0x%08lX,\n", identity->threadCount);
+	wrap_log("\t.shaderCoreCount = 0x%08lX,\n", identity->shaderCoreCount);
+	wrap_log("\t.vertexCacheSize = 0x%08lX,\n", identity->vertexCacheSize);
+	wrap_log("\t.vertexOutputBufferSize = 0x%08lX,\n", identity->vertexOutputBufferSize);
+	wrap_log("\t.pixelPipes = 0x%08lX,\n", identity->pixelPipes);
+	wrap_log("\t.instructionCount = 0x%08lX,\n", identity->instructionCount);
+	wrap_log("\t.numConstants = 0x%08lX,\n", identity->numConstants);
+	wrap_log("\t.bufferSize = 0x%08lX,\n", identity->bufferSize);
+	wrap_log("\t.varyingsCount = 0x%08lX,\n", identity->varyingsCount);
+	wrap_log("\t.superTileMode = 0x%08lX,\n", identity->superTileMode);
+	wrap_log("\t.chip2DControl = 0x%08lX,\n", identity->chip2DControl);
+	wrap_log("};\n");
+
+	return 0;
+}
+
+static int
+hook_Attach_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_ATTACH *attach = data;
+
+	wrap_log("%s(%s, context 0x%08lX, stateCount %lld) = %d;\n",
+		 command, hardware, attach->context, attach->stateCount, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_AllocateContiguousMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct  _gcsHAL_ALLOCATE_CONTIGUOUS_MEMORY *alloc = data;
+
+	wrap_log("%s(%s, bytes 0x%llX);\n", command, hardware, alloc->bytes);
+
+	return 0;
+}
+
+static int
+hook_AllocateContiguousMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct  _gcsHAL_ALLOCATE_CONTIGUOUS_MEMORY *alloc = data;
+	char name[80];
+
+	wrap_log("%s(%s, bytes 0x%llX, address 0x%08lX%s, physical 0x%08lX, logical 0x%08llX) = %d;\n",
+		 command, hardware, alloc->bytes, alloc->address,
+		 hook_address(alloc->address, name, sizeof(name)),
+		 alloc->physical, alloc->logical, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_FreeContiguousMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_FREE_CONTIGUOUS_MEMORY *free = data;
+
+	wrap_log("%s(%s, bytes 0x%llX, physical 0x%08X, logical 0x%08llX);\n",
+		 command, hardware, free->bytes, free->physical, free->logical);
+
+	return 0;
+}
+
+static int
+hook_FreeContiguousMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_FREE_CONTIGUOUS_MEMORY *free = data;
+
+	wrap_log("%s(%s, physical 0x%08X) = %d;\n", command, hardware,
+		 free->physical, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_MapMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_MAP_MEMORY *map = data;
+
+	wrap_log("%s(%s, physical 0x%08X, bytes 0x%llX);\n",
+		 command, hardware, map->physical, map->bytes);
+
+	return 0;
+}
+
+static int
+hook_MapMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_MAP_MEMORY *map = data;
+
+	wrap_log("%s(%s, physical 0x%08X, bytes 0x%llX, logical 0x%08llX) = %d;\n",
+		 command, hardware, map->physical, map->bytes, map->logical,
+		 ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_UnmapMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_UNMAP_MEMORY *unmap = data;
+
+	wrap_log("%s(%s, physical 0x%08X, bytes 0x%llX, logical 0x%08llX);\n",
+		 command, hardware, unmap->physical, unmap->bytes,
+		 unmap->logical);
+
+	return 0;
+}
+
+static int
+hook_UnmapMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_UNMAP_MEMORY *unmap = data;
+
+	wrap_log("%s(%s, logical 0x%08llX) = %d;\n", command, hardware,
+		 unmap->logical, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_MapPhysical_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_MAP_PHYSICAL *map = data;
+
+	wrap_log("%s(%s, %s, physical 0x%08llX);\n", command, hardware,
+		 map->map ? "map" : "unmap", map->physical);
+
+	return 0;
+}
+
+static int
+hook_MapPhysical_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_MAP_PHYSICAL *map = data;
+
+	wrap_log("%s(%s, %s, physical 0x%08llX) = %d;\n", command, hardware,
+		 map->map ? "map" : "unmap", map->physical, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_MapUserMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_MAP_USER_MEMORY *map = data;
+
+	wrap_log("%s(%s, memory 0x%08llX, physical 0x%08X, size 0x%llX);\n",
+		 command, hardware, map->memory, map->physical, map->size);
+
+	return 0;
+}
+
+static int
+hook_MapUserMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_MAP_USER_MEMORY *map = data;
+	char name[80];
+
+	wrap_log("%s(%s, memory 0x%08llX, size 0x%llX, info 0x%08X, address 0x%08X%s) = %d;\n",
+		 command, hardware, map->memory, map->size, map->info,
+		 map->address, hook_address(map->address, name, sizeof(name)),
+		 ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_UnmapUserMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_UNMAP_USER_MEMORY *unmap = data;
+	char name[80];
+
+	wrap_log("%s(%s, memory 0x%08llX, size 0x%llX, info 0x%08X, address 0x%08X%s);\n",
+		 command, hardware, unmap->memory, unmap->size, unmap->info,
+		 unmap->address,
+		 hook_address(unmap->address, name, sizeof(name)));
+
+	return 0;
+}
+
+static int
+hook_UnmapUserMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_UNMAP_USER_MEMORY *unmap = data;
+
+	wrap_log("%s(%s, memory 0x%08llX, info 0x%08X) = %d;\n", command,
+		 hardware, unmap->memory, unmap->info, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_Signal_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_SIGNAL *signal = data;
+
+	wrap_log("%s(%s, signal 0x%08llX, process 0x%08llX, from %d);\n",
+		 command, hardware, signal->signal, signal->process,
+		 signal->fromWhere);
+
+	return 0;
+}
+
+static int
+hook_Signal_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_SIGNAL *signal = data;
+
+	wrap_log("%s(%s, signal 0x%08llX) = %d;\n", command, hardware,
+		 signal->signal, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_WriteData_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_WRITE_DATA *write = data;
+	char name[80];
+
+	wrap_log("%s(%s, address 0x%08X%s, data 0x%08X);\n", command,
+		 hardware, write->address,
+		 hook_address(write->address, name, sizeof(name)), write->data);
+
+	return 0;
+}
+
+static int
+hook_WriteData_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_WRITE_DATA *write = data;
+	char name[80];
+
+	wrap_log("%s(%s, address 0x%08X%s) = %d;\n", command, hardware,
+		 write->address, hook_address(write->address, name, sizeof(name)),
+		 ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_UserSignal_pre(const char *command, const char *hardware, void *data)
+{
+	struct  _gcsHAL_USER_SIGNAL *signal = data;
+
+	switch(signal->command) {
+	case gcvUSER_SIGNAL_CREATE:
+		wrap_log("%s(%s, CREATE, manualreset %d);\n",
+			 command, hardware, signal->manualReset);
+		break;
+        case gcvUSER_SIGNAL_DESTROY:
+		wrap_log("%s(%s, DESTROY, id 0x%08lX);\n",
+			 command, hardware, signal->id);
+		break;
+        case gcvUSER_SIGNAL_SIGNAL:
+		wrap_log("%s(%s, SIGNAL, id 0x%08lX, state %d);\n",
+			 command, hardware, signal->id, signal->state);
+		break;
+        case gcvUSER_SIGNAL_WAIT:
+		wrap_log("%s(%s, WAIT, id 0x%08lX, wait %d);\n",
+			 command, hardware, signal->id, signal->wait);
+		break;
+        case gcvUSER_SIGNAL_MAP:
+		wrap_log("%s(%s, MAP, id 0x%08lX);\n",
+			 command, hardware, signal->id);
+		break;
+	case gcvUSER_SIGNAL_UNMAP:
+		wrap_log("%s(%s, UNMAP, id 0x%08lX);\n",
+			 command, hardware, signal->id);
+		break;
+	default:
+		fprintf(stderr, "%s: unknown signal %d\n", __func__, signal->command);
+		break;
+	}
+
+	return 0;
+}
+
+static int
+hook_UserSignal_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct  _gcsHAL_USER_SIGNAL *signal = data;
+
+	switch(signal->command) {
+	case gcvUSER_SIGNAL_CREATE:
+		wrap_log("%s(%s, CREATE, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+        case gcvUSER_SIGNAL_DESTROY:
+		wrap_log("%s(%s, DESTROY, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+        case gcvUSER_SIGNAL_SIGNAL:
+		wrap_log("%s(%s, SIGNAL, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+        case gcvUSER_SIGNAL_WAIT:
+		wrap_log("%s(%s, WAIT, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+        case gcvUSER_SIGNAL_MAP:
+		wrap_log("%s(%s, MAP, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+	case gcvUSER_SIGNAL_UNMAP:
+		wrap_log("%s(%s, UNMAP, id 0x%08lX) = %d;\n",
+			 command, hardware, signal->id, ioctl_ret);
+		break;
+	default:
+		fprintf(stderr, "%s: unknown signal %d\n", __func__, signal->command);
+		break;
+	}
+
+	return 0;
+}
+
+static int
+hook_QueryCommandBuffer_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_QUERY_COMMAND_BUFFER *query = data;
+	struct _gcsCOMMAND_BUFFER_INFO *info = &query->information;
+
+	wrap_log("%s(%s) = {{\n", command, hardware);
+	wrap_log("\t.feBufferInt = 0x%08lX,\n", info->feBufferInt);
+	wrap_log("\t.tsOverflowInt = 0x%08lX,\n", info->tsOverflowInt);
+	wrap_log("\t.addressMask = 0x%08lX,\n", info->addressMask);
+	wrap_log("\t.addressAlignment = 0x%08lX,\n", info->addressAlignment);
+	wrap_log("\t.commandAlignment = 0x%08lX,\n", info->commandAlignment);
+	wrap_log("\t.stateCommandSize = 0x%08lX,\n", info->stateCommandSize);
+	wrap_log("\t.restartCommandSize = 0x%08lX,\n", info->restartCommandSize);
+	wrap_log("\t.fetchCommandSize = 0x%08lX,\n", info->fetchCommandSize);
+	wrap_log("\t.callCommandSize = 0x%08lX,\n", info->callCommandSize);
+	wrap_log("\t.returnCommandSize = 0x%08lX,\n", info->returnCommandSize);
+	wrap_log("\t.eventCommandSize = 0x%08lX,\n", info->eventCommandSize);
+	wrap_log("\t.endCommandSize = 0x%08lX,\n", info->endCommandSize);
+	wrap_log("\t.staticTailSize = 0x%08lX,\n", info->staticTailSize);
+	wrap_log("\t.dynamicTailSize = 0x%08lX,\n", info->dynamicTailSize);
+	wrap_log("}};\n");
+
+	return 0;
+}
+
+static int
+hook_AllocateLinearVideoMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_ALLOCATE_LINEAR_VIDEO_MEMORY *alloc = data;
+
+	wrap_log("%s(%s, bytes 0x%lX, alignment %d, type %d, pool %d);\n",
+		 command, hardware, alloc->bytes, alloc->alignment, alloc->type, alloc->pool);
+
+	return 0;
+}
+
+static int
+hook_AllocateLinearVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_ALLOCATE_LINEAR_VIDEO_MEMORY *alloc = data;
+
+	wrap_log("%s(%s, bytes 0x%lX, type %d, pool %d, node 0x%08llX) = %d;\n",
+		 command, hardware, alloc->bytes, alloc->type, alloc->pool, alloc->node, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_AllocateVideoMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_ALLOCATE_VIDEO_MEMORY *alloc = data;
+
+	wrap_log("%s(%s, width %d, height %d, depth %d, format %d, type %d, pool %d);\n",
+		 command, hardware, alloc->width, alloc->height, alloc->depth,
+		 alloc->format, alloc->type, alloc->pool);
+
+	return 0;
+}
+
+static int
+hook_AllocateVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_ALLOCATE_VIDEO_MEMORY *alloc = data;
+
+	wrap_log("%s(%s, width %d, height %d, pool %d, node 0x%08llX) = %d;\n",
+		 command, hardware, alloc->width, alloc->height, alloc->pool,
+		 alloc->node, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_LockVideoMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_LOCK_VIDEO_MEMORY *lock = data;
+
+	wrap_log("%s(%s, node 0x%llX, cacheable %d);\n",
+		 command, hardware, lock->node, lock->cacheable);
+
+	return 0;
+}
+
+static int
+hook_LockVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_LOCK_VIDEO_MEMORY *lock = data;
+	char name[80];
+
+	wrap_log("%s(%s, node 0x%llX, address 0x%08lX%s, memory 0x%08llX) = %d\n",
+		 command, hardware, lock->node, lock->address,
+		 hook_address(lock->address, name, sizeof(name)), lock->memory,
+		 ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_Commit_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_COMMIT *commit = data;
+
+	wrap_log("%s(%s, context 0x%08llX, commandBuffer 0x%08llX, delta 0x%08llX, queue 0x%08llX);\n",
+		 command, hardware, commit->context, commit->commandBuffer,
+		 commit->delta, commit->queue);
+
+	return 0;
+}
+
+static int
+hook_Commit_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_COMMIT *commit = data;
+
+	wrap_log("%s(%s, queue 0x%08llX) = %d;\n",
+		 command, hardware, commit->queue, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_UnlockVideoMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_UNLOCK_VIDEO_MEMORY *unlock = data;
+
+	wrap_log("%s(%s, node 0x%08llX, type %d, async %d);\n",
+		 command, hardware, unlock->node, unlock->type, unlock->asynchroneous);
+
+	return 0;
+}
+
+static int
+hook_UnlockVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_UNLOCK_VIDEO_MEMORY *unlock = data;
+
+	wrap_log("%s(%s, node 0x%08llX) = %d;\n", command, hardware, unlock->node, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_EventCommit_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_EVENT_COMMIT *commit = data;
+
+	wrap_log("%s(%s, queue 0x%08llX);\n", command, hardware, commit->queue);
+
+	return 0;
+}
+
+static int
+hook_EventCommit_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_EVENT_COMMIT *commit = data;
+
+	wrap_log("%s(%s, queue 0x%08llX) = %d;\n", command, hardware, commit->queue, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_Detach_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_DETACH *detach = data;
+
+	wrap_log("%s(%s, context 0x%08lX);\n", command, hardware, detach->context);
+
+	return 0;
+}
+
+static int
+hook_Detach_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_DETACH *detach = data;
+
+	wrap_log("%s(%s, context 0x%08lX) = %d;\n",
+		 command, hardware, detach->context, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_FreeVideoMemory_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_FREE_VIDEO_MEMORY *free = data;
+
+	wrap_log("%s(%s, node 0x%08llX);\n", command, hardware, free->node);
+
+	return 0;
+}
+
+static int
+hook_FreeVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_FREE_VIDEO_MEMORY *free = data;
+
+	wrap_log("%s(%s, node 0x%08llX) = %d;\n", command, hardware, free->node, ioctl_ret);
+
+	return 0;
+}
+
+static int
+hook_Database_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_DATABASE *database = data;
+
+	wrap_log("%s(%s, validProcessID %d, processID %d);\n", command,
+		 hardware, database->validProcessID, database->processID);
+
+	return 0;
+}
+
+static void
+hook_database_info(const char *name, gcuDATABASE_INFO *info)
+{
+	wrap_log("\t%s = { bytes %llu, maxBytes %llu, totalBytes %llu, time %llu },\n",
+		 name, info->counters.bytes, info->counters.maxBytes,
+		 info->counters.totalBytes, info->time);
+}
+
+static int
+hook_Database_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_DATABASE *database = data;
+
+	wrap_log("%s(%s, processID %d) = %d {\n", command, hardware,
+		 database->processID, ioctl_ret);
+	hook_database_info("vidMem", &database->vidMem);
+	hook_database_info("nonPaged", &database->nonPaged);
+	hook_database_info("contiguous", &database->contiguous);
+	hook_database_info("gpuIdle", &database->gpuIdle);
+	wrap_log("};\n");
+
+	return 0;
+}
+
+static int
+hook_VidMemDatabase_pre(const char *command, const char *hardware, void *data)
+{
+	struct _gcsHAL_VIDMEM_DATABASE *database = data;
+
+	wrap_log("%s(%s, validProcessID %d, processID %d);\n", command,
+		 hardware, database->validProcessID, database->processID);
+
+	return 0;
+}
+
+static int
+hook_VidMemDatabase_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+{
+	struct _gcsHAL_VIDMEM_DATABASE *database = data;
+
+	wrap_log("%s(%s, processID %d) = %d {\n", command, hardware,
+		 database->processID, ioctl_ret);
+	hook_database_info("vidMemResv", &database->vidMemResv);
+	hook_database_info("vidMemCont", &database->vidMemCont);
+	hook_database_info("vidMemVirt", &database->vidMemVirt);
+	wrap_log("};\n");
+
+	return 0;
+}
+
+/*
+ * The size is that of the relevant member of the gcsHAL_INTERFACE union,
+ * which is what gets stored in binary records. Commands we do not know
+ * the layout of have a size of 0.
+ */
+#define HAL_SIZE(member) sizeof(((gcsHAL_INTERFACE *) 0)->u.member)
+
+struct wrap_command command_table[] = {
+	{gcvHAL_QUERY_VIDEO_MEMORY, "QUERY_VIDEO_MEMORY", hook_empty_pre, hook_QueryVideoMemory_post, HAL_SIZE(QueryVideoMemory)},
+	{gcvHAL_QUERY_CHIP_IDENTITY, "QUERY_CHIP_IDENTITY", hook_empty_pre, hook_QueryChipIdentity_post, HAL_SIZE(QueryChipIdentity)},
+	{gcvHAL_ALLOCATE_NON_PAGED_MEMORY, "ALLOCATE_NON_PAGED_MEMORY", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_FREE_NON_PAGED_MEMORY, "FREE_NON_PAGED_MEMORY", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY, "ALLOCATE_CONTIGUOUS_MEMORY", hook_AllocateContiguousMemory_pre, hook_AllocateContiguousMemory_post, HAL_SIZE(AllocateContiguousMemory)},
+	{gcvHAL_FREE_CONTIGUOUS_MEMORY, "FREE_CONTIGUOUS_MEMORY", hook_FreeContiguousMemory_pre, hook_FreeContiguousMemory_post, HAL_SIZE(FreeContiguousMemory)},
+	{gcvHAL_ALLOCATE_VIDEO_MEMORY, "ALLOCATE_VIDEO_MEMORY", hook_AllocateVideoMemory_pre, hook_AllocateVideoMemory_post, HAL_SIZE(AllocateVideoMemory)},
+	{gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY, "ALLOCATE_LINEAR_VIDEO_MEMORY", hook_AllocateLinearVideoMemory_pre, hook_AllocateLinearVideoMemory_post, HAL_SIZE(AllocateLinearVideoMemory)},
+	{gcvHAL_FREE_VIDEO_MEMORY, "FREE_VIDEO_MEMORY", hook_FreeVideoMemory_pre, hook_FreeVideoMemory_post, HAL_SIZE(FreeVideoMemory)},
+	{gcvHAL_MAP_MEMORY, "MAP_MEMORY", hook_MapMemory_pre, hook_MapMemory_post, HAL_SIZE(MapMemory)},
+	{gcvHAL_UNMAP_MEMORY, "UNMAP_MEMORY", hook_UnmapMemory_pre, hook_UnmapMemory_post, HAL_SIZE(UnmapMemory)},
+	{gcvHAL_MAP_USER_MEMORY, "MAP_USER_MEMORY", hook_MapUserMemory_pre, hook_MapUserMemory_post, HAL_SIZE(MapUserMemory)},
+	{gcvHAL_UNMAP_USER_MEMORY, "UNMAP_USER_MEMORY", hook_UnmapUserMemory_pre, hook_UnmapUserMemory_post, HAL_SIZE(UnmapUserMemory)},
+	{gcvHAL_LOCK_VIDEO_MEMORY, "LOCK_VIDEO_MEMORY", hook_LockVideoMemory_pre, hook_LockVideoMemory_post, HAL_SIZE(LockVideoMemory)},
+	{gcvHAL_UNLOCK_VIDEO_MEMORY, "UNLOCK_VIDEO_MEMORY", hook_UnlockVideoMemory_pre, hook_UnlockVideoMemory_post, HAL_SIZE(UnlockVideoMemory)},
+	{gcvHAL_EVENT_COMMIT, "EVENT_COMMIT", hook_EventCommit_pre, hook_EventCommit_post, HAL_SIZE(Event)},
+	{gcvHAL_USER_SIGNAL, "USER_SIGNAL", hook_UserSignal_pre, hook_UserSignal_post, HAL_SIZE(UserSignal)},
+	{gcvHAL_SIGNAL, "SIGNAL", hook_Signal_pre, hook_Signal_post, HAL_SIZE(Signal)},
+	{gcvHAL_WRITE_DATA, "WRITE_DATA", hook_WriteData_pre, hook_WriteData_post, HAL_SIZE(WriteData)},
+	{gcvHAL_COMMIT, "COMMIT", hook_Commit_pre, hook_Commit_post, HAL_SIZE(Commit)},
+	{gcvHAL_STALL, "STALL", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_READ_REGISTER, "READ_REGISTER", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_WRITE_REGISTER, "WRITE_REGISTER", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_GET_PROFILE_SETTING, "GET_PROFILE_SETTING", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_SET_PROFILE_SETTING, "SET_PROFILE_SETTING", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_READ_ALL_PROFILE_REGISTERS, "READ_ALL_PROFILE_REGISTERS", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_PROFILE_REGISTERS_2D, "PROFILE_REGISTERS_2D", hook_unknown_pre, hook_unknown_post, 0},
+#if VIVANTE_PROFILER_PERDRAW
+	{gcvHAL_READ_PROFILER_REGISTER_SETTING, "READ_PROFILER_REGISTER_SETTING", hook_unknown_pre, hook_unknown_post, 0},
+#endif
+	{gcvHAL_SET_POWER_MANAGEMENT_STATE, "SET_POWER_MANAGEMENT_STATE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_QUERY_POWER_MANAGEMENT_STATE, "QUERY_POWER_MANAGEMENT_STATE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_GET_BASE_ADDRESS, "GET_BASE_ADDRESS", hook_empty_pre, hook_GetBaseAddress_post, HAL_SIZE(GetBaseAddress)},
+	{gcvHAL_SET_IDLE, "SET_IDLE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_QUERY_KERNEL_SETTINGS, "QUERY_KERNEL_SETTINGS", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_RESET, "RESET", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_MAP_PHYSICAL, "MAP_PHYSICAL", hook_MapPhysical_pre, hook_MapPhysical_post, HAL_SIZE(MapPhysical)},
+	{gcvHAL_DEBUG, "DEBUG", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_CACHE, "CACHE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_TIMESTAMP, "TIMESTAMP", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_DATABASE, "DATABASE", hook_Database_pre, hook_Database_post, HAL_SIZE(Database)},
+	{gcvHAL_VERSION, "VERSION", hook_empty_pre, hook_Version_post, HAL_SIZE(Version)},
+	{gcvHAL_CHIP_INFO, "CHIP_INFO", hook_empty_pre, hook_ChipInfo_post, HAL_SIZE(ChipInfo)},
+	{gcvHAL_ATTACH, "ATTACH", hook_empty_pre, hook_Attach_post, HAL_SIZE(Attach)},
+	{gcvHAL_DETACH, "DETACH", hook_Detach_pre, hook_Detach_post, HAL_SIZE(Detach)},
+	{gcvHAL_COMPOSE, "COMPOSE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_SET_TIMEOUT, "SET_TIMEOUT", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_GET_FRAME_INFO, "GET_FRAME_INFO", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_GET_SHARED_INFO, "GET_SHARED_INFO", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_SET_SHARED_INFO, "SET_SHARED_INFO", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_QUERY_COMMAND_BUFFER, "QUERY_COMMAND_BUFFER", hook_empty_pre, hook_QueryCommandBuffer_post, HAL_SIZE(QueryCommandBuffer)},
+	{gcvHAL_COMMIT_DONE, "COMMIT_DONE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_DUMP_GPU_STATE, "DUMP_GPU_STATE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_DUMP_EVENT, "DUMP_EVENT", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_ALLOCATE_VIRTUAL_COMMAND_BUFFER, "ALLOCATE_VIRTUAL_COMMAND_BUFFER", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_FREE_VIRTUAL_COMMAND_BUFFER, "FREE_VIRTUAL_COMMAND_BUFFER", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_SET_FSCALE_VALUE, "SET_FSCALE_VALUE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_GET_FSCALE_VALUE, "GET_FSCALE_VALUE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_QUERY_RESET_TIME_STAMP, "QUERY_RESET_TIME_STAMP", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_SYNC_POINT, "SYNC_POINT", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_CREATE_NATIVE_FENCE, "CREATE_NATIVE_FENCE", hook_unknown_pre, hook_unknown_post, 0},
+	{gcvHAL_VIDMEM_DATABASE, "VIDMEM_DATABASE", hook_VidMemDatabase_pre, hook_VidMemDatabase_post, HAL_SIZE(VidMemDatabase)},
+};
+
+int command_table_count = sizeof(command_table) / sizeof(command_table[0]);
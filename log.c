@@ -0,0 +1,867 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *
+ * Basic log writing infrastructure.
+ *
+ * Each thread formats into its own single producer/single consumer ring,
+ * so the hooks never take a lock. A single writer thread drains all rings
+ * into the log file.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define WRAP_LOG_LINE_MAX 4096
+#define WRAP_LOG_IOV_MAX 64
+#define WRAP_LOG_IDLE_MIN 1000 /* us */
+#define WRAP_LOG_IDLE_MAX 20000 /* us */
+
+struct wrap_ring {
+	unsigned int size;
+
+	/* producer side. */
+	unsigned int head;
+	unsigned int pending;
+	unsigned int dropped;
+
+	/* consumer side. */
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned int dropped_reported;
+
+	char data[] __attribute__((aligned(64)));
+};
+
+int wrap_log_binary;
+
+static int wrap_log_fd = -1;
+static unsigned int wrap_ring_size = 256 * 1024; /* a power of two. */
+
+/*
+ * The writer writes out once this many bytes are queued up, or once the
+ * oldest queued data is flush_ms old. It only calls fdatasync() when asked
+ * to, at most every fsync_ms.
+ */
+static int wrap_log_batch = 64 * 1024;
+static int wrap_log_flush_ms = 10;
+static int wrap_log_fsync_ms;
+
+static pthread_mutex_t wrap_log_start_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t wrap_log_drain_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_t wrap_log_writer_thread;
+static int wrap_log_started;
+static int wrap_log_stop;
+static int wrap_log_atfork_registered;
+static int wrap_log_writer_running;
+
+/*
+ * Memory mapped mode, see record.h.
+ */
+static struct viv_record_mmap *wrap_log_map;
+static unsigned int wrap_log_map_size;
+
+static void
+wrap_log_write(const void *data, int size)
+{
+	const char *buffer = data;
+
+	while (size > 0) {
+		int ret = write(wrap_log_fd, buffer, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: write failed: %s\n", __func__,
+				strerror(errno));
+			return;
+		}
+
+		buffer += ret;
+		size -= ret;
+	}
+}
+
+static void
+wrap_log_open(void)
+{
+	char *filename;
+
+	if (wrap_log_fd != -1)
+		return;
+
+	filename = getenv("VIV_WRAP_LOG");
+	if (!filename)
+		filename = "/tmp/viv_wrap.log";
+
+	/* the flight recorder has set up the file already. */
+	if (wrap_flight_size)
+		wrap_log_fd = open(filename, O_WRONLY | O_APPEND | O_CLOEXEC);
+	else
+		wrap_log_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC |
+				   O_CLOEXEC, 0644);
+	if (wrap_log_fd == -1) {
+		fprintf(stderr, "Error: failed to open wrap log %s: %s\n",
+			filename, strerror(errno));
+		wrap_log_fd = STDOUT_FILENO;
+		printf("viv_wrap: dumping to stdout.\n");
+	} else
+		printf("viv_wrap: dumping to %s.\n", filename);
+
+	if (wrap_log_binary && !wrap_flight_size) {
+		struct viv_record_file header = {
+			.magic = VIV_RECORD_MAGIC,
+			.version = VIV_RECORD_VERSION,
+			.header_size = sizeof(struct viv_record),
+		};
+
+		wrap_log_write(&header, sizeof(header));
+	}
+}
+
+/*
+ * Bypasses the rings, only for use with the drain mutex held.
+ */
+static void
+wrap_log_file_text(const char *text)
+{
+	if (wrap_log_binary) {
+		static const char padding[8];
+		struct viv_record record = {
+			.timestamp = wrap_time(),
+			.size = strlen(text),
+			.type = VIV_RECORD_TEXT,
+		};
+
+		wrap_log_write(&record, sizeof(record));
+		wrap_log_write(text, record.size);
+		wrap_log_write(padding,
+			       VIV_RECORD_ALIGN(record.size) - record.size);
+	} else
+		wrap_log_write(text, strlen(text));
+}
+
+/*
+ * Consumer side. Only ever run with the drain mutex held.
+ */
+static int
+wrap_log_writev(struct iovec *iov, int count)
+{
+	int total = 0;
+
+	while (count) {
+		ssize_t ret = writev(wrap_log_fd, iov, count);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: writev failed: %s\n", __func__,
+				strerror(errno));
+			return total;
+		}
+
+		total += ret;
+
+		/* skip over what was written, and continue the rest. */
+		while (count && (ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count) {
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+static unsigned int
+wrap_ring_queued(struct wrap_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+static void
+wrap_ring_report_drops(struct wrap_thread *thread, struct wrap_ring *ring)
+{
+	unsigned int dropped =
+		__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	char text[128];
+
+	if (dropped == ring->dropped_reported)
+		return;
+
+	snprintf(text, sizeof(text),
+		 "/* viv_wrap: thread %d dropped %u records. */\n",
+		 thread->tid, dropped - ring->dropped_reported);
+	wrap_log_file_text(text);
+
+	ring->dropped_reported = dropped;
+}
+
+/*
+ * Gathers everything which is queued up in all rings, and hands it to the
+ * kernel with as few writev() calls as possible.
+ */
+static int
+wrap_log_drain(void)
+{
+	struct iovec iov[WRAP_LOG_IOV_MAX];
+	struct wrap_ring *rings[WRAP_LOG_IOV_MAX / 2];
+	unsigned int heads[WRAP_LOG_IOV_MAX / 2];
+	struct wrap_thread *thread;
+	int iov_count = 0, ring_count = 0, total = 0, i;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		struct wrap_ring *ring =
+			__atomic_load_n(&thread->ring, __ATOMIC_ACQUIRE);
+		unsigned int head, start, length;
+
+		if (!ring)
+			continue;
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == ring->tail) {
+			wrap_ring_report_drops(thread, ring);
+			continue;
+		}
+
+		start = ring->tail & (ring->size - 1);
+		length = head - ring->tail;
+
+		if ((start + length) > ring->size) {
+			iov[iov_count].iov_base = ring->data + start;
+			iov[iov_count].iov_len = ring->size - start;
+			iov_count++;
+			iov[iov_count].iov_base = ring->data;
+			iov[iov_count].iov_len = start + length - ring->size;
+			iov_count++;
+		} else {
+			iov[iov_count].iov_base = ring->data + start;
+			iov[iov_count].iov_len = length;
+			iov_count++;
+		}
+
+		rings[ring_count] = ring;
+		heads[ring_count] = head;
+		ring_count++;
+
+		if ((iov_count + 2) > WRAP_LOG_IOV_MAX) {
+			total += wrap_log_writev(iov, iov_count);
+			for (i = 0; i < ring_count; i++)
+				__atomic_store_n(&rings[i]->tail, heads[i],
+						 __ATOMIC_RELEASE);
+			iov_count = 0;
+			ring_count = 0;
+		}
+
+		wrap_ring_report_drops(thread, ring);
+	}
+
+	if (iov_count) {
+		total += wrap_log_writev(iov, iov_count);
+		for (i = 0; i < ring_count; i++)
+			__atomic_store_n(&rings[i]->tail, heads[i],
+					 __ATOMIC_RELEASE);
+	}
+
+	return total;
+}
+
+static unsigned int
+wrap_log_queued(void)
+{
+	struct wrap_thread *thread;
+	unsigned int queued = 0;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		struct wrap_ring *ring =
+			__atomic_load_n(&thread->ring, __ATOMIC_ACQUIRE);
+
+		if (ring)
+			queued += wrap_ring_queued(ring);
+	}
+
+	return queued;
+}
+
+/*
+ * Work which the modules leave for us, writing out files other than the
+ * log and such, so that the application threads never block on it.
+ */
+static void
+wrap_log_side_flush(void)
+{
+	if (wrap_timeline_enabled)
+		wrap_timeline_flush();
+	if (wrap_dedup_enabled)
+		wrap_dedup_flush();
+	if (wrap_address_enabled)
+		wrap_address_drain();
+}
+
+static void *
+wrap_log_writer(void *data)
+{
+	uint64_t queued_since = 0, synced = 0, written = 0;
+	int idle = WRAP_LOG_IDLE_MIN;
+	sigset_t set;
+
+	/* never run the signal handlers, they drain too. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!__atomic_load_n(&wrap_log_stop, __ATOMIC_ACQUIRE)) {
+		unsigned int queued = wrap_log_queued();
+		uint64_t now = wrap_time();
+
+		wrap_log_side_flush();
+
+		if (!queued) {
+			queued_since = 0;
+
+			if (wrap_log_fsync_ms && (written > synced) &&
+			    ((now - written) >= (wrap_log_fsync_ms * 1000000ULL))) {
+				fdatasync(wrap_log_fd);
+				synced = now;
+			}
+
+			usleep(idle);
+			if (idle < WRAP_LOG_IDLE_MAX)
+				idle *= 2;
+			continue;
+		}
+
+		idle = WRAP_LOG_IDLE_MIN;
+
+		if (!queued_since)
+			queued_since = now;
+
+		if ((queued < wrap_log_batch) &&
+		    ((now - queued_since) < (wrap_log_flush_ms * 1000000ULL))) {
+			usleep(idle);
+			continue;
+		}
+
+		pthread_mutex_lock(wrap_log_drain_mutex);
+		wrap_log_drain();
+		pthread_mutex_unlock(wrap_log_drain_mutex);
+
+		queued_since = 0;
+		written = now;
+
+		if (wrap_log_fsync_ms &&
+		    ((now - synced) >= (wrap_log_fsync_ms * 1000000ULL))) {
+			fdatasync(wrap_log_fd);
+			synced = now;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *
+ * Memory mapped mode: every record lands in the page cache as soon as the
+ * hook is done, so nothing gets lost when the process gets killed. No
+ * rings and no writer thread are involved, so this is also safe to use
+ * from signal handlers.
+ *
+ */
+static void
+wrap_log_map_open(void)
+{
+	struct viv_record_mmap *map;
+	char *filename;
+	int fd;
+
+	filename = getenv("VIV_WRAP_LOG");
+	if (!filename)
+		filename = "/tmp/viv_wrap.log";
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error: failed to open wrap log %s: %s\n",
+			filename, strerror(errno));
+		exit(-1);
+	}
+
+	/* actually allocate, so that we never take a SIGBUS. */
+	errno = posix_fallocate(fd, 0, wrap_log_map_size);
+	if (errno) {
+		fprintf(stderr, "Error: failed to allocate %u bytes for %s: "
+			"%s\n", wrap_log_map_size, filename, strerror(errno));
+		exit(-1);
+	}
+
+	map = mmap(NULL, wrap_log_map_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error: failed to map %s: %s\n", filename,
+			strerror(errno));
+		exit(-1);
+	}
+
+	memcpy(map->file.magic, VIV_RECORD_MMAP_MAGIC,
+	       sizeof(VIV_RECORD_MMAP_MAGIC));
+	map->file.version = VIV_RECORD_VERSION;
+	map->file.header_size = sizeof(struct viv_record);
+	map->data = VIV_RECORD_ALIGN(sizeof(struct viv_record_mmap));
+	map->size = wrap_log_map_size;
+	map->reserved = map->data;
+	map->committed = map->data;
+
+	/* the mapping holds its own reference. */
+	wrap_log_fd = fd;
+	wrap_log_map = map;
+
+	printf("viv_wrap: dumping to %s (mapped, %u bytes).\n", filename,
+	       wrap_log_map_size);
+}
+
+static void
+wrap_log_map_advance(struct viv_record_mmap *map)
+{
+	uint64_t committed = __atomic_load_n(&map->committed, __ATOMIC_ACQUIRE);
+
+	while (committed < map->size) {
+		struct viv_record_frame *frame =
+			(struct viv_record_frame *) ((char *) map + committed);
+
+		if (__atomic_load_n(&frame->commit, __ATOMIC_ACQUIRE) !=
+		    VIV_RECORD_COMMITTED)
+			break;
+
+		/* if this fails, someone else moved it, continue from there. */
+		if (__atomic_compare_exchange_n(&map->committed, &committed,
+						committed + frame->length, 0,
+						__ATOMIC_RELEASE,
+						__ATOMIC_ACQUIRE))
+			committed += frame->length;
+	}
+}
+
+static int
+wrap_log_map_record(struct viv_record *record, const void *data)
+{
+	struct viv_record_mmap *map = wrap_log_map;
+	struct viv_record_frame *frame;
+	unsigned int length;
+	uint64_t offset;
+	char *buffer;
+
+	length = sizeof(struct viv_record_frame) + sizeof(struct viv_record) +
+		VIV_RECORD_ALIGN(record->size);
+
+	offset = __atomic_fetch_add(&map->reserved, length, __ATOMIC_RELAXED);
+	if ((offset + length) > map->size) {
+		__atomic_fetch_add(&map->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	frame = (struct viv_record_frame *) ((char *) map + offset);
+	frame->length = length;
+
+	/* the file was zeroed, so there is no need to write the padding. */
+	buffer = (char *) (frame + 1);
+	memcpy(buffer, record, sizeof(struct viv_record));
+	memcpy(buffer + sizeof(struct viv_record), data, record->size);
+
+	__atomic_store_n(&frame->commit, VIV_RECORD_COMMITTED,
+			 __ATOMIC_RELEASE);
+
+	wrap_log_map_advance(map);
+
+	return 0;
+}
+
+static void *
+wrap_log_map_syncer(void *data)
+{
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!__atomic_load_n(&wrap_log_stop, __ATOMIC_ACQUIRE)) {
+		usleep((wrap_log_fsync_ms ? wrap_log_fsync_ms :
+			wrap_log_flush_ms) * 1000);
+
+		wrap_log_side_flush();
+
+		if (wrap_log_fsync_ms)
+			msync(wrap_log_map, wrap_log_map_size, MS_SYNC);
+	}
+
+	return NULL;
+}
+
+static void
+wrap_log_atfork_child(void)
+{
+	struct wrap_thread *thread;
+
+	pthread_mutex_init(wrap_log_start_mutex, NULL);
+	pthread_mutex_init(wrap_log_drain_mutex, NULL);
+
+	/* whatever the parent had queued up is the parents business. */
+	for (thread = wrap_thread_first(); thread; thread = thread->next)
+		if (thread->ring) {
+			thread->ring->head = thread->ring->pending;
+			thread->ring->tail = thread->ring->pending;
+		}
+
+	wrap_thread_atfork_child();
+
+	wrap_log_started = 0;
+	wrap_log_stop = 0;
+	wrap_log_writer_running = 0;
+}
+
+/*
+ * Normally happens with the first thing logged, modules which need the
+ * writer thread for their own files start it earlier.
+ */
+void
+wrap_log_start(void)
+{
+	void *(*thread_func)(void *) = wrap_log_writer;
+	int ret;
+
+	pthread_mutex_lock(wrap_log_start_mutex);
+
+	if (!wrap_log_started) {
+		if (wrap_log_map_size) {
+			if (!wrap_log_map)
+				wrap_log_map_open();
+
+			/* to survive a reboot, and for the other files. */
+			thread_func = wrap_log_map_syncer;
+		} else
+			wrap_log_open();
+
+		ret = pthread_create(&wrap_log_writer_thread, NULL,
+				     thread_func, NULL);
+		if (ret) {
+			fprintf(stderr, "%s: failed to create writer: %s\n",
+				__func__, strerror(ret));
+			exit(-1);
+		}
+		wrap_log_writer_running = 1;
+
+		if (!wrap_log_atfork_registered) {
+			pthread_atfork(NULL, NULL, wrap_log_atfork_child);
+			wrap_log_atfork_registered = 1;
+		}
+
+		__atomic_store_n(&wrap_log_started, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(wrap_log_start_mutex);
+}
+
+void
+wrap_log_init(void)
+{
+	char *format = getenv("VIV_WRAP_FORMAT");
+	unsigned int size;
+	int map_size;
+
+	if (format && !strcmp(format, "binary"))
+		wrap_log_binary = 1;
+
+	wrap_log_batch = wrap_getenv_int("VIV_WRAP_BATCH", wrap_log_batch);
+	wrap_log_flush_ms = wrap_getenv_int("VIV_WRAP_FLUSH_MS",
+					    wrap_log_flush_ms);
+	wrap_log_fsync_ms = wrap_getenv_int("VIV_WRAP_FSYNC_MS",
+					    wrap_log_fsync_ms);
+
+	/* in MB, implies a binary log. */
+	map_size = wrap_getenv_int("VIV_WRAP_MMAP", 0);
+	if ((map_size < 0) || (map_size >= (1 << 12))) {
+		fprintf(stderr, "viv_wrap: ignoring invalid VIV_WRAP_MMAP=%d, "
+			"it has to lie between 1 and 4095MB\n", map_size);
+		map_size = 0;
+	}
+
+	/* the flight recorder dumps into the very same file. */
+	if (map_size && (wrap_getenv_int("VIV_WRAP_FLIGHT", 0) > 0)) {
+		fprintf(stderr, "viv_wrap: VIV_WRAP_MMAP is ignored when "
+			"VIV_WRAP_FLIGHT is set.\n");
+		map_size = 0;
+	}
+
+	if (map_size) {
+		wrap_log_map_size = (unsigned int) map_size << 20;
+		wrap_log_binary = 1;
+	}
+
+	size = wrap_getenv_int("VIV_WRAP_RING_SIZE", wrap_ring_size);
+	if (size >= WRAP_LOG_LINE_MAX) {
+		/* round down to a power of two. */
+		while (size & (size - 1))
+			size &= size - 1;
+		wrap_ring_size = size;
+	}
+}
+
+static struct wrap_ring *
+wrap_ring_get(void)
+{
+	struct wrap_thread *thread = wrap_thread_get();
+	struct wrap_ring *ring = thread->ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(struct wrap_ring) + wrap_ring_size);
+	if (!ring) {
+		fprintf(stderr, "%s: failed to allocate ring\n", __func__);
+		exit(-1);
+	}
+	ring->size = wrap_ring_size;
+
+	__atomic_store_n(&thread->ring, ring, __ATOMIC_RELEASE);
+
+	return ring;
+}
+
+static void
+wrap_ring_publish(struct wrap_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->pending, __ATOMIC_RELEASE);
+}
+
+/*
+ * Producer side, only ever called by the thread owning the ring.
+ *
+ * We never wait for the writer, this would stall the very thread which
+ * is submitting to the gpu. When the ring is full, the record is dropped
+ * and counted, and the writer notes this in the log.
+ */
+static int
+wrap_ring_reserve(struct wrap_ring *ring, unsigned int length)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if ((ring->size - (ring->pending - tail)) >= length)
+		return 0;
+
+	wrap_ring_publish(ring);
+	__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+
+	return -1;
+}
+
+static void
+wrap_ring_copy(struct wrap_ring *ring, const void *data, unsigned int length)
+{
+	const char *buffer = data;
+	unsigned int start = ring->pending & (ring->size - 1);
+
+	if ((start + length) > ring->size) {
+		memcpy(ring->data + start, buffer, ring->size - start);
+		memcpy(ring->data, buffer + ring->size - start,
+		       start + length - ring->size);
+	} else
+		memcpy(ring->data + start, buffer, length);
+
+	ring->pending += length;
+}
+
+int
+wrap_log(const char *format, ...)
+{
+	char buffer[WRAP_LOG_LINE_MAX];
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	ret = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	if (ret <= 0)
+		return ret;
+
+	if (ret >= sizeof(buffer))
+		ret = sizeof(buffer) - 1;
+
+	if (wrap_log_binary) {
+		struct viv_record record = {
+			.size = ret,
+			.type = VIV_RECORD_TEXT,
+		};
+
+		wrap_log_record(&record, buffer);
+	} else {
+		struct wrap_ring *ring;
+
+		if (!__atomic_load_n(&wrap_log_started, __ATOMIC_ACQUIRE))
+			wrap_log_start();
+
+		ring = wrap_ring_get();
+		if (wrap_ring_reserve(ring, ret))
+			return 0;
+		wrap_ring_copy(ring, buffer, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Queues up a binary record, the payload is copied verbatim. The caller
+ * fills in the header, timestamp and thread id are filled in here when
+ * left empty.
+ */
+int
+wrap_log_record(struct viv_record *record, const void *data)
+{
+	static const char padding[8];
+	struct wrap_ring *ring;
+	unsigned int length;
+
+	if (!__atomic_load_n(&wrap_log_started, __ATOMIC_ACQUIRE))
+		wrap_log_start();
+
+	if (!record->timestamp)
+		record->timestamp = wrap_time();
+	if (!record->tid)
+		record->tid = wrap_thread_get()->tid;
+
+	if (wrap_log_map)
+		return wrap_log_map_record(record, data);
+
+	ring = wrap_ring_get();
+
+	length = sizeof(*record) + VIV_RECORD_ALIGN(record->size);
+	if (length > ring->size) {
+		fprintf(stderr, "%s: record of %d bytes does not fit.\n",
+			__func__, record->size);
+		return -1;
+	}
+
+	if (wrap_ring_reserve(ring, length))
+		return 0;
+
+	wrap_ring_copy(ring, record, sizeof(*record));
+	wrap_ring_copy(ring, data, record->size);
+	wrap_ring_copy(ring, padding,
+		       VIV_RECORD_ALIGN(record->size) - record->size);
+
+	return 0;
+}
+
+/*
+ * Makes everything this thread logged so far visible to the writer. Called
+ * at the end of each hook, so that multi-line output of one hook is never
+ * interleaved with the output of another thread.
+ */
+void
+wrap_log_commit(void)
+{
+	struct wrap_thread *thread = wrap_thread_get();
+
+	if (thread->ring)
+		wrap_ring_publish(thread->ring);
+}
+
+/*
+ * Whether length more bytes of text, or of a record and its header, fit in
+ * the ring of this thread right now, so that large output can be dropped
+ * as a whole, and noted as such. The mapped file keeps its own count.
+ */
+int
+wrap_log_room(unsigned int length)
+{
+	struct wrap_ring *ring;
+	unsigned int tail;
+
+	if (wrap_log_map)
+		return 1;
+
+	ring = wrap_ring_get();
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	return (ring->size - (ring->pending - tail)) >= length;
+}
+
+void
+wrap_log_flush(int signum)
+{
+	if (wrap_log_map) {
+		struct viv_record record = {
+			.size = 9,
+			.type = VIV_RECORD_TEXT,
+		};
+
+		wrap_log_record(&record, "SIG_INT!\n");
+	} else if (wrap_log_fd != -1) {
+		pthread_mutex_lock(wrap_log_drain_mutex);
+		wrap_log_drain();
+		wrap_log_file_text("SIG_INT!\n");
+		pthread_mutex_unlock(wrap_log_drain_mutex);
+	}
+
+	signal(SIGINT, SIG_DFL);
+}
+
+void
+wrap_log_close(void)
+{
+	if (!__atomic_load_n(&wrap_log_started, __ATOMIC_ACQUIRE))
+		return;
+
+	if (wrap_log_writer_running) {
+		__atomic_store_n(&wrap_log_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(wrap_log_writer_thread, NULL);
+		wrap_log_writer_running = 0;
+	}
+
+	if (wrap_log_map) {
+		/* stays mapped, late records are still welcome. */
+		if (wrap_log_fsync_ms)
+			msync(wrap_log_map, wrap_log_map_size, MS_SYNC);
+	} else {
+		wrap_log_commit();
+
+		pthread_mutex_lock(wrap_log_drain_mutex);
+		wrap_log_drain();
+		if (wrap_log_fsync_ms)
+			fdatasync(wrap_log_fd);
+		pthread_mutex_unlock(wrap_log_drain_mutex);
+	}
+
+	wrap_log_started = 0;
+	wrap_log_stop = 0;
+}
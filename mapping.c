@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * CPU mappings of galcore memory.
+ *
+ * Memory gets mapped into the process in two ways: by mmap() on the
+ * galcore fd, and by the kernel itself, during MAP_MEMORY. Both are kept
+ * track of here, with size, offset, protection and when they were made,
+ * so that the address space and page table updates this costs us can be
+ * counted.
+ *
+ * Mappings are also grouped by what they map: offset and size for mmap(),
+ * physical address and size for MAP_MEMORY. The same memory getting mapped
+ * and unmapped over and over again shows up there.
+ *
+ * None of this happens often, so a plain mutex and arrays will do.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define MAPPING_PAGE 4096
+#define MAPPING_KINDS 256
+
+enum mapping_source {
+	MAPPING_MMAP,
+	MAPPING_MAP_MEMORY,
+};
+
+struct mapping_kind {
+	int source;
+	uint64_t offset; /* or physical address. */
+	uint64_t size;
+
+	uint64_t maps;
+	uint64_t unmaps;
+	uint64_t lifetime; /* total. */
+};
+
+struct mapping {
+	uint64_t address;
+	uint64_t size; /* what is still mapped. */
+	uint64_t offset;
+	int prot;
+	int flags;
+	uint64_t mapped;
+	struct mapping_kind *kind;
+};
+
+int wrap_mapping_enabled;
+
+static pthread_mutex_t mapping_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct mapping *mappings;
+static int mapping_count;
+static int mapping_size;
+
+static struct mapping_kind mapping_kinds[MAPPING_KINDS];
+static int mapping_kind_count;
+
+static uint64_t mapping_bytes;
+static uint64_t mapping_peak;
+static uint64_t mapping_pages_mapped;
+static uint64_t mapping_pages_unmapped;
+static uint64_t mapping_mmaps;
+static uint64_t mapping_munmaps;
+static uint64_t mapping_physical_maps;
+static uint64_t mapping_physical_unmaps;
+
+static const char *
+mapping_source_name(int source)
+{
+	if (source == MAPPING_MAP_MEMORY)
+		return "MAP_MEMORY";
+	return "mmap";
+}
+
+static uint64_t
+mapping_pages(uint64_t bytes)
+{
+	return (bytes + MAPPING_PAGE - 1) / MAPPING_PAGE;
+}
+
+static struct mapping_kind *
+mapping_kind_get(int source, uint64_t offset, uint64_t size)
+{
+	struct mapping_kind *kind;
+	int i;
+
+	for (i = 0; i < mapping_kind_count; i++) {
+		kind = &mapping_kinds[i];
+
+		if ((kind->source == source) && (kind->offset == offset) &&
+		    (kind->size == size))
+			return kind;
+	}
+
+	if (mapping_kind_count == MAPPING_KINDS)
+		return NULL;
+
+	kind = &mapping_kinds[mapping_kind_count++];
+	kind->source = source;
+	kind->offset = offset;
+	kind->size = size;
+
+	return kind;
+}
+
+static void
+mapping_add(int source, uint64_t address, uint64_t size, uint64_t offset,
+	    int prot, int flags)
+{
+	struct mapping *mapping;
+
+	pthread_mutex_lock(mapping_mutex);
+
+	if (mapping_count == mapping_size) {
+		int count = mapping_size ? mapping_size * 2 : 64;
+		struct mapping *new = realloc(mappings,
+					      count * sizeof(struct mapping));
+
+		if (!new) {
+			fprintf(stderr, "%s: failed to grow mappings\n",
+				__func__);
+			pthread_mutex_unlock(mapping_mutex);
+			return;
+		}
+		mappings = new;
+		mapping_size = count;
+	}
+
+	mapping = &mappings[mapping_count++];
+	mapping->address = address;
+	mapping->size = size;
+	mapping->offset = offset;
+	mapping->prot = prot;
+	mapping->flags = flags;
+	mapping->mapped = wrap_time();
+	mapping->kind = mapping_kind_get(source, offset, size);
+	if (mapping->kind)
+		mapping->kind->maps++;
+
+	mapping_bytes += size;
+	if (mapping_bytes > mapping_peak)
+		mapping_peak = mapping_bytes;
+	mapping_pages_mapped += mapping_pages(size);
+
+	pthread_mutex_unlock(mapping_mutex);
+}
+
+/*
+ * Whatever part of our mappings falls inside this range is gone.
+ */
+static void
+mapping_remove(uint64_t address, uint64_t size, int source)
+{
+	uint64_t end = address + size, now = 0;
+	int i, found = 0;
+
+	pthread_mutex_lock(mapping_mutex);
+
+	for (i = 0; i < mapping_count; i++) {
+		struct mapping *mapping = &mappings[i];
+		uint64_t start = mapping->address, stop, overlap;
+
+		stop = start + mapping->size;
+		if ((start >= end) || (stop <= address))
+			continue;
+
+		overlap = ((stop < end) ? stop : end) -
+			((start > address) ? start : address);
+
+		found = 1;
+		mapping->size -= overlap;
+		mapping_bytes -= overlap;
+		mapping_pages_unmapped += mapping_pages(overlap);
+
+		if (mapping->size)
+			continue;
+
+		if (!now)
+			now = wrap_time();
+
+		if (mapping->kind) {
+			mapping->kind->unmaps++;
+			mapping->kind->lifetime += now - mapping->mapped;
+		}
+
+		*mapping = mappings[--mapping_count];
+		i--;
+	}
+
+	if (found && (source == MAPPING_MMAP))
+		mapping_munmaps++;
+
+	pthread_mutex_unlock(mapping_mutex);
+}
+
+static void
+mapping_prot_string(int prot, char *string)
+{
+	string[0] = (prot & PROT_READ) ? 'r' : '-';
+	string[1] = (prot & PROT_WRITE) ? 'w' : '-';
+	string[2] = (prot & PROT_EXEC) ? 'x' : '-';
+	string[3] = 0;
+}
+
+/*
+ * mmap() of the galcore fd, after the fact. Only logged when traced.
+ */
+void
+wrap_mapping_mmap(void *address, size_t size, int prot, int flags,
+		  uint64_t offset, int traced)
+{
+	char string[4];
+
+	__atomic_add_fetch(&mapping_mmaps, 1, __ATOMIC_RELAXED);
+
+	if (traced) {
+		mapping_prot_string(prot, string);
+		wrap_log("/* viv_wrap: mmap(galcore, 0x%llX bytes, offset "
+			 "0x%llX, %s%s) = %p */\n", (unsigned long long) size,
+			 (unsigned long long) offset, string,
+			 (flags & MAP_SHARED) ? ", shared" : "", address);
+		wrap_log_commit();
+	}
+
+	if (address == MAP_FAILED)
+		return;
+
+	mapping_add(MAPPING_MMAP, (uintptr_t) address, size, offset, prot,
+		    flags);
+}
+
+/*
+ * Every munmap(), we do not know which fd was mapped.
+ */
+void
+wrap_mapping_munmap(void *address, size_t size)
+{
+	if (!__atomic_load_n(&mapping_count, __ATOMIC_RELAXED))
+		return;
+
+	mapping_remove((uintptr_t) address, size, MAPPING_MMAP);
+}
+
+/*
+ * Mappings which the kernel makes for us, for successful calls only.
+ */
+void
+wrap_mapping_post(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+
+	switch (interface->command) {
+	case gcvHAL_MAP_MEMORY:
+		mapping_add(MAPPING_MAP_MEMORY,
+			    interface->u.MapMemory.logical,
+			    interface->u.MapMemory.bytes,
+			    interface->u.MapMemory.physical,
+			    PROT_READ | PROT_WRITE, MAP_SHARED);
+		break;
+	case gcvHAL_UNMAP_MEMORY:
+		mapping_remove(interface->u.UnmapMemory.logical,
+			       interface->u.UnmapMemory.bytes,
+			       MAPPING_MAP_MEMORY);
+		break;
+	case gcvHAL_MAP_PHYSICAL:
+		if (interface->u.MapPhysical.map)
+			__atomic_add_fetch(&mapping_physical_maps, 1,
+					   __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&mapping_physical_unmaps, 1,
+					   __ATOMIC_RELAXED);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Can be called by the application at any time.
+ */
+void
+viv_wrap_mapping_dump(void)
+{
+	uint64_t now = wrap_time();
+	int i, header = 0;
+
+	if (!wrap_mapping_enabled)
+		return;
+
+	pthread_mutex_lock(mapping_mutex);
+
+	wrap_log("/* viv_wrap: galcore mappings: %d live, %llu bytes, peak %llu "
+		 "bytes; %llu mmap, %llu munmap, %llu pages mapped, %llu "
+		 "unmapped; MAP_PHYSICAL %llu, unmapped %llu.\n",
+		 mapping_count, (unsigned long long) mapping_bytes,
+		 (unsigned long long) mapping_peak,
+		 (unsigned long long) mapping_mmaps,
+		 (unsigned long long) mapping_munmaps,
+		 (unsigned long long) mapping_pages_mapped,
+		 (unsigned long long) mapping_pages_unmapped,
+		 (unsigned long long) mapping_physical_maps,
+		 (unsigned long long) mapping_physical_unmaps);
+
+	for (i = 0; i < mapping_count; i++) {
+		struct mapping *mapping = &mappings[i];
+		char string[4];
+
+		mapping_prot_string(mapping->prot, string);
+		wrap_log(" * %s 0x%08llX: 0x%llX bytes, offset 0x%llX, %s, "
+			 "age %llums\n", mapping->kind ?
+			 mapping_source_name(mapping->kind->source) : "?",
+			 (unsigned long long) mapping->address,
+			 (unsigned long long) mapping->size,
+			 (unsigned long long) mapping->offset, string,
+			 (unsigned long long) (now - mapping->mapped) / 1000000);
+	}
+
+	for (i = 0; i < mapping_kind_count; i++) {
+		struct mapping_kind *kind = &mapping_kinds[i];
+
+		if (kind->maps < 2)
+			continue;
+
+		if (!header) {
+			wrap_log(" * mapped repeatedly:\n");
+			header = 1;
+		}
+
+		wrap_log(" *   %s 0x%llX, 0x%llX bytes: mapped %llu times, "
+			 "unmapped %llu times, lived %lluus on average\n",
+			 mapping_source_name(kind->source),
+			 (unsigned long long) kind->offset,
+			 (unsigned long long) kind->size,
+			 (unsigned long long) kind->maps,
+			 (unsigned long long) kind->unmaps,
+			 (unsigned long long) (kind->unmaps ?
+			 kind->lifetime / kind->unmaps / 1000 : 0));
+	}
+
+	if (mapping_kind_count == MAPPING_KINDS)
+		wrap_log(" * too many different mappings, not all are "
+			 "grouped.\n");
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	pthread_mutex_unlock(mapping_mutex);
+}
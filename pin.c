@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Pinned user memory.
+ *
+ * MAP_USER_MEMORY hands a range of our own memory to the gpu: the kernel
+ * pins the pages and hands back a gpu address, until UNMAP_USER_MEMORY.
+ * Imported buffers, like those of a camera, tend to come in this way.
+ *
+ * Every live pin is kept, with its gpu address and since when, and so are
+ * the bytes pinned. Pins are also grouped by user range, base and size,
+ * so a buffer which keeps on getting pinned and unpinned again stands
+ * out, as each cycle costs a page walk in the kernel. Such a buffer gets
+ * a warning in the trace, the first time it is pinned PIN_REPEAT times.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define PIN_BUFFERS 256
+#define PIN_REPEAT 4
+
+struct pin_buffer {
+	uint64_t memory;
+	uint64_t size;
+
+	uint64_t pins;
+	uint64_t unpins;
+	uint64_t pinned; /* total time. */
+};
+
+struct pin {
+	uint64_t memory;
+	uint64_t size;
+	uint32_t info;
+	uint32_t address;
+	uint64_t pinned;
+	struct pin_buffer *buffer;
+};
+
+int wrap_pin_enabled;
+
+static pthread_mutex_t pin_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct pin *pins;
+static int pin_count;
+static int pin_size;
+
+static struct pin_buffer pin_buffers[PIN_BUFFERS];
+static int pin_buffer_count;
+
+static uint64_t pin_bytes;
+static uint64_t pin_peak;
+static uint64_t pin_total; /* bytes, ever. */
+static uint64_t pin_pins;
+static uint64_t pin_unpins;
+static uint64_t pin_unknown; /* unpins of what we did not see pinned. */
+
+static struct pin_buffer *
+pin_buffer_get(uint64_t memory, uint64_t size)
+{
+	struct pin_buffer *buffer;
+	int i;
+
+	for (i = 0; i < pin_buffer_count; i++) {
+		buffer = &pin_buffers[i];
+
+		if ((buffer->memory == memory) && (buffer->size == size))
+			return buffer;
+	}
+
+	if (pin_buffer_count == PIN_BUFFERS)
+		return NULL;
+
+	buffer = &pin_buffers[pin_buffer_count++];
+	buffer->memory = memory;
+	buffer->size = size;
+
+	return buffer;
+}
+
+static void
+pin_add(struct _gcsHAL_MAP_USER_MEMORY *map)
+{
+	struct pin *pin;
+
+	if (pin_count == pin_size) {
+		int count = pin_size ? pin_size * 2 : 64;
+		struct pin *new = realloc(pins, count * sizeof(struct pin));
+
+		if (!new) {
+			fprintf(stderr, "%s: failed to grow pins\n", __func__);
+			return;
+		}
+		pins = new;
+		pin_size = count;
+	}
+
+	pin = &pins[pin_count++];
+	pin->memory = map->memory;
+	pin->size = map->size;
+	pin->info = map->info;
+	pin->address = map->address;
+	pin->pinned = wrap_time();
+	pin->buffer = pin_buffer_get(map->memory, map->size);
+
+	pin_pins++;
+	pin_bytes += map->size;
+	pin_total += map->size;
+	if (pin_bytes > pin_peak)
+		pin_peak = pin_bytes;
+
+	if (!pin->buffer)
+		return;
+
+	pin->buffer->pins++;
+	if (pin->buffer->pins == PIN_REPEAT) {
+		wrap_log("/* viv_wrap: user memory 0x%08llX (0x%llX bytes) "
+			 "pinned %d times now, held %lluus on average. */\n",
+			 (unsigned long long) map->memory,
+			 (unsigned long long) map->size, PIN_REPEAT,
+			 (unsigned long long) (pin->buffer->unpins ?
+			 pin->buffer->pinned / pin->buffer->unpins / 1000 : 0));
+		wrap_log_commit();
+	}
+}
+
+static void
+pin_remove(struct _gcsHAL_UNMAP_USER_MEMORY *unmap)
+{
+	struct pin *pin = NULL;
+	int i;
+
+	pin_unpins++;
+
+	/* info is what the kernel knows it by, memory should match too. */
+	for (i = 0; i < pin_count; i++)
+		if ((pins[i].info == unmap->info) &&
+		    (pins[i].memory == unmap->memory)) {
+			pin = &pins[i];
+			break;
+		}
+
+	if (!pin) {
+		pin_unknown++;
+		return;
+	}
+
+	pin_bytes -= pin->size;
+
+	if (pin->buffer) {
+		pin->buffer->unpins++;
+		pin->buffer->pinned += wrap_time() - pin->pinned;
+	}
+
+	*pin = pins[--pin_count];
+}
+
+/*
+ * Called for successfully completed ioctls only.
+ */
+void
+wrap_pin_post(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+
+	switch (interface->command) {
+	case gcvHAL_MAP_USER_MEMORY:
+		pthread_mutex_lock(pin_mutex);
+		pin_add(&interface->u.MapUserMemory);
+		pthread_mutex_unlock(pin_mutex);
+		break;
+	case gcvHAL_UNMAP_USER_MEMORY:
+		pthread_mutex_lock(pin_mutex);
+		pin_remove(&interface->u.UnmapUserMemory);
+		pthread_mutex_unlock(pin_mutex);
+		break;
+	default:
+		break;
+	}
+}
+
+uint64_t
+wrap_pin_bytes(void)
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(pin_mutex);
+	bytes = pin_bytes;
+	pthread_mutex_unlock(pin_mutex);
+
+	return bytes;
+}
+
+/*
+ * Can be called by the application at any time.
+ */
+void
+viv_wrap_pin_dump(void)
+{
+	uint64_t now = wrap_time();
+	int i, header = 0;
+
+	if (!wrap_pin_enabled)
+		return;
+
+	pthread_mutex_lock(pin_mutex);
+
+	wrap_log("/* viv_wrap: pinned user memory: %d live, %llu bytes, peak "
+		 "%llu bytes, %llu bytes pinned in total; %llu pins, %llu "
+		 "unpins, %llu unknown.\n", pin_count,
+		 (unsigned long long) pin_bytes,
+		 (unsigned long long) pin_peak,
+		 (unsigned long long) pin_total,
+		 (unsigned long long) pin_pins,
+		 (unsigned long long) pin_unpins,
+		 (unsigned long long) pin_unknown);
+
+	for (i = 0; i < pin_count; i++) {
+		struct pin *pin = &pins[i];
+
+		wrap_log(" * 0x%08llX: 0x%llX bytes, info 0x%08X, address "
+			 "0x%08X, pinned %llums\n",
+			 (unsigned long long) pin->memory,
+			 (unsigned long long) pin->size, pin->info, pin->address,
+			 (unsigned long long) (now - pin->pinned) / 1000000);
+	}
+
+	for (i = 0; i < pin_buffer_count; i++) {
+		struct pin_buffer *buffer = &pin_buffers[i];
+
+		if (buffer->pins < 2)
+			continue;
+
+		if (!header) {
+			wrap_log(" * pinned repeatedly:\n");
+			header = 1;
+		}
+
+		wrap_log(" *   0x%08llX, 0x%llX bytes: pinned %llu times, "
+			 "unpinned %llu times, held %lluus on average\n",
+			 (unsigned long long) buffer->memory,
+			 (unsigned long long) buffer->size,
+			 (unsigned long long) buffer->pins,
+			 (unsigned long long) buffer->unpins,
+			 (unsigned long long) (buffer->unpins ?
+			 buffer->pinned / buffer->unpins / 1000 : 0));
+	}
+
+	if (pin_buffer_count == PIN_BUFFERS)
+		wrap_log(" * too many different buffers, not all are "
+			 "grouped.\n");
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	pthread_mutex_unlock(pin_mutex);
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Event queue walker.
+ *
+ * COMMIT and EVENT_COMMIT carry a chain of gcsQUEUE entries, each with a
+ * complete gcsHAL_INTERFACE inside. These are the frees, unlocks and
+ * signals which the kernel only executes once the gpu gets to that point
+ * in the stream. Each of them gets pushed through the usual pre hook,
+ * marked as deferred, and they get counted, per commit and overall.
+ *
+ * The walker itself is also used by wrap.c, to hand the frees and unlocks
+ * in there to the trackers, whether we trace or not.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define QUEUE_MAX 1024 /* entries per chain, in case it loops. */
+#define QUEUE_COMMANDS 256
+
+/*
+ * Not part of the kernel headers either.
+ */
+struct queue_entry {
+	gctUINT64 next;
+	gcsHAL_INTERFACE interface;
+};
+
+int wrap_queue_enabled;
+
+static pthread_mutex_t queue_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t queue_commits; /* with a queue. */
+static uint64_t queue_entries;
+static uint64_t queue_max;
+static uint64_t queue_truncated;
+static uint64_t queue_commands[QUEUE_COMMANDS];
+
+static void
+queue_log_counts(uint64_t *counts)
+{
+	int i, first = 1;
+
+	for (i = 0; i < QUEUE_COMMANDS; i++) {
+		if (!counts[i])
+			continue;
+
+		wrap_log("%s %s %llu", first ? "" : ",",
+			 (i < command_table_count) ?
+			 command_table[i].name : "UNKNOWN",
+			 (unsigned long long) counts[i]);
+		first = 0;
+	}
+}
+
+static void
+queue_entry_log(gcsHAL_INTERFACE *interface, int hardware_type)
+{
+	const char *hardware;
+	struct wrap_command *entry;
+
+	if (interface->hardwareType)
+		hardware_type = interface->hardwareType;
+
+	if (wrap_log_binary) {
+		struct viv_record record = {
+			.size = sizeof(interface->u),
+			.type = VIV_RECORD_PRE,
+			.command = interface->command,
+			.hardware = hardware_type,
+			.flags = VIV_RECORD_FLAG_DEFERRED,
+		};
+
+		if (interface->command < command_table_count)
+			record.size = command_table[interface->command].size;
+		if (!record.size)
+			record.size = sizeof(interface->u);
+
+		wrap_log_record(&record, &interface->u);
+		return;
+	}
+
+	hardware = viv_hardware_type(hardware_type);
+	if ((interface->command >= command_table_count) || !hardware) {
+		wrap_log("\tdeferred command %d, hardware %d;\n",
+			 interface->command, hardware_type);
+		return;
+	}
+
+	entry = &command_table[interface->command];
+	wrap_log("\tdeferred ");
+	if (entry->pre(entry->name, hardware, &interface->u))
+		wrap_log("%s(%s);\n", entry->name, hardware);
+}
+
+/*
+ * Hands every entry in the queue of a COMMIT or EVENT_COMMIT to func,
+ * returns how many there were. Chains longer than QUEUE_MAX are cut
+ * short, in which case truncated gets set.
+ */
+int
+wrap_queue_foreach(void *data, void (*func)(void *entry, void *private),
+		   void *private, int *truncated)
+{
+	gcsHAL_INTERFACE *interface = data;
+	struct queue_entry *entry;
+	uint64_t next;
+	int count = 0;
+
+	if (interface->command == gcvHAL_COMMIT)
+		next = interface->u.Commit.queue;
+	else
+		next = interface->u.Event.queue;
+
+	for (; next && (count < QUEUE_MAX); next = entry->next, count++) {
+		entry = (struct queue_entry *) (uintptr_t) next;
+		func(&entry->interface, private);
+	}
+
+	if (truncated)
+		*truncated = next ? 1 : 0;
+
+	return count;
+}
+
+struct queue_walk {
+	uint64_t counts[QUEUE_COMMANDS];
+	int hardware_type;
+	int traced;
+};
+
+static void
+queue_walk_entry(void *data, void *private)
+{
+	gcsHAL_INTERFACE *interface = data;
+	struct queue_walk *walk = private;
+
+	if (walk->traced)
+		queue_entry_log(interface, walk->hardware_type);
+	walk->counts[interface->command & (QUEUE_COMMANDS - 1)]++;
+}
+
+/*
+ * Called right after the pre hook of a traced COMMIT or EVENT_COMMIT, or
+ * right before an untraced one is issued, which then only gets counted.
+ */
+void
+wrap_queue_walk(void *data, int traced)
+{
+	gcsHAL_INTERFACE *interface = data;
+	struct queue_walk walk;
+	int count, truncated, i;
+
+	if (!((interface->command == gcvHAL_COMMIT) ?
+	      interface->u.Commit.queue : interface->u.Event.queue))
+		return;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.hardware_type = interface->hardwareType;
+	walk.traced = traced;
+
+	count = wrap_queue_foreach(interface, queue_walk_entry, &walk,
+				   &truncated);
+
+	if (traced) {
+		wrap_log("\t/* %d deferred:", count);
+		queue_log_counts(walk.counts);
+		wrap_log(" */\n");
+	}
+
+	pthread_mutex_lock(queue_mutex);
+
+	queue_commits++;
+	queue_entries += count;
+	if (count > queue_max)
+		queue_max = count;
+	if (truncated)
+		queue_truncated++;
+	for (i = 0; i < QUEUE_COMMANDS; i++)
+		queue_commands[i] += walk.counts[i];
+
+	pthread_mutex_unlock(queue_mutex);
+}
+
+void
+viv_wrap_queue_stats(void)
+{
+	if (!wrap_queue_enabled)
+		return;
+
+	pthread_mutex_lock(queue_mutex);
+
+	wrap_log("/* viv_wrap: event queues: %llu commits with a queue, %llu "
+		 "deferred operations, %llu.%02llu on average, at most %llu:",
+		 (unsigned long long) queue_commits,
+		 (unsigned long long) queue_entries,
+		 (unsigned long long) (queue_commits ?
+		 queue_entries / queue_commits : 0),
+		 (unsigned long long) (queue_commits ?
+		 (queue_entries * 100 / queue_commits) % 100 : 0),
+		 (unsigned long long) queue_max);
+	queue_log_counts(queue_commands);
+	if (queue_truncated)
+		wrap_log("; %llu chains were longer than %d",
+			 (unsigned long long) queue_truncated, QUEUE_MAX);
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	pthread_mutex_unlock(queue_mutex);
+}
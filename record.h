@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Binary trace format, shared between the wrapper and vivwrap-decode.
+ *
+ * A file header is followed by a stream of records. Each record is a fixed
+ * header, followed by size bytes of payload, padded up to 8 bytes. For
+ * ioctls, the payload is the relevant member of the gcsHAL_INTERFACE union,
+ * verbatim. Blobs, like captured command buffers, follow the pre record of
+ * the ioctl they belong to. Everything is in the native byte order of the
+ * traced device.
+ */
+#ifndef RECORD_H
+#define RECORD_H 1
+
+#include <stdint.h>
+
+#define VIV_RECORD_MAGIC "VIVWRAP"
+#define VIV_RECORD_VERSION 2
+
+struct viv_record_file {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* sizeof(struct viv_record) */
+};
+
+enum viv_record_type {
+	VIV_RECORD_PRE = 1,
+	VIV_RECORD_POST = 2,
+	VIV_RECORD_TEXT = 3,
+	VIV_RECORD_BLOB = 4, /* raw data belonging to the previous record. */
+	VIV_RECORD_DELTA = 5, /* state delta records of the previous COMMIT. */
+	VIV_RECORD_BLOB_REF = 6, /* struct viv_blob_ref, blob is in the store. */
+};
+
+/*
+ * For post records, timestamp is taken right before the actual ioctl was
+ * issued, and duration is how long the kernel took. Everything else gets
+ * stamped when it was logged.
+ */
+struct viv_record {
+	uint64_t timestamp; /* monotonic, in ns */
+	uint64_t duration; /* in ns, post only */
+	uint32_t size; /* of the payload, without padding. */
+	uint32_t tid;
+	uint8_t type;
+	uint8_t command;
+	uint8_t hardware;
+	uint8_t flags; /* see below, COMMIT blobs: bytes of reserved tail. */
+	int32_t ret; /* ioctl return value, post only */
+	int32_t status; /* gcsHAL_INTERFACE status, post only */
+	uint32_t reserved;
+};
+
+/* pre records from an event queue, executed by the kernel later on. */
+#define VIV_RECORD_FLAG_DEFERRED 0x01
+
+#define VIV_RECORD_ALIGN(size) (((size) + 7) & ~7)
+
+/*
+ * Blob store, for deduplicated command buffers: a struct viv_record_file
+ * with its own magic, header_size being sizeof(struct viv_blob), followed
+ * by every distinct blob, once, each padded up to 8 bytes. Traces then
+ * only hold references to these.
+ */
+#define VIV_BLOB_MAGIC "VIVBLOB"
+
+struct viv_blob {
+	uint64_t hash;
+	uint32_t size; /* of the data, without padding. */
+	uint32_t reserved;
+};
+
+struct viv_blob_ref {
+	uint64_t hash;
+	uint32_t size;
+	uint32_t count; /* times submitted, this one included. */
+};
+
+/*
+ * Crash survivable variant: a pre-sized, memory mapped file, which the
+ * traced threads write to directly. Space is reserved by atomically
+ * bumping reserved, each record is preceded by a frame which only gets
+ * marked as committed once the record is complete. committed is only ever
+ * moved over a run of committed frames, so everything before it is
+ * guaranteed to be complete.
+ */
+#define VIV_RECORD_MMAP_MAGIC "VIVMMAP"
+#define VIV_RECORD_COMMITTED 0x54494D43 /* "CMIT" */
+
+struct viv_record_mmap {
+	struct viv_record_file file;
+	uint32_t data; /* offset of the first frame. */
+	uint32_t dropped;
+	uint64_t size; /* of the whole file. */
+	uint64_t reserved;
+	uint64_t committed;
+};
+
+struct viv_record_frame {
+	uint32_t length; /* including this frame. */
+	uint32_t commit;
+};
+
+#endif /* RECORD_H */
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Ioctl latency histograms.
+ *
+ * Every thread keeps its own set of histograms, one per command and
+ * hardware type, with USER_SIGNAL split up further by sub-command. Only
+ * the owning thread ever writes to them, so counting is just a few
+ * relaxed stores. For a summary, all threads get summed up, while they
+ * keep on running.
+ *
+ * Buckets are log-linear: every power of two of ns is split into
+ * STATS_SUB_BUCKETS linear steps, which keeps the error below 7%, all
+ * the way up to a minute.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 36 /* 68s, everything above ends up in the last. */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+#define STATS_HARDWARE 5 /* hardware types 1-4 */
+#define STATS_SIGNALS (gcvUSER_SIGNAL_UNMAP + 1)
+
+struct stats_histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct wrap_stats {
+	int count;
+	struct stats_histogram *rows[];
+};
+
+int wrap_stats_enabled;
+
+static int stats_dump_requested;
+
+/*
+ * First all commands, then the USER_SIGNAL sub-commands.
+ */
+static int
+stats_rows(void)
+{
+	return (command_table_count + STATS_SIGNALS) * STATS_HARDWARE;
+}
+
+static int
+stats_row(int command, int hardware, int signal)
+{
+	if ((hardware < 0) || (hardware >= STATS_HARDWARE))
+		return -1;
+
+	if (command == gcvHAL_USER_SIGNAL) {
+		if ((signal < 0) || (signal >= STATS_SIGNALS))
+			return -1;
+		command = command_table_count + signal;
+	} else if ((command < 0) || (command >= command_table_count))
+		return -1;
+
+	return command * STATS_HARDWARE + hardware;
+}
+
+static const char *
+stats_row_name(int row)
+{
+	static const char *signals[STATS_SIGNALS] = {
+		[gcvUSER_SIGNAL_CREATE] = "USER_SIGNAL CREATE",
+		[gcvUSER_SIGNAL_DESTROY] = "USER_SIGNAL DESTROY",
+		[gcvUSER_SIGNAL_SIGNAL] = "USER_SIGNAL SIGNAL",
+		[gcvUSER_SIGNAL_WAIT] = "USER_SIGNAL WAIT",
+		[gcvUSER_SIGNAL_MAP] = "USER_SIGNAL MAP",
+		[gcvUSER_SIGNAL_UNMAP] = "USER_SIGNAL UNMAP",
+	};
+	int command = row / STATS_HARDWARE;
+
+	if (command >= command_table_count)
+		return signals[command - command_table_count];
+
+	return command_table[command].name;
+}
+
+static int
+stats_bucket(uint64_t value)
+{
+	int bits;
+
+	if (value < STATS_SUB_BUCKETS)
+		return value;
+
+	bits = 63 - __builtin_clzll(value);
+	if (bits > STATS_MAX_BITS)
+		return STATS_BUCKETS - 1;
+
+	return ((bits - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+		((value >> (bits - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * Highest value which still ends up in this bucket.
+ */
+static uint64_t
+stats_bucket_value(int bucket)
+{
+	int bits = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	uint64_t sub = bucket & (STATS_SUB_BUCKETS - 1);
+
+	if (bucket < STATS_SUB_BUCKETS)
+		return bucket;
+
+	return ((STATS_SUB_BUCKETS + sub + 1) << (bits - STATS_SUB_BITS)) - 1;
+}
+
+static struct stats_histogram *
+stats_histogram_get(struct wrap_thread *thread, int row)
+{
+	struct wrap_stats *stats = thread->stats;
+	struct stats_histogram *histogram;
+
+	if (!stats) {
+		stats = calloc(1, sizeof(struct wrap_stats) +
+			       stats_rows() * sizeof(struct stats_histogram *));
+		if (!stats) {
+			fprintf(stderr, "%s: failed to allocate stats\n",
+				__func__);
+			exit(-1);
+		}
+		stats->count = stats_rows();
+
+		__atomic_store_n(&thread->stats, stats, __ATOMIC_RELEASE);
+	}
+
+	histogram = stats->rows[row];
+	if (histogram)
+		return histogram;
+
+	histogram = calloc(1, sizeof(struct stats_histogram));
+	if (!histogram) {
+		fprintf(stderr, "%s: failed to allocate histogram\n", __func__);
+		exit(-1);
+	}
+
+	__atomic_store_n(&stats->rows[row], histogram, __ATOMIC_RELEASE);
+
+	return histogram;
+}
+
+void
+wrap_stats_add(int command, int hardware, int signal, uint64_t duration)
+{
+	struct stats_histogram *histogram;
+	int row = stats_row(command, hardware, signal), bucket;
+
+	if (row < 0)
+		return;
+
+	histogram = stats_histogram_get(wrap_thread_get(), row);
+	bucket = stats_bucket(duration);
+
+	__atomic_store_n(&histogram->buckets[bucket],
+			 histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->total, histogram->total + duration,
+			 __ATOMIC_RELAXED);
+	if (duration > histogram->max)
+		__atomic_store_n(&histogram->max, duration, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->count, histogram->count + 1,
+			 __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&stats_dump_requested, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&stats_dump_requested, 0, __ATOMIC_ACQUIRE))
+		viv_wrap_stats_dump();
+}
+
+static void
+stats_histogram_merge(struct stats_histogram *sum, int row)
+{
+	struct wrap_thread *thread;
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		struct wrap_stats *stats =
+			__atomic_load_n(&thread->stats, __ATOMIC_ACQUIRE);
+		struct stats_histogram *histogram;
+		uint64_t max;
+
+		if (!stats)
+			continue;
+
+		histogram = __atomic_load_n(&stats->rows[row],
+					    __ATOMIC_ACQUIRE);
+		if (!histogram)
+			continue;
+
+		for (i = 0; i < STATS_BUCKETS; i++)
+			sum->buckets[i] +=
+				__atomic_load_n(&histogram->buckets[i],
+						__ATOMIC_RELAXED);
+		sum->total += __atomic_load_n(&histogram->total,
+					      __ATOMIC_RELAXED);
+		max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+		if (max > sum->max)
+			sum->max = max;
+	}
+
+	/* the owners keep on counting, so trust the buckets only. */
+	for (i = 0; i < STATS_BUCKETS; i++)
+		sum->count += sum->buckets[i];
+}
+
+static uint64_t
+stats_percentile(struct stats_histogram *histogram, int permille)
+{
+	uint64_t target = (histogram->count * permille + 999) / 1000;
+	uint64_t seen = 0, value;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	value = stats_bucket_value(i);
+	if (value > histogram->max)
+		value = histogram->max;
+
+	return value;
+}
+
+struct stats_summary {
+	int row;
+	struct stats_histogram histogram;
+};
+
+static int
+stats_summary_compare(const void *a, const void *b)
+{
+	const struct stats_summary *first = a, *second = b;
+
+	if (first->histogram.total > second->histogram.total)
+		return -1;
+	if (first->histogram.total < second->histogram.total)
+		return 1;
+	return first->row - second->row;
+}
+
+#define STATS_US(value) \
+	(unsigned long long) ((value) / 1000), \
+	(unsigned int) ((value) % 1000)
+
+/*
+ * Can be called at any time, from the application too, but not from a
+ * signal handler.
+ */
+void
+viv_wrap_stats_dump(void)
+{
+	struct stats_summary *summary;
+	int rows = stats_rows(), count = 0, i;
+
+	if (!wrap_stats_enabled)
+		return;
+
+	summary = calloc(rows, sizeof(struct stats_summary));
+	if (!summary) {
+		fprintf(stderr, "%s: failed to allocate summary\n", __func__);
+		return;
+	}
+
+	for (i = 0; i < rows; i++) {
+		summary[count].row = i;
+		stats_histogram_merge(&summary[count].histogram, i);
+		if (summary[count].histogram.count)
+			count++;
+	}
+
+	qsort(summary, count, sizeof(struct stats_summary),
+	      stats_summary_compare);
+
+	wrap_log("/* viv_wrap: ioctl latency (us):\n");
+	wrap_log(" * %-30s %-5s %10s %10s %10s %10s %10s %10s %14s\n",
+		 "command", "hw", "count", "p50", "p90", "p99", "p99.9",
+		 "max", "total");
+
+	for (i = 0; i < count; i++) {
+		struct stats_histogram *histogram = &summary[i].histogram;
+
+		wrap_log(" * %-30s %-5s %10llu %6llu.%03u %6llu.%03u "
+			 "%6llu.%03u %6llu.%03u %6llu.%03u %10llu.%03u\n",
+			 stats_row_name(summary[i].row),
+			 viv_hardware_type(summary[i].row % STATS_HARDWARE),
+			 (unsigned long long) histogram->count,
+			 STATS_US(stats_percentile(histogram, 500)),
+			 STATS_US(stats_percentile(histogram, 900)),
+			 STATS_US(stats_percentile(histogram, 990)),
+			 STATS_US(stats_percentile(histogram, 999)),
+			 STATS_US(histogram->max),
+			 STATS_US(histogram->total));
+	}
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	free(summary);
+}
+
+/*
+ * Formatting is not something for a signal handler, the next ioctl on
+ * any thread does it instead.
+ */
+static void
+stats_signal(int signum)
+{
+	__atomic_store_n(&stats_dump_requested, 1, __ATOMIC_RELEASE);
+}
+
+void
+wrap_stats_init(void)
+{
+	struct sigaction action;
+
+	wrap_stats_enabled = wrap_getenv_int("VIV_WRAP_STATS", 0);
+	if (!wrap_stats_enabled)
+		return;
+
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	action.sa_handler = stats_signal;
+	sigaction(SIGUSR2, &action, NULL);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Per thread state.
+ *
+ * The list of threads only ever grows, new entries are pushed on the head
+ * with a compare and swap. Entries of exited threads are marked as unused
+ * and get claimed again by the next thread which comes along, so readers
+ * can walk the list at any time without taking a lock.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "wrap.h"
+
+static struct wrap_thread *wrap_threads;
+
+static __thread struct wrap_thread *wrap_thread_self;
+
+static pthread_key_t wrap_thread_key;
+static pthread_once_t wrap_thread_once = PTHREAD_ONCE_INIT;
+
+static void
+wrap_thread_release(void *data)
+{
+	struct wrap_thread *thread = data;
+
+	wrap_thread_self = NULL;
+	__atomic_store_n(&thread->used, 0, __ATOMIC_RELEASE);
+}
+
+static void
+wrap_thread_key_create(void)
+{
+	pthread_key_create(&wrap_thread_key, wrap_thread_release);
+}
+
+static struct wrap_thread *
+wrap_thread_claim(void)
+{
+	struct wrap_thread *thread;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		int unused = 0;
+
+		if (__atomic_compare_exchange_n(&thread->used, &unused, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return thread;
+	}
+
+	thread = calloc(1, sizeof(struct wrap_thread));
+	if (!thread) {
+		fprintf(stderr, "%s: failed to allocate thread\n", __func__);
+		exit(-1);
+	}
+
+	thread->used = 1;
+	thread->next = __atomic_load_n(&wrap_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&wrap_threads, &thread->next,
+					    thread, 1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	return thread;
+}
+
+struct wrap_thread *
+wrap_thread_get(void)
+{
+	struct wrap_thread *thread = wrap_thread_self;
+
+	if (thread)
+		return thread;
+
+	pthread_once(&wrap_thread_once, wrap_thread_key_create);
+
+	thread = wrap_thread_claim();
+	thread->tid = syscall(SYS_gettid);
+
+	pthread_setspecific(wrap_thread_key, thread);
+	wrap_thread_self = thread;
+
+	return thread;
+}
+
+struct wrap_thread *
+wrap_thread_first(void)
+{
+	return __atomic_load_n(&wrap_threads, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Only the forking thread survives in the child, hand all other
+ * entries back.
+ */
+void
+wrap_thread_atfork_child(void)
+{
+	struct wrap_thread *thread;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		if (thread == wrap_thread_self)
+			thread->tid = syscall(SYS_gettid);
+		else
+			thread->used = 0;
+	}
+}
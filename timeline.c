@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Memory timeline.
+ *
+ * Writes one CSV row per frame, with the video memory bytes per pool, the
+ * live and locked nodes, the contiguous bytes and the pinned user bytes,
+ * as the trackers see them right then. When no frame boundary comes along
+ * for TIMELINE_NS, a row gets written at the next ioctl instead, so that
+ * loading screens and applications which do not swap show up too.
+ *
+ * The file sits next to the log, with .csv appended to its name. Rows are
+ * only formatted into a buffer here, the log writer thread writes them
+ * out. Rows which do not fit, because the writer fell behind, are dropped
+ * and counted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define TIMELINE_NS 100000000ULL /* without frames, 100ms. */
+#define TIMELINE_BUFFER 0x10000
+
+int wrap_timeline_enabled;
+
+static pthread_mutex_t timeline_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static int timeline_fd = -1;
+static uint64_t timeline_last; /* when the last row was queued. */
+
+/* rows get queued in one, while the other is being written out. */
+static char *timeline_buffers[2];
+static char *timeline_buffer;
+static int timeline_used;
+static uint64_t timeline_dropped;
+
+/* only one thread writes out at a time, without holding the mutex. */
+static pthread_mutex_t timeline_write_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t timeline_contiguous;
+
+static void
+timeline_write(const char *buffer, int size)
+{
+	while (size) {
+		int ret = write(timeline_fd, buffer, size);
+
+		if (ret <= 0) {
+			if ((ret == -1) && (errno == EINTR))
+				continue;
+			fprintf(stderr, "%s: failed to write timeline: %s\n",
+				__func__, strerror(errno));
+			return;
+		}
+
+		buffer += ret;
+		size -= ret;
+	}
+}
+
+static void
+timeline_header(void)
+{
+	char buffer[512];
+	int size, i;
+
+	size = snprintf(buffer, sizeof(buffer), "time,frame");
+	for (i = 0; i < gcvPOOL_NUMBER_OF_POOLS; i++)
+		size += snprintf(buffer + size, sizeof(buffer) - size, ",%s",
+				 viv_pool_type(i));
+	size += snprintf(buffer + size, sizeof(buffer) - size,
+			 ",nodes,locked,contiguous,pinned\n");
+
+	timeline_write(buffer, size);
+}
+
+/*
+ * Call with the mutex held.
+ */
+static void
+timeline_queue(const char *row, int size)
+{
+	if ((timeline_used + size) > TIMELINE_BUFFER) {
+		timeline_dropped++;
+		return;
+	}
+
+	memcpy(timeline_buffer + timeline_used, row, size);
+	__atomic_store_n(&timeline_used, timeline_used + size,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Call with the mutex held.
+ */
+static void
+timeline_row(uint64_t now)
+{
+	uint64_t pools[gcvPOOL_NUMBER_OF_POOLS];
+	char buffer[512];
+	int nodes, locked, size, i;
+
+	wrap_vidmem_snapshot(pools, &nodes, &locked);
+
+	size = snprintf(buffer, sizeof(buffer), "%llu.%09llu,%u",
+			(unsigned long long) now / 1000000000,
+			(unsigned long long) now % 1000000000,
+			__atomic_load_n(&wrap_frame, __ATOMIC_RELAXED));
+	for (i = 0; i < gcvPOOL_NUMBER_OF_POOLS; i++)
+		size += snprintf(buffer + size, sizeof(buffer) - size, ",%llu",
+				 (unsigned long long) pools[i]);
+	size += snprintf(buffer + size, sizeof(buffer) - size,
+			 ",%d,%d,%llu,%llu\n", nodes, locked,
+			 (unsigned long long) __atomic_load_n(&timeline_contiguous,
+							      __ATOMIC_RELAXED),
+			 (unsigned long long) wrap_pin_bytes());
+
+	timeline_queue(buffer, size);
+
+	__atomic_store_n(&timeline_last, now, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by the log writer thread, and at close. Swaps buffers, and writes
+ * out what was queued up, while the application carries on queueing.
+ */
+void
+wrap_timeline_flush(void)
+{
+	char *buffer;
+	int size;
+
+	if (!__atomic_load_n(&timeline_used, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(timeline_write_mutex);
+
+	pthread_mutex_lock(timeline_mutex);
+	buffer = timeline_buffer;
+	size = timeline_used;
+	timeline_buffer = (buffer == timeline_buffers[0]) ?
+		timeline_buffers[1] : timeline_buffers[0];
+	timeline_used = 0;
+	pthread_mutex_unlock(timeline_mutex);
+
+	if (timeline_fd != -1)
+		timeline_write(buffer, size);
+
+	pthread_mutex_unlock(timeline_write_mutex);
+}
+
+/*
+ * Called from viv_wrap_frame(), after the frame counter moved on.
+ */
+void
+wrap_timeline_frame(void)
+{
+	pthread_mutex_lock(timeline_mutex);
+	if (timeline_fd != -1)
+		timeline_row(wrap_time());
+	pthread_mutex_unlock(timeline_mutex);
+}
+
+/*
+ * Called for successfully completed ioctls only.
+ */
+void
+wrap_timeline_post(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+	uint64_t now;
+
+	switch (interface->command) {
+	case gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY:
+		__atomic_add_fetch(&timeline_contiguous,
+				   interface->u.AllocateContiguousMemory.bytes,
+				   __ATOMIC_RELAXED);
+		break;
+	case gcvHAL_FREE_CONTIGUOUS_MEMORY:
+		__atomic_sub_fetch(&timeline_contiguous,
+				   interface->u.FreeContiguousMemory.bytes,
+				   __ATOMIC_RELAXED);
+		break;
+	default:
+		break;
+	}
+
+	now = wrap_time();
+	if ((now - __atomic_load_n(&timeline_last, __ATOMIC_RELAXED)) <
+	    TIMELINE_NS)
+		return;
+
+	pthread_mutex_lock(timeline_mutex);
+	/* someone else might have beaten us to it. */
+	if ((timeline_fd != -1) && ((now - timeline_last) >= TIMELINE_NS))
+		timeline_row(now);
+	pthread_mutex_unlock(timeline_mutex);
+}
+
+void
+wrap_timeline_init(void)
+{
+	char *log, *filename;
+
+	wrap_timeline_enabled = wrap_getenv_int("VIV_WRAP_TIMELINE", 0);
+	if (!wrap_timeline_enabled)
+		return;
+
+	log = getenv("VIV_WRAP_LOG");
+	if (!log)
+		log = "/tmp/viv_wrap.log";
+
+	filename = malloc(strlen(log) + 5);
+	if (!filename) {
+		fprintf(stderr, "%s: failed to allocate filename\n", __func__);
+		wrap_timeline_enabled = 0;
+		return;
+	}
+	sprintf(filename, "%s.csv", log);
+
+	timeline_buffers[0] = malloc(TIMELINE_BUFFER);
+	timeline_buffers[1] = malloc(TIMELINE_BUFFER);
+	if (!timeline_buffers[0] || !timeline_buffers[1]) {
+		fprintf(stderr, "%s: failed to allocate buffers\n", __func__);
+		free(timeline_buffers[0]);
+		free(timeline_buffers[1]);
+		wrap_timeline_enabled = 0;
+		free(filename);
+		return;
+	}
+	timeline_buffer = timeline_buffers[0];
+
+	timeline_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			   0644);
+	if (timeline_fd == -1) {
+		fprintf(stderr, "Error: failed to open timeline %s: %s\n",
+			filename, strerror(errno));
+		free(timeline_buffers[0]);
+		free(timeline_buffers[1]);
+		wrap_timeline_enabled = 0;
+		free(filename);
+		return;
+	}
+
+	printf("viv_wrap: memory timeline in %s.\n", filename);
+	free(filename);
+
+	timeline_header();
+	timeline_last = wrap_time();
+
+	/* so that there is a writer thread to write out the rows. */
+	wrap_log_start();
+}
+
+/*
+ * Queues up the final row, and writes out everything that is left.
+ */
+void
+wrap_timeline_close(void)
+{
+	int fd;
+
+	pthread_mutex_lock(timeline_mutex);
+	if (timeline_fd != -1)
+		timeline_row(wrap_time());
+	pthread_mutex_unlock(timeline_mutex);
+
+	wrap_timeline_flush();
+
+	pthread_mutex_lock(timeline_write_mutex);
+	pthread_mutex_lock(timeline_mutex);
+	fd = timeline_fd;
+	timeline_fd = -1;
+	pthread_mutex_unlock(timeline_mutex);
+	pthread_mutex_unlock(timeline_write_mutex);
+
+	if (fd == -1)
+		return;
+	close(fd);
+
+	if (timeline_dropped) {
+		wrap_log("/* viv_wrap: %llu timeline rows were dropped, the "
+			 "writer fell behind. */\n",
+			 (unsigned long long) timeline_dropped);
+		wrap_log_commit();
+	}
+}
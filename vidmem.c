@@ -0,0 +1,1288 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Video memory node tracker.
+ *
+ * Every node the kernel hands out gets an entry in an open addressing
+ * hash table, keyed by the node handle, which is kept up to date as the
+ * node gets locked, unlocked and freed. This gives the live video memory
+ * footprint of the process at any time.
+ *
+ * Slots are claimed with a compare and swap on the key, which stays busy
+ * until the entry is filled in, and freed nodes leave a tombstone behind
+ * which can be claimed again. A handle only exists between its allocation
+ * and its free, so no two threads ever insert the same key. The table is
+ * never resized, when it is full, further nodes are not tracked.
+ *
+ * Each node also remembers where it was allocated from. Backtraces are
+ * hashed, and each distinct one is kept once in a second table, which
+ * works the same way but never loses entries.
+ *
+ * On top of that, current and peak bytes, allocation counts and a size
+ * histogram are kept per pool and per surface type, as well as which pool
+ * was asked for versus which pool the kernel actually handed out.
+ *
+ * Locks and unlocks get paired up per node, for the time a node stays
+ * locked, how often it gets locked per frame and how often the unlock is
+ * deferred by the kernel. Nodes and call sites which lock and unlock
+ * every single frame are wasting a kernel round-trip each time.
+ *
+ * With VIV_WRAP_CHURN, nodes which get freed again within a frame or so
+ * are counted as transient, per size, surface type, pool and call site.
+ * Those which keep coming back are buffers which should have been kept
+ * around instead.
+ */
+
+#define _GNU_SOURCE /* dladdr() */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include "wrap.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define VIDMEM_EMPTY 0
+#define VIDMEM_FREED (~0ULL)
+#define VIDMEM_BUSY (~0ULL - 1)
+
+#define VIDMEM_FRAMES 12
+#define VIDMEM_SITES 1024 /* a power of two. */
+
+#define VIDMEM_SIZES 32 /* power of two buckets. */
+
+#define VIDMEM_RANKED 16
+
+#define VIDMEM_CHURNS 1024 /* a power of two. */
+#define VIDMEM_CHURN_NS 100000000ULL /* without frames, 100ms. */
+
+struct vidmem_site {
+	uint64_t hash;
+	int count;
+	void *frames[VIDMEM_FRAMES];
+
+	/* lock/unlock cycles of all nodes allocated here. */
+	uint64_t cycles;
+	uint64_t async;
+	uint64_t held;
+};
+
+struct vidmem_node {
+	uint64_t node;
+
+	uint32_t bytes;
+	uint32_t address; /* gpu address, as of the last lock. */
+	uint64_t memory; /* cpu mapping, as of the last lock. */
+	int type;
+	int pool;
+	int locks;
+	pid_t tid; /* which allocated it. */
+	struct vidmem_site *site;
+
+	uint64_t allocated;
+	uint64_t locked;
+	uint64_t unlocked;
+
+	unsigned int frame; /* allocated during. */
+	unsigned int lock_frame; /* last locked during. */
+	unsigned int frames_locked;
+	uint64_t cycles; /* lock/unlock pairs. */
+	uint64_t async; /* unlocks deferred by the kernel. */
+	uint64_t held; /* total time locked. */
+	uint64_t held_max;
+};
+
+int wrap_vidmem_size;
+
+static struct vidmem_node *vidmem_table;
+
+static int vidmem_nodes;
+static uint64_t vidmem_bytes;
+static uint64_t vidmem_peak;
+static int vidmem_locked;
+static int vidmem_untracked;
+
+static uint64_t vidmem_cycles;
+static uint64_t vidmem_async;
+
+struct vidmem_churn {
+	uint64_t hash;
+
+	uint32_t bytes;
+	int type;
+	int pool;
+	struct vidmem_site *site;
+
+	uint64_t count;
+	uint64_t lifetime; /* total. */
+	uint64_t first;
+	uint64_t last;
+};
+
+static int vidmem_churn_enabled;
+static struct vidmem_churn *vidmem_churns;
+static int vidmem_churn_dropped;
+
+static struct vidmem_site vidmem_sites[VIDMEM_SITES];
+
+struct vidmem_class {
+	int nodes;
+	uint64_t bytes;
+	uint64_t peak;
+
+	uint64_t allocations;
+	uint64_t unknown; /* allocations of unknown size. */
+	uint64_t sizes[VIDMEM_SIZES];
+};
+
+static struct vidmem_class vidmem_pools[gcvPOOL_NUMBER_OF_POOLS];
+static struct vidmem_class vidmem_types[gcvSURF_NUM_TYPES];
+
+/* requested versus returned pool. */
+static uint64_t vidmem_fallbacks[gcvPOOL_NUMBER_OF_POOLS][gcvPOOL_NUMBER_OF_POOLS];
+
+/* what the current allocation on this thread asked for. */
+static __thread int vidmem_requested;
+
+static unsigned int
+vidmem_hash(uint64_t node)
+{
+	node *= 0x9E3779B97F4A7C15ULL;
+
+	return (node >> 32) & (wrap_vidmem_size - 1);
+}
+
+static struct vidmem_node *
+vidmem_lookup(uint64_t node)
+{
+	unsigned int index = vidmem_hash(node), i;
+
+	for (i = 0; i < wrap_vidmem_size; i++) {
+		struct vidmem_node *entry =
+			&vidmem_table[(index + i) & (wrap_vidmem_size - 1)];
+		uint64_t key = __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE);
+
+		if (key == node)
+			return entry;
+		if (key == VIDMEM_EMPTY)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hands back a busy slot, which becomes visible once the key is stored.
+ */
+static struct vidmem_node *
+vidmem_claim(uint64_t node)
+{
+	unsigned int index = vidmem_hash(node), i;
+
+	for (i = 0; i < wrap_vidmem_size; i++) {
+		struct vidmem_node *entry =
+			&vidmem_table[(index + i) & (wrap_vidmem_size - 1)];
+		uint64_t key = __atomic_load_n(&entry->node, __ATOMIC_RELAXED);
+
+		if ((key != VIDMEM_EMPTY) && (key != VIDMEM_FREED))
+			continue;
+
+		if (__atomic_compare_exchange_n(&entry->node, &key, VIDMEM_BUSY,
+						0, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static uint64_t
+vidmem_site_hash(void **frames, int count)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		hash ^= (uintptr_t) frames[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	/* keep clear of our markers. */
+	if ((hash == VIDMEM_EMPTY) || (hash >= VIDMEM_BUSY))
+		hash = 1;
+
+	return hash;
+}
+
+/*
+ * Where the allocation came from. The first frames are always our own,
+ * those get skipped when printing.
+ */
+static struct vidmem_site *
+vidmem_site_get(void)
+{
+	void *frames[VIDMEM_FRAMES];
+	int count = backtrace(frames, VIDMEM_FRAMES), i;
+	uint64_t hash = vidmem_site_hash(frames, count);
+	unsigned int index = (hash >> 32) & (VIDMEM_SITES - 1);
+
+	for (i = 0; i < VIDMEM_SITES; i++) {
+		struct vidmem_site *site =
+			&vidmem_sites[(index + i) & (VIDMEM_SITES - 1)];
+		uint64_t key = __atomic_load_n(&site->hash, __ATOMIC_ACQUIRE);
+
+		if (key == hash)
+			return site;
+
+		/* someone else is filling this in, it might be ours. */
+		if (key == VIDMEM_BUSY) {
+			i--;
+			continue;
+		}
+
+		if (key != VIDMEM_EMPTY)
+			continue;
+
+		if (!__atomic_compare_exchange_n(&site->hash, &key, VIDMEM_BUSY,
+						 0, __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED)) {
+			i--;
+			continue;
+		}
+
+		memcpy(site->frames, frames, count * sizeof(void *));
+		site->count = count;
+		__atomic_store_n(&site->hash, hash, __ATOMIC_RELEASE);
+
+		return site;
+	}
+
+	return NULL;
+}
+
+static void
+vidmem_site_print(struct vidmem_site *site)
+{
+	Dl_info self, info;
+	int i;
+
+	if (!site) {
+		wrap_log(" *     (unknown)\n");
+		return;
+	}
+
+	dladdr(vidmem_site_print, &self);
+
+	for (i = 0; i < site->count; i++) {
+		if (!dladdr(site->frames[i], &info)) {
+			wrap_log(" *     %p\n", site->frames[i]);
+			continue;
+		}
+
+		if (info.dli_fbase == self.dli_fbase)
+			continue;
+
+		if (info.dli_sname)
+			wrap_log(" *     %s(%s+0x%lX)\n", info.dli_fname,
+				 info.dli_sname, (unsigned long)
+				 ((char *) site->frames[i] -
+				  (char *) info.dli_saddr));
+		else
+			wrap_log(" *     %s+0x%lX\n", info.dli_fname,
+				 (unsigned long) ((char *) site->frames[i] -
+						  (char *) info.dli_fbase));
+	}
+}
+
+static void
+vidmem_peak_update(uint64_t *peak, uint64_t total)
+{
+	uint64_t value = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+	while ((total > value) &&
+	       !__atomic_compare_exchange_n(peak, &value, total, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static struct vidmem_class *
+vidmem_pool_class(int pool)
+{
+	if ((pool < 0) || (pool >= gcvPOOL_NUMBER_OF_POOLS))
+		return NULL;
+
+	return &vidmem_pools[pool];
+}
+
+static struct vidmem_class *
+vidmem_type_class(int type)
+{
+	type &= 0xFF;
+	if (type >= gcvSURF_NUM_TYPES)
+		return NULL;
+
+	return &vidmem_types[type];
+}
+
+static void
+vidmem_class_add(struct vidmem_class *class, unsigned int bytes)
+{
+	uint64_t total;
+
+	if (!class)
+		return;
+
+	__atomic_add_fetch(&class->nodes, 1, __ATOMIC_RELAXED);
+	total = __atomic_add_fetch(&class->bytes, bytes, __ATOMIC_RELAXED);
+	vidmem_peak_update(&class->peak, total);
+
+	__atomic_add_fetch(&class->allocations, 1, __ATOMIC_RELAXED);
+	if (bytes)
+		__atomic_add_fetch(&class->sizes[31 - __builtin_clz(bytes)], 1,
+				   __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&class->unknown, 1, __ATOMIC_RELAXED);
+}
+
+static void
+vidmem_class_sub(struct vidmem_class *class, unsigned int bytes)
+{
+	if (!class)
+		return;
+
+	__atomic_sub_fetch(&class->nodes, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&class->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static void
+vidmem_release(struct vidmem_node *entry)
+{
+	__atomic_sub_fetch(&vidmem_nodes, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&vidmem_bytes, entry->bytes, __ATOMIC_RELAXED);
+	vidmem_class_sub(vidmem_pool_class(entry->pool), entry->bytes);
+	vidmem_class_sub(vidmem_type_class(entry->type), entry->bytes);
+	if (entry->locks)
+		__atomic_sub_fetch(&vidmem_locked, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&entry->node, VIDMEM_FREED, __ATOMIC_RELEASE);
+}
+
+static void
+vidmem_allocated(uint64_t node, unsigned int bytes, int type, int pool)
+{
+	struct vidmem_node *entry;
+	uint64_t total;
+
+	if (vidmem_pool_class(vidmem_requested) && vidmem_pool_class(pool))
+		__atomic_add_fetch(&vidmem_fallbacks[vidmem_requested][pool], 1,
+				   __ATOMIC_RELAXED);
+
+	/* we missed a free, the kernel handed out this handle again. */
+	entry = vidmem_lookup(node);
+	if (entry)
+		vidmem_release(entry);
+
+	entry = vidmem_claim(node);
+	if (!entry) {
+		if (!__atomic_fetch_add(&vidmem_untracked, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "viv_wrap: video memory node table "
+				"full, raise VIV_WRAP_VIDMEM.\n");
+		return;
+	}
+
+	entry->bytes = bytes;
+	entry->address = 0;
+	entry->memory = 0;
+	entry->type = type;
+	entry->pool = pool;
+	entry->locks = 0;
+	entry->tid = wrap_thread_get()->tid;
+	entry->site = vidmem_site_get();
+	entry->allocated = wrap_time();
+	entry->locked = 0;
+	entry->unlocked = 0;
+	entry->frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	entry->lock_frame = 0;
+	entry->frames_locked = 0;
+	entry->cycles = 0;
+	entry->async = 0;
+	entry->held = 0;
+	entry->held_max = 0;
+
+	__atomic_store_n(&entry->node, node, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&vidmem_nodes, 1, __ATOMIC_RELAXED);
+	total = __atomic_add_fetch(&vidmem_bytes, bytes, __ATOMIC_RELAXED);
+	vidmem_peak_update(&vidmem_peak, total);
+
+	vidmem_class_add(vidmem_pool_class(pool), bytes);
+	vidmem_class_add(vidmem_type_class(type), bytes);
+}
+
+static void
+vidmem_lock(struct _gcsHAL_LOCK_VIDEO_MEMORY *lock)
+{
+	struct vidmem_node *entry = vidmem_lookup(lock->node);
+	unsigned int frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+
+	if (!entry)
+		return;
+
+	if (!entry->frames_locked || (entry->lock_frame != frame)) {
+		__atomic_store_n(&entry->lock_frame, frame, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&entry->frames_locked, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&entry->address, lock->address, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->memory, lock->memory, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->locked, wrap_time(), __ATOMIC_RELAXED);
+
+	if (!__atomic_fetch_add(&entry->locks, 1, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&vidmem_locked, 1, __ATOMIC_RELAXED);
+}
+
+static void
+vidmem_unlocked(struct vidmem_node *entry)
+{
+	int locks;
+
+	locks = __atomic_load_n(&entry->locks, __ATOMIC_RELAXED);
+	while (locks &&
+	       !__atomic_compare_exchange_n(&entry->locks, &locks, locks - 1,
+					    1, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+
+	if (locks == 1)
+		__atomic_sub_fetch(&vidmem_locked, 1, __ATOMIC_RELAXED);
+}
+
+static void
+vidmem_unlock(struct _gcsHAL_UNLOCK_VIDEO_MEMORY *unlock)
+{
+	struct vidmem_node *entry = vidmem_lookup(unlock->node);
+	struct vidmem_site *site;
+	uint64_t now = wrap_time(), held;
+
+	if (!entry)
+		return;
+
+	__atomic_store_n(&entry->unlocked, now, __ATOMIC_RELAXED);
+
+	/* nested locks are paired with the last one. */
+	held = now - __atomic_load_n(&entry->locked, __ATOMIC_RELAXED);
+	if (!entry->locked)
+		held = 0;
+
+	__atomic_add_fetch(&entry->cycles, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&entry->held, held, __ATOMIC_RELAXED);
+	vidmem_peak_update(&entry->held_max, held);
+	__atomic_add_fetch(&vidmem_cycles, 1, __ATOMIC_RELAXED);
+
+	site = entry->site;
+	if (site) {
+		__atomic_add_fetch(&site->cycles, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->held, held, __ATOMIC_RELAXED);
+	}
+
+	/*
+	 * The kernel tells us that the unlock has to go through the queue,
+	 * the lock is only dropped once we see it there.
+	 */
+	if (unlock->asynchroneous) {
+		__atomic_add_fetch(&entry->async, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&vidmem_async, 1, __ATOMIC_RELAXED);
+		if (site)
+			__atomic_add_fetch(&site->async, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	vidmem_unlocked(entry);
+}
+
+static uint64_t
+vidmem_churn_hash(struct vidmem_node *entry)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	hash = (hash ^ entry->bytes) * 0x100000001B3ULL;
+	hash = (hash ^ entry->type) * 0x100000001B3ULL;
+	hash = (hash ^ entry->pool) * 0x100000001B3ULL;
+	hash = (hash ^ (uintptr_t) entry->site) * 0x100000001B3ULL;
+
+	if ((hash == VIDMEM_EMPTY) || (hash >= VIDMEM_BUSY))
+		hash = 1;
+
+	return hash;
+}
+
+/*
+ * Same as the call sites, entries get claimed, filled in, and then stay.
+ */
+static struct vidmem_churn *
+vidmem_churn_get(struct vidmem_node *entry, uint64_t now)
+{
+	uint64_t hash = vidmem_churn_hash(entry);
+	unsigned int index = (hash >> 32) & (VIDMEM_CHURNS - 1);
+	int i;
+
+	for (i = 0; i < VIDMEM_CHURNS; i++) {
+		struct vidmem_churn *churn =
+			&vidmem_churns[(index + i) & (VIDMEM_CHURNS - 1)];
+		uint64_t key = __atomic_load_n(&churn->hash, __ATOMIC_ACQUIRE);
+
+		if ((key == hash) && (churn->bytes == entry->bytes) &&
+		    (churn->type == entry->type) &&
+		    (churn->pool == entry->pool) &&
+		    (churn->site == entry->site))
+			return churn;
+
+		if (key == VIDMEM_BUSY) {
+			i--;
+			continue;
+		}
+
+		if (key != VIDMEM_EMPTY)
+			continue;
+
+		if (!__atomic_compare_exchange_n(&churn->hash, &key, VIDMEM_BUSY,
+						 0, __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED)) {
+			i--;
+			continue;
+		}
+
+		churn->bytes = entry->bytes;
+		churn->type = entry->type;
+		churn->pool = entry->pool;
+		churn->site = entry->site;
+		churn->first = now;
+		__atomic_store_n(&churn->hash, hash, __ATOMIC_RELEASE);
+
+		return churn;
+	}
+
+	return NULL;
+}
+
+/*
+ * Freed within the frame after the one it was allocated in, or quickly
+ * when nobody is counting frames.
+ */
+static void
+vidmem_churn_add(struct vidmem_node *entry)
+{
+	struct vidmem_churn *churn;
+	unsigned int frame = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	uint64_t now = wrap_time(), lifetime = now - entry->allocated;
+
+	if (frame ? ((frame - entry->frame) > 1) :
+	    (lifetime >= VIDMEM_CHURN_NS))
+		return;
+
+	churn = vidmem_churn_get(entry, now);
+	if (!churn) {
+		__atomic_add_fetch(&vidmem_churn_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&churn->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&churn->lifetime, lifetime, __ATOMIC_RELAXED);
+	vidmem_peak_update(&churn->last, now);
+}
+
+static void
+vidmem_free(uint64_t node)
+{
+	struct vidmem_node *entry = vidmem_lookup(node);
+
+	if (!entry)
+		return;
+
+	if (vidmem_churn_enabled)
+		vidmem_churn_add(entry);
+
+	vidmem_release(entry);
+}
+
+/*
+ * Called right after the actual ioctl, for successful calls only.
+ */
+void
+wrap_vidmem_post(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+
+	switch (interface->command) {
+	case gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY:
+		vidmem_allocated(interface->u.AllocateLinearVideoMemory.node,
+				 interface->u.AllocateLinearVideoMemory.bytes,
+				 interface->u.AllocateLinearVideoMemory.type,
+				 interface->u.AllocateLinearVideoMemory.pool);
+		break;
+	case gcvHAL_ALLOCATE_VIDEO_MEMORY:
+		/* the size depends on the format, which we do not know. */
+		vidmem_allocated(interface->u.AllocateVideoMemory.node, 0,
+				 interface->u.AllocateVideoMemory.type,
+				 interface->u.AllocateVideoMemory.pool);
+		break;
+	case gcvHAL_LOCK_VIDEO_MEMORY:
+		vidmem_lock(&interface->u.LockVideoMemory);
+		break;
+	case gcvHAL_UNLOCK_VIDEO_MEMORY:
+		vidmem_unlock(&interface->u.UnlockVideoMemory);
+		break;
+	case gcvHAL_FREE_VIDEO_MEMORY:
+		vidmem_free(interface->u.FreeVideoMemory.node);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Called for the entries in the event queue of a successful COMMIT or
+ * EVENT_COMMIT. The kernel only gets to these once the gpu is done, we
+ * account for them straight away.
+ */
+void
+wrap_vidmem_deferred(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+	struct vidmem_node *entry;
+
+	switch (interface->command) {
+	case gcvHAL_UNLOCK_VIDEO_MEMORY:
+		entry = vidmem_lookup(interface->u.UnlockVideoMemory.node);
+		if (entry)
+			vidmem_unlocked(entry);
+		break;
+	case gcvHAL_FREE_VIDEO_MEMORY:
+		vidmem_free(interface->u.FreeVideoMemory.node);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Called right before the actual ioctl.
+ */
+void
+wrap_vidmem_pre(void *data)
+{
+	gcsHAL_INTERFACE *interface = data;
+
+	switch (interface->command) {
+	case gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY:
+		/* the kernel overwrites this with the pool it used. */
+		vidmem_requested = interface->u.AllocateLinearVideoMemory.pool;
+		break;
+	case gcvHAL_ALLOCATE_VIDEO_MEMORY:
+		vidmem_requested = interface->u.AllocateVideoMemory.pool;
+		break;
+	case gcvHAL_DETACH:
+		viv_wrap_vidmem_leaks("DETACH");
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+vidmem_class_print(const char *name, struct vidmem_class *class)
+{
+	uint64_t unknown = __atomic_load_n(&class->unknown, __ATOMIC_RELAXED);
+	int i;
+
+	wrap_log(" * %-26s %8d %12llu %12llu %10llu", name,
+		 __atomic_load_n(&class->nodes, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&class->bytes, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&class->peak, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&class->allocations, __ATOMIC_RELAXED));
+
+	for (i = 0; i < VIDMEM_SIZES; i++) {
+		uint64_t count = __atomic_load_n(&class->sizes[i],
+						 __ATOMIC_RELAXED);
+
+		if (!count)
+			continue;
+
+		if (i >= 20)
+			wrap_log(" %uM:%llu", 1 << (i - 20),
+				 (unsigned long long) count);
+		else if (i >= 10)
+			wrap_log(" %uK:%llu", 1 << (i - 10),
+				 (unsigned long long) count);
+		else
+			wrap_log(" %u:%llu", 1 << i,
+				 (unsigned long long) count);
+	}
+
+	if (unknown)
+		wrap_log(" ?:%llu", (unsigned long long) unknown);
+
+	wrap_log("\n");
+}
+
+/*
+ * Footprint per pool and per surface type, and every allocation which
+ * did not end up in the pool it asked for. Sizes are counted per power
+ * of two, "4K:12" means 12 allocations of 4kB up to just below 8kB.
+ * Can be called by the application at any time.
+ */
+void
+viv_wrap_vidmem_stats(void)
+{
+	int i, j, header = 0, picked = 0;
+
+	if (!vidmem_table)
+		return;
+
+	wrap_log("/* viv_wrap: video memory per pool and surface type:\n");
+	wrap_log(" * %-26s %8s %12s %12s %10s %s\n", "", "nodes", "bytes",
+		 "peak", "allocs", "sizes");
+
+	for (i = 0; i < gcvPOOL_NUMBER_OF_POOLS; i++)
+		if (__atomic_load_n(&vidmem_pools[i].allocations,
+				    __ATOMIC_RELAXED))
+			vidmem_class_print(viv_pool_type(i),
+					   &vidmem_pools[i]);
+
+	for (i = 0; i < gcvSURF_NUM_TYPES; i++)
+		if (__atomic_load_n(&vidmem_types[i].allocations,
+				    __ATOMIC_RELAXED))
+			vidmem_class_print(viv_surface_type(i),
+					   &vidmem_types[i]);
+
+	/* DEFAULT is up to the kernel, anything else is a fallback. */
+	for (i = 0; i < gcvPOOL_NUMBER_OF_POOLS; i++) {
+		if ((i == gcvPOOL_DEFAULT) || (i == gcvPOOL_UNKNOWN))
+			continue;
+
+		for (j = 0; j < gcvPOOL_NUMBER_OF_POOLS; j++) {
+			uint64_t count =
+				__atomic_load_n(&vidmem_fallbacks[i][j],
+						__ATOMIC_RELAXED);
+
+			if ((i == j) || !count)
+				continue;
+
+			if (!header) {
+				wrap_log(" * pool fallbacks:\n");
+				header = 1;
+			}
+
+			wrap_log(" *   %s -> %s: %llu\n", viv_pool_type(i),
+				 viv_pool_type(j), (unsigned long long) count);
+		}
+	}
+
+	for (j = 0; j < gcvPOOL_NUMBER_OF_POOLS; j++) {
+		uint64_t count =
+			__atomic_load_n(&vidmem_fallbacks[gcvPOOL_DEFAULT][j],
+					__ATOMIC_RELAXED);
+
+		if (!count)
+			continue;
+
+		if (!picked) {
+			wrap_log(" * kernel picked for DEFAULT:");
+			picked = 1;
+		}
+		wrap_log(" %s:%llu", viv_pool_type(j),
+			 (unsigned long long) count);
+	}
+	if (picked)
+		wrap_log("\n");
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+}
+
+struct vidmem_ranked {
+	uint64_t rate; /* cycles per frame, times 100. */
+	uint64_t cycles;
+	uint64_t async;
+	uint64_t held;
+	void *what;
+};
+
+static int
+vidmem_ranked_compare(const void *a, const void *b)
+{
+	const struct vidmem_ranked *first = a, *second = b;
+
+	if (first->rate > second->rate)
+		return -1;
+	if (first->rate < second->rate)
+		return 1;
+	if (first->cycles > second->cycles)
+		return -1;
+	if (first->cycles < second->cycles)
+		return 1;
+	return 0;
+}
+
+/*
+ * Frames completed since this node was allocated, at least one.
+ */
+static unsigned int
+vidmem_node_frames(struct vidmem_node *entry, unsigned int frames)
+{
+	if (frames == entry->frame)
+		return 1;
+
+	return frames - entry->frame;
+}
+
+#define VIDMEM_RATE(rate) \
+	(unsigned long long) ((rate) / 100), (unsigned int) ((rate) % 100)
+
+#define VIDMEM_LOCKS(ranked) \
+	(unsigned long long) (ranked)->cycles, VIDMEM_RATE((ranked)->rate), \
+	(unsigned long long) ((ranked)->async * 100 / (ranked)->cycles), \
+	(unsigned long long) ((ranked)->held / (ranked)->cycles / 1000)
+
+/*
+ * Lock/unlock cycles, ranked per live node and per call site by how often
+ * they happen per frame. Frames are counted through eglSwapBuffers() or
+ * viv_wrap_frame(), without those, the whole run counts as one frame.
+ * Can be called by the application at any time.
+ */
+void
+viv_wrap_vidmem_locks(void)
+{
+	struct vidmem_ranked *ranked;
+	unsigned int frames = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	uint64_t cycles = __atomic_load_n(&vidmem_cycles, __ATOMIC_RELAXED);
+	uint64_t async = __atomic_load_n(&vidmem_async, __ATOMIC_RELAXED);
+	int count = 0, i;
+
+	if (!vidmem_table || !cycles)
+		return;
+
+	ranked = calloc(wrap_vidmem_size + VIDMEM_SITES,
+			sizeof(struct vidmem_ranked));
+	if (!ranked) {
+		fprintf(stderr, "%s: failed to allocate ranking\n", __func__);
+		return;
+	}
+
+	wrap_log("/* viv_wrap: video memory lock/unlock: %llu cycles over %u "
+		 "frames, %llu.%02u per frame, %llu%% asynchronous.\n",
+		 (unsigned long long) cycles, frames,
+		 VIDMEM_RATE(cycles * 100 / (frames ? frames : 1)),
+		 (unsigned long long) (async * 100 / cycles));
+
+	for (i = 0; i < wrap_vidmem_size; i++) {
+		struct vidmem_node *entry = &vidmem_table[i];
+		uint64_t node = __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE);
+		uint64_t cycles;
+
+		if ((node == VIDMEM_EMPTY) || (node == VIDMEM_FREED) ||
+		    (node == VIDMEM_BUSY))
+			continue;
+
+		cycles = __atomic_load_n(&entry->cycles, __ATOMIC_RELAXED);
+		if (!cycles)
+			continue;
+
+		ranked[count].cycles = cycles;
+		ranked[count].rate = cycles * 100 /
+			vidmem_node_frames(entry, frames);
+		ranked[count].async =
+			__atomic_load_n(&entry->async, __ATOMIC_RELAXED);
+		ranked[count].held =
+			__atomic_load_n(&entry->held, __ATOMIC_RELAXED);
+		ranked[count].what = entry;
+		count++;
+	}
+
+	qsort(ranked, count, sizeof(struct vidmem_ranked),
+	      vidmem_ranked_compare);
+
+	if (count)
+		wrap_log(" * live nodes:\n");
+
+	for (i = 0; (i < count) && (i < VIDMEM_RANKED); i++) {
+		struct vidmem_node *entry = ranked[i].what;
+
+		wrap_log(" *   node 0x%08llX, %s, pool %s: %llu cycles, %llu.%02u "
+			 "per frame, %llu%% async, held %lluus on average, "
+			 "%lluus max, locked in %u of %u frames\n",
+			 (unsigned long long) entry->node,
+			 viv_surface_type(entry->type),
+			 viv_pool_type(entry->pool), VIDMEM_LOCKS(&ranked[i]),
+			 (unsigned long long)
+			 __atomic_load_n(&entry->held_max, __ATOMIC_RELAXED) /
+			 1000, __atomic_load_n(&entry->frames_locked,
+					       __ATOMIC_RELAXED),
+			 vidmem_node_frames(entry, frames));
+	}
+
+	count = 0;
+	for (i = 0; i < VIDMEM_SITES; i++) {
+		struct vidmem_site *site = &vidmem_sites[i];
+		uint64_t hash = __atomic_load_n(&site->hash, __ATOMIC_ACQUIRE);
+		uint64_t cycles;
+
+		if ((hash == VIDMEM_EMPTY) || (hash == VIDMEM_BUSY))
+			continue;
+
+		cycles = __atomic_load_n(&site->cycles, __ATOMIC_RELAXED);
+		if (!cycles)
+			continue;
+
+		ranked[count].cycles = cycles;
+		ranked[count].rate = cycles * 100 / (frames ? frames : 1);
+		ranked[count].async =
+			__atomic_load_n(&site->async, __ATOMIC_RELAXED);
+		ranked[count].held =
+			__atomic_load_n(&site->held, __ATOMIC_RELAXED);
+		ranked[count].what = site;
+		count++;
+	}
+
+	qsort(ranked, count, sizeof(struct vidmem_ranked),
+	      vidmem_ranked_compare);
+
+	for (i = 0; (i < count) && (i < VIDMEM_RANKED); i++) {
+		wrap_log(" * %llu cycles, %llu.%02u per frame, %llu%% async, "
+			 "held %lluus on average, for nodes from:\n",
+			 VIDMEM_LOCKS(&ranked[i]));
+		vidmem_site_print(ranked[i].what);
+	}
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	free(ranked);
+}
+
+static int
+vidmem_churn_compare(const void *a, const void *b)
+{
+	const struct vidmem_churn *first = *(const struct vidmem_churn **) a;
+	const struct vidmem_churn *second = *(const struct vidmem_churn **) b;
+
+	if (first->count > second->count)
+		return -1;
+	if (first->count < second->count)
+		return 1;
+	if (first->bytes > second->bytes)
+		return -1;
+	if (first->bytes < second->bytes)
+		return 1;
+	return 0;
+}
+
+/*
+ * Transient allocations which happened more than once, most frequent
+ * first. Can be called by the application at any time.
+ */
+void
+viv_wrap_vidmem_churn(void)
+{
+	struct vidmem_churn **sorted;
+	unsigned int frames = __atomic_load_n(&wrap_frame, __ATOMIC_RELAXED);
+	uint64_t count = 0, bytes = 0;
+	int used = 0, i;
+
+	if (!vidmem_churns)
+		return;
+
+	sorted = calloc(VIDMEM_CHURNS, sizeof(struct vidmem_churn *));
+	if (!sorted) {
+		fprintf(stderr, "%s: failed to allocate churn\n", __func__);
+		return;
+	}
+
+	for (i = 0; i < VIDMEM_CHURNS; i++) {
+		struct vidmem_churn *churn = &vidmem_churns[i];
+		uint64_t hash = __atomic_load_n(&churn->hash, __ATOMIC_ACQUIRE);
+
+		if ((hash == VIDMEM_EMPTY) || (hash == VIDMEM_BUSY))
+			continue;
+
+		count += churn->count;
+		bytes += churn->count * churn->bytes;
+
+		if (churn->count > 1)
+			sorted[used++] = churn;
+	}
+
+	qsort(sorted, used, sizeof(struct vidmem_churn *),
+	      vidmem_churn_compare);
+
+	wrap_log("/* viv_wrap: video memory churn: %llu transient allocations, "
+		 "%llu bytes, over %u frames.\n", (unsigned long long) count,
+		 (unsigned long long) bytes, frames);
+
+	for (i = 0; (i < used) && (i < VIDMEM_RANKED); i++) {
+		struct vidmem_churn *churn = sorted[i];
+		uint64_t times = __atomic_load_n(&churn->count,
+						 __ATOMIC_RELAXED);
+		uint64_t span = __atomic_load_n(&churn->last,
+						__ATOMIC_RELAXED) - churn->first;
+		/* per second, times 100. */
+		uint64_t rate = span ?
+			(times - 1) * 100000000000ULL / span : 0;
+
+		wrap_log(" * %s, pool %s, 0x%X bytes: %llu times, %llu.%02u/s, "
+			 "%llu.%02u per frame, %llu bytes, lived %lluus on "
+			 "average, from:\n", viv_surface_type(churn->type),
+			 viv_pool_type(churn->pool), churn->bytes,
+			 (unsigned long long) times, VIDMEM_RATE(rate),
+			 VIDMEM_RATE(times * 100 / (frames ? frames : 1)),
+			 (unsigned long long) (times * churn->bytes),
+			 (unsigned long long)
+			 (__atomic_load_n(&churn->lifetime, __ATOMIC_RELAXED) /
+			  times / 1000));
+		vidmem_site_print(churn->site);
+	}
+
+	if (vidmem_churn_dropped)
+		wrap_log(" * %d transient allocations were not counted, too "
+			 "many different ones.\n", vidmem_churn_dropped);
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	free(sorted);
+}
+
+struct vidmem_group {
+	int type;
+	int pool;
+	struct vidmem_site *site;
+
+	int count;
+	int locked;
+	int unknown; /* nodes of unknown size. */
+	uint64_t bytes;
+};
+
+static int
+vidmem_group_compare(const void *a, const void *b)
+{
+	const struct vidmem_group *first = a, *second = b;
+
+	if (first->bytes > second->bytes)
+		return -1;
+	if (first->bytes < second->bytes)
+		return 1;
+	return second->count - first->count;
+}
+
+/*
+ * Everything which is still allocated, grouped by surface type, pool and
+ * call site, biggest first.
+ */
+void
+viv_wrap_vidmem_leaks(const char *reason)
+{
+	struct vidmem_group *groups;
+	uint64_t bytes = 0;
+	int count = 0, nodes = 0, i, j;
+
+	if (!vidmem_table)
+		return;
+
+	groups = calloc(wrap_vidmem_size, sizeof(struct vidmem_group));
+	if (!groups) {
+		fprintf(stderr, "%s: failed to allocate groups\n", __func__);
+		return;
+	}
+
+	for (i = 0; i < wrap_vidmem_size; i++) {
+		struct vidmem_node *entry = &vidmem_table[i];
+		uint64_t node = __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE);
+		struct vidmem_group *group;
+
+		if ((node == VIDMEM_EMPTY) || (node == VIDMEM_FREED) ||
+		    (node == VIDMEM_BUSY))
+			continue;
+
+		for (j = 0; j < count; j++)
+			if ((groups[j].type == entry->type) &&
+			    (groups[j].pool == entry->pool) &&
+			    (groups[j].site == entry->site))
+				break;
+
+		group = &groups[j];
+		if (j == count) {
+			group->type = entry->type;
+			group->pool = entry->pool;
+			group->site = entry->site;
+			count++;
+		}
+
+		group->count++;
+		group->bytes += entry->bytes;
+		if (entry->locks)
+			group->locked++;
+		if (!entry->bytes)
+			group->unknown++;
+
+		nodes++;
+		bytes += entry->bytes;
+	}
+
+	qsort(groups, count, sizeof(struct vidmem_group),
+	      vidmem_group_compare);
+
+	wrap_log("/* viv_wrap: video memory still allocated at %s: %d nodes, "
+		 "%llu bytes.\n", reason, nodes, (unsigned long long) bytes);
+
+	for (i = 0; i < count; i++) {
+		struct vidmem_group *group = &groups[i];
+
+		wrap_log(" * %s, pool %s: %d nodes (%d locked), %llu bytes",
+			 viv_surface_type(group->type),
+			 viv_pool_type(group->pool), group->count,
+			 group->locked, (unsigned long long) group->bytes);
+		if (group->unknown)
+			wrap_log(", %d of unknown size", group->unknown);
+		wrap_log(", from:\n");
+
+		vidmem_site_print(group->site);
+	}
+
+	if (vidmem_untracked)
+		wrap_log(" * %d nodes were not tracked, the table was full.\n",
+			 vidmem_untracked);
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+
+	free(groups);
+}
+
+/*
+ * Lists every node which is still around. Can be called by the
+ * application at any time.
+ */
+void
+viv_wrap_vidmem_dump(void)
+{
+	uint64_t now = wrap_time();
+	int i;
+
+	if (!vidmem_table)
+		return;
+
+	wrap_log("/* viv_wrap: video memory: %d nodes, %llu bytes, %d locked, "
+		 "peak %llu bytes.\n",
+		 __atomic_load_n(&vidmem_nodes, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&vidmem_bytes, __ATOMIC_RELAXED),
+		 __atomic_load_n(&vidmem_locked, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&vidmem_peak, __ATOMIC_RELAXED));
+
+	for (i = 0; i < wrap_vidmem_size; i++) {
+		struct vidmem_node *entry = &vidmem_table[i];
+		uint64_t node = __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE);
+
+		if ((node == VIDMEM_EMPTY) || (node == VIDMEM_FREED) ||
+		    (node == VIDMEM_BUSY))
+			continue;
+
+		wrap_log(" * node 0x%08llX: bytes 0x%X, type %s, pool %s, "
+			 "locks %d, address 0x%08X, memory 0x%08llX, "
+			 "thread %d, age %llums\n", (unsigned long long) node,
+			 entry->bytes, viv_surface_type(entry->type),
+			 viv_pool_type(entry->pool), entry->locks,
+			 entry->address, (unsigned long long) entry->memory,
+			 entry->tid, (unsigned long long)
+			 (now - entry->allocated) / 1000000);
+	}
+
+	if (vidmem_untracked)
+		wrap_log(" * %d nodes were not tracked, the table was full.\n",
+			 vidmem_untracked);
+
+	wrap_log(" */\n");
+	wrap_log_commit();
+}
+
+/*
+ * Bytes per pool, live and locked nodes, as they are right now.
+ */
+void
+wrap_vidmem_snapshot(uint64_t *pools, int *nodes, int *locked)
+{
+	int i;
+
+	for (i = 0; i < gcvPOOL_NUMBER_OF_POOLS; i++)
+		pools[i] = __atomic_load_n(&vidmem_pools[i].bytes,
+					   __ATOMIC_RELAXED);
+
+	*nodes = __atomic_load_n(&vidmem_nodes, __ATOMIC_RELAXED);
+	*locked = __atomic_load_n(&vidmem_locked, __ATOMIC_RELAXED);
+}
+
+void
+wrap_vidmem_init(void)
+{
+	int size = wrap_getenv_int("VIV_WRAP_VIDMEM", 0);
+
+	/* transient nodes can only be spotted when they are tracked. */
+	vidmem_churn_enabled = wrap_getenv_int("VIV_WRAP_CHURN", 0);
+	if ((vidmem_churn_enabled || wrap_timeline_enabled) && (size <= 0))
+		size = 4096;
+
+	if (size <= 0)
+		return;
+
+	/* a node count, round up to a power of two, and keep it sparse. */
+	if (size < 1024)
+		size = 1024;
+	while (size & (size - 1))
+		size += size & -size;
+	size *= 2;
+
+	vidmem_table = calloc(size, sizeof(struct vidmem_node));
+	if (!vidmem_table) {
+		fprintf(stderr, "%s: failed to allocate node table\n",
+			__func__);
+		return;
+	}
+
+	if (vidmem_churn_enabled) {
+		vidmem_churns = calloc(VIDMEM_CHURNS,
+				       sizeof(struct vidmem_churn));
+		if (!vidmem_churns) {
+			fprintf(stderr, "%s: failed to allocate churn table\n",
+				__func__);
+			vidmem_churn_enabled = 0;
+		}
+	}
+
+	wrap_vidmem_size = size;
+}
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Hang watchdog.
+ *
+ * Before going into the kernel, each thread notes down which ioctl it is
+ * about to issue, and with which arguments. On the way back out, this
+ * gets moved to a short per thread history. A watchdog thread looks at
+ * all of this every so often, and reports every ioctl which has been in
+ * the kernel for longer than VIV_WRAP_HANG_MS, once, together with what
+ * that thread did right before.
+ *
+ * Updates are guarded by a sequence count, which is odd while the owner
+ * is busy, so the watchdog never has to take a lock. Whatever it reads is
+ * copied out first and only then checked and used.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "wrap.h"
+#include "record.h"
+
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
+
+#define HANG_ARGS_MAX sizeof(((gcsHAL_INTERFACE *) 0)->u)
+#define HANG_HISTORY 16 /* a power of two. */
+
+struct hang_history {
+	uint64_t start;
+	uint64_t duration;
+	uint8_t command;
+	uint8_t hardware;
+	int ret;
+	int status;
+};
+
+struct wrap_hang {
+	unsigned int sequence; /* odd while being written. */
+	int busy; /* inside the ioctl. */
+
+	uint64_t start;
+	int command;
+	int hardware;
+	int size;
+	char args[HANG_ARGS_MAX];
+
+	unsigned int history_head;
+	struct hang_history history[HANG_HISTORY];
+
+	/* only written by the watchdog: sequence of the last report. */
+	unsigned int reported;
+};
+
+int wrap_hang_ms;
+
+static pthread_mutex_t hang_start_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_t hang_thread;
+static int hang_started;
+static int hang_running;
+static int hang_stop;
+static int hang_atfork_registered;
+
+static struct wrap_hang *
+hang_get(struct wrap_thread *thread)
+{
+	struct wrap_hang *hang = thread->hang;
+
+	if (hang)
+		return hang;
+
+	hang = calloc(1, sizeof(struct wrap_hang));
+	if (!hang) {
+		fprintf(stderr, "%s: failed to allocate hang state\n",
+			__func__);
+		exit(-1);
+	}
+	/* nothing was ever reported. */
+	hang->reported = -1;
+
+	__atomic_store_n(&thread->hang, hang, __ATOMIC_RELEASE);
+
+	return hang;
+}
+
+static void
+hang_begin(struct wrap_hang *hang)
+{
+	__atomic_store_n(&hang->sequence, hang->sequence + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+hang_end(struct wrap_hang *hang)
+{
+	__atomic_store_n(&hang->sequence, hang->sequence + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static void hang_start(void);
+
+/*
+ * Only ever called by the owning thread, right before the ioctl.
+ */
+void
+wrap_hang_enter(int command, int hardware, const void *args, int size,
+		uint64_t start)
+{
+	struct wrap_hang *hang = hang_get(wrap_thread_get());
+
+	if (!__atomic_load_n(&hang_started, __ATOMIC_ACQUIRE))
+		hang_start();
+
+	if (size > HANG_ARGS_MAX)
+		size = HANG_ARGS_MAX;
+
+	hang_begin(hang);
+
+	hang->busy = 1;
+	hang->start = start;
+	hang->command = command;
+	hang->hardware = hardware;
+	hang->size = size;
+	memcpy(hang->args, args, size);
+
+	hang_end(hang);
+}
+
+/*
+ * Only ever called by the owning thread, right after the ioctl.
+ */
+void
+wrap_hang_leave(int ret, int status, uint64_t duration)
+{
+	struct wrap_thread *thread = wrap_thread_get();
+	struct wrap_hang *hang = thread->hang;
+	struct hang_history *history;
+	unsigned int sequence = hang->sequence;
+
+	hang_begin(hang);
+
+	history = &hang->history[hang->history_head & (HANG_HISTORY - 1)];
+	history->start = hang->start;
+	history->duration = duration;
+	history->command = hang->command;
+	history->hardware = hang->hardware;
+	history->ret = ret;
+	history->status = status;
+
+	hang->history_head++;
+	hang->busy = 0;
+
+	hang_end(hang);
+
+	if (__atomic_load_n(&hang->reported, __ATOMIC_ACQUIRE) == sequence) {
+		wrap_log("/* viv_wrap: watchdog: thread %d returned from "
+			 "%s(%s) after %llums = %d, status %d. */\n",
+			 thread->tid, command_table[history->command].name,
+			 viv_hardware_type(history->hardware),
+			 (unsigned long long) duration / 1000000, ret, status);
+		wrap_log_commit();
+	}
+}
+
+/*
+ * Watchdog side.
+ */
+static int
+hang_copy(struct wrap_hang *hang, struct wrap_hang *copy,
+	  unsigned int *sequence)
+{
+	*sequence = __atomic_load_n(&hang->sequence, __ATOMIC_ACQUIRE);
+	if (*sequence & 1)
+		return -1;
+
+	memcpy(copy, hang, sizeof(struct wrap_hang));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&hang->sequence, __ATOMIC_RELAXED) != *sequence)
+		return -1;
+
+	return 0;
+}
+
+static void
+hang_report_args(struct wrap_thread *thread, struct wrap_hang *copy)
+{
+	struct wrap_command *entry = &command_table[copy->command];
+
+	if (!entry->size) {
+		wrap_log("%s(%s, command %d);\n", entry->name,
+			 viv_hardware_type(copy->hardware), copy->command);
+		return;
+	}
+
+	if (wrap_log_binary) {
+		struct viv_record record = {
+			.size = entry->size,
+			.tid = thread->tid,
+			.type = VIV_RECORD_PRE,
+			.command = copy->command,
+			.hardware = copy->hardware,
+		};
+
+		wrap_log_record(&record, copy->args);
+	} else
+		entry->pre(entry->name, viv_hardware_type(copy->hardware),
+			   copy->args);
+}
+
+static void
+hang_report(struct wrap_thread *thread, struct wrap_hang *copy,
+	    uint64_t now)
+{
+	unsigned int i, first;
+
+	wrap_log("/* viv_wrap: watchdog: thread %d stuck for %llums in: */\n",
+		 thread->tid, (unsigned long long) (now - copy->start) / 1000000);
+
+	hang_report_args(thread, copy);
+
+	if (copy->history_head > HANG_HISTORY)
+		first = copy->history_head - HANG_HISTORY;
+	else
+		first = 0;
+
+	wrap_log("/* viv_wrap: watchdog: thread %d history:\n", thread->tid);
+	for (i = first; i != copy->history_head; i++) {
+		struct hang_history *history =
+			&copy->history[i & (HANG_HISTORY - 1)];
+
+		wrap_log(" *   @%llu.%09llus %s(%s) = %d, status %d, "
+			 "took %llu.%03lluus\n",
+			 (unsigned long long) history->start / 1000000000,
+			 (unsigned long long) history->start % 1000000000,
+			 command_table[history->command].name,
+			 viv_hardware_type(history->hardware),
+			 history->ret, history->status,
+			 (unsigned long long) history->duration / 1000,
+			 (unsigned long long) history->duration % 1000);
+	}
+	wrap_log(" */\n");
+
+	wrap_log_commit();
+}
+
+static void
+hang_check(void)
+{
+	struct wrap_thread *thread;
+	struct wrap_hang copy;
+	uint64_t now = wrap_time();
+	int found = 0;
+
+	for (thread = wrap_thread_first(); thread; thread = thread->next) {
+		struct wrap_hang *hang =
+			__atomic_load_n(&thread->hang, __ATOMIC_ACQUIRE);
+		unsigned int sequence;
+
+		if (!hang || !__atomic_load_n(&hang->busy, __ATOMIC_RELAXED))
+			continue;
+
+		if (hang_copy(hang, &copy, &sequence) || !copy.busy)
+			continue;
+
+		if ((now - copy.start) < (wrap_hang_ms * 1000000ULL))
+			continue;
+
+		if (copy.reported == sequence)
+			continue;
+
+		hang_report(thread, &copy, now);
+		__atomic_store_n(&hang->reported, sequence, __ATOMIC_RELEASE);
+		found = 1;
+	}
+
+	if (found && wrap_flight_size)
+		viv_wrap_flight_dump("watchdog");
+}
+
+static void *
+hang_watchdog(void *data)
+{
+	unsigned int interval = wrap_hang_ms * 250; /* us */
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (interval > 100000)
+		interval = 100000;
+
+	while (!__atomic_load_n(&hang_stop, __ATOMIC_ACQUIRE)) {
+		usleep(interval);
+		hang_check();
+	}
+
+	return NULL;
+}
+
+/*
+ * Only the forking thread survives, the watchdog gets started again with
+ * the next ioctl.
+ */
+static void
+hang_atfork_child(void)
+{
+	pthread_mutex_init(hang_start_mutex, NULL);
+	hang_started = 0;
+	hang_running = 0;
+	hang_stop = 0;
+}
+
+static void
+hang_start(void)
+{
+	pthread_mutex_lock(hang_start_mutex);
+
+	if (!hang_started) {
+		int ret = pthread_create(&hang_thread, NULL, hang_watchdog,
+					 NULL);
+
+		if (ret)
+			fprintf(stderr, "%s: failed to create watchdog: %s\n",
+				__func__, strerror(ret));
+		else
+			hang_running = 1;
+
+		if (!hang_atfork_registered) {
+			pthread_atfork(NULL, NULL, hang_atfork_child);
+			hang_atfork_registered = 1;
+		}
+
+		__atomic_store_n(&hang_started, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(hang_start_mutex);
+}
+
+void
+wrap_hang_init(void)
+{
+	wrap_hang_ms = wrap_getenv_int("VIV_WRAP_HANG_MS", 0);
+	if (wrap_hang_ms < 0)
+		wrap_hang_ms = 0;
+}
+
+/*
+ * The watchdog is not started again after this.
+ */
+void
+wrap_hang_close(void)
+{
+	pthread_mutex_lock(hang_start_mutex);
+
+	if (hang_running) {
+		__atomic_store_n(&hang_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(hang_thread, NULL);
+		hang_running = 0;
+	}
+	__atomic_store_n(&hang_started, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(hang_start_mutex);
+}
@@ -24,6 +24,7 @@
  * ioctls can theoretically by logged right next to the GL or Qt calls.
  */
 
+#define _GNU_SOURCE /* RTLD_NEXT */
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,71 +34,34 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <asm/ioctl.h>
 #include <stdint.h>
 #include <signal.h>
 
+#include "wrap.h"
+#include "record.h"
+
 /*
- *
- * Basic log writing infrastructure.
- *
+ * Numeric configuration from the environment.
  */
-FILE *viv_wrap_log;
-static pthread_mutex_t wrap_log_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
-int frame_count;
-
-static void
-wrap_log_open(void)
-{
-	char *filename;
-
-	if (viv_wrap_log)
-		return;
-
-	filename = getenv("VIV_WRAP_LOG");
-	if (!filename)
-		filename = "/tmp/viv_wrap.log";
-
-	viv_wrap_log = fopen(filename, "w");
-	if (!viv_wrap_log) {
-		fprintf(stderr, "Error: failed to open wrap log %s: %s\n",
-			filename, strerror(errno));
-		viv_wrap_log = stdout;
-		printf("viv_wrap: dumping to stdout.\n");
-	} else
-		printf("viv_wrap: dumping to %s.\n", filename);
-}
-
-static int
-wrap_log(const char *format, ...)
+int
+wrap_getenv_int(const char *name, int value)
 {
-	va_list args;
-	int ret;
-
-	pthread_mutex_lock(wrap_log_mutex);
-
-	wrap_log_open();
-
-	va_start(args, format);
-	ret = vfprintf(viv_wrap_log, format, args);
-	va_end(args);
+	char *string = getenv(name), *end;
+	long ret;
 
-	pthread_mutex_unlock(wrap_log_mutex);
+	if (!string || !string[0])
+		return value;
 
-	return ret;
-}
-
-void
-wrap_log_flush(int signum)
-{
-	if (viv_wrap_log) {
-		pthread_mutex_lock(wrap_log_mutex);
-		fprintf(viv_wrap_log, "SIG_INT!\n");
-		fflush(viv_wrap_log);
-		pthread_mutex_unlock(wrap_log_mutex);
+	ret = strtol(string, &end, 0);
+	if (*end) {
+		fprintf(stderr, "viv_wrap: ignoring invalid %s=%s\n",
+			name, string);
+		return value;
 	}
 
-	signal(SIGINT, SIG_DFL);
+	return ret;
 }
 
 /*
@@ -138,7 +102,33 @@ libc_dlsym(const char *name)
 	return func;
 }
 
-static int dev_galcore_fd;
+static int dev_galcore_fd = -1;
+
+/* per call logging, turn off to only collect statistics. */
+int wrap_trace = 1;
+
+/* something besides the trace wants to see every ioctl. */
+static int galcore_observed;
+
+static void
+wrap_exit(void)
+{
+	wrap_database_close();
+	wrap_hang_close();
+	viv_wrap_stats_dump();
+	viv_wrap_capture_stats();
+	wrap_dedup_close();
+	viv_wrap_queue_stats();
+	wrap_sample_report();
+	viv_wrap_vidmem_stats();
+	viv_wrap_vidmem_locks();
+	viv_wrap_vidmem_churn();
+	viv_wrap_vidmem_leaks("exit");
+	viv_wrap_mapping_dump();
+	viv_wrap_pin_dump();
+	wrap_timeline_close();
+	wrap_log_close();
+}
 
 /*
  *
@@ -157,7 +147,36 @@ open(const char* path, int flags, ...)
 
 	if (!orig_open) {
 		orig_open = libc_dlsym(__func__);
+		wrap_trace = wrap_getenv_int("VIV_WRAP_TRACE", wrap_trace);
+		wrap_filter_init();
+		wrap_sample_init();
+		wrap_log_init();
+		wrap_flight_init();
+		wrap_stats_init();
+		wrap_hang_init();
+		wrap_timeline_init();
+		wrap_vidmem_init();
+		wrap_address_enabled = wrap_getenv_int("VIV_WRAP_ADDRESS", 0);
+		wrap_database_init();
+		wrap_mapping_enabled = wrap_getenv_int("VIV_WRAP_MAPPINGS", 0);
+		wrap_pin_enabled = wrap_getenv_int("VIV_WRAP_PINS", 0) ||
+			wrap_timeline_enabled;
+		wrap_capture_enabled = wrap_getenv_int("VIV_WRAP_CAPTURE", 0);
+		if (wrap_capture_enabled)
+			wrap_dedup_init();
+		wrap_capture_opcodes = wrap_getenv_int("VIV_WRAP_OPCODES", 0);
+		wrap_delta_enabled = wrap_getenv_int("VIV_WRAP_DELTA", 0);
+		wrap_queue_enabled = wrap_getenv_int("VIV_WRAP_QUEUE", 0);
+
+		galcore_observed = wrap_stats_enabled || wrap_hang_ms ||
+			wrap_vidmem_size || wrap_address_enabled ||
+			wrap_mapping_enabled || wrap_pin_enabled ||
+			wrap_timeline_enabled || wrap_capture_enabled ||
+			wrap_capture_opcodes || wrap_delta_enabled ||
+			wrap_queue_enabled;
+
 		signal(SIGINT, wrap_log_flush);
+		atexit(wrap_exit);
 	}
 
 	if (flags & O_CREAT) {
@@ -173,8 +192,10 @@ open(const char* path, int flags, ...)
 		ret = orig_open(path, flags);
 
 		if (ret != -1) {
-			if (galcore)
+			if (galcore) {
 				dev_galcore_fd = ret;
+				wrap_database_start();
+			}
 		}
 	}
 
@@ -194,7 +215,7 @@ close(int fd)
 	if (!orig_close)
 		orig_close = libc_dlsym(__func__);
 
-	if (fd == dev_galcore_fd)
+	if ((fd != -1) && (fd == dev_galcore_fd))
 		dev_galcore_fd = -1;
 
 	ret = orig_close(fd);
@@ -203,546 +224,408 @@ close(int fd)
 }
 
 /*
- *
+ * Mappings of galcore, anonymous mappings come with fd -1, which is also
+ * what dev_galcore_fd is while galcore is not open.
  */
-static int galcore_ioctl(int request, void *data);
-static int (*orig_ioctl)(int fd, unsigned long request, ...);
+static void galcore_mmap(void *address, size_t size, int prot, int flags,
+			 uint64_t offset);
+static void *(*orig_mmap)(void *address, size_t size, int prot, int flags,
+			  int fd, off_t offset);
 
-int
-ioctl(int fd, unsigned long request, ...)
+void *
+mmap(void *address, size_t size, int prot, int flags, int fd, off_t offset)
 {
-	int ioc_size = _IOC_SIZE(request);
-	int ret;
+	void *ret;
 
-	if (!orig_ioctl)
-		orig_ioctl = libc_dlsym(__func__);
+	if (!orig_mmap)
+		orig_mmap = libc_dlsym(__func__);
 
-	/* Vivante is soo broken, as is fbdev. */
-	if (ioc_size || (fd == dev_galcore_fd) ||
-	    ((request & 0xFFC8) == 0x4600)) {
-		va_list args;
-		void *ptr;
+	ret = orig_mmap(address, size, prot, flags, fd, offset);
 
-		va_start(args, request);
-		ptr = va_arg(args, void *);
-		va_end(args);
-
-		if (fd == dev_galcore_fd)
-			ret = galcore_ioctl(request, ptr);
-		else
-			ret = orig_ioctl(fd, request, ptr);
-	} else {
-		ret = orig_ioctl(fd, request);
-	}
+	if (wrap_mapping_enabled && (fd != -1) && (fd == dev_galcore_fd))
+		galcore_mmap(ret, size, prot, flags, offset);
 
 	return ret;
 }
 
-#define gcdENABLE_VG 1
-#include "gc_hal_base.h"
-#include "gc_hal_profiler.h"
-#include "gc_hal_driver.h"
+static void *(*orig_mmap64)(void *address, size_t size, int prot, int flags,
+			    int fd, off64_t offset);
 
-typedef struct _DRIVER_ARGS
+void *
+mmap64(void *address, size_t size, int prot, int flags, int fd,
+       off64_t offset)
 {
-    gctUINT64               InputBuffer;
-    gctUINT64               InputBufferSize;
-    gctUINT64               OutputBuffer;
-    gctUINT64               OutputBufferSize;
-}
-DRIVER_ARGS;
+	void *ret;
 
-static const char *
-viv_hardware_type(int type)
-{
-	switch(type) {
-	case 1:
-		return "3D";
-	case 2:
-		return "2D";
-	case 3:
-		return "2D/3D";
-	case 4:
-		return "VG";
-	default:
-		return NULL;
-	}
-}
+	if (!orig_mmap64)
+		orig_mmap64 = libc_dlsym(__func__);
 
-static int
-hook_unknown_pre(const char *command, const char *hardware, void *data)
-{
-	return -1;
-}
+	ret = orig_mmap64(address, size, prot, flags, fd, offset);
 
-static int
-hook_unknown_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	return -1;
-}
+	if (wrap_mapping_enabled && (fd != -1) && (fd == dev_galcore_fd))
+		galcore_mmap(ret, size, prot, flags, offset);
 
-static int
-hook_empty_pre(const char *command, const char *hardware, void *data)
-{
-	return 0;
+	return ret;
 }
 
-#if 0
-static int
-hook_empty_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	return 0;
-}
-#endif
+static int (*orig_munmap)(void *address, size_t size);
 
-static int
-hook_GetBaseAddress_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+int
+munmap(void *address, size_t size)
 {
-	struct _gcsHAL_GET_BASE_ADDRESS *address = data;
-
-	wrap_log("%s = 0x%08X;\n", command, address->baseAddress);
+	int ret;
 
-	return 0;
-}
+	if (!orig_munmap)
+		orig_munmap = libc_dlsym(__func__);
 
-static int
-hook_Version_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_VERSION *version = data;
+	ret = orig_munmap(address, size);
 
-	wrap_log("%s = %d.%d.%d.%d;\n", command, version->major, version->minor,
-		 version->patch, version->build);
+	if (wrap_mapping_enabled && !ret)
+		wrap_mapping_munmap(address, size);
 
-	return 0;
+	return ret;
 }
 
-static int
-hook_ChipInfo_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_CHIP_INFO *info = data;
-	int i;
-
-	wrap_log("%s[%d] = {\n", command, info->count);
-	for (i = 0; i < info->count; i++) {
-		if (hardware)
-			wrap_log("\t%s, /* %d */\n", hardware, i);
-		else
-			wrap_log("\tNULL, /* %d */\n", hardware, i);
-	}
-
-	wrap_log("};\n");
-
-	return 0;
-}
+/*
+ * Frame boundaries. Applications which do not go through EGL can call
+ * viv_wrap_frame() themselves.
+ */
+unsigned int wrap_frame;
 
-static int
-hook_QueryVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+void
+viv_wrap_frame(void)
 {
-	struct _gcsHAL_QUERY_VIDEO_MEMORY *memory = data;
-
-	wrap_log("%s = {\n", command);
-	wrap_log("\t.internalPhysical = 0x%08lX,\n", memory->internalPhysical);
-	wrap_log("\t.internalSize = %lld,\n", memory->internalSize);
-	wrap_log("\t.externalPhysical = 0x%08lX,\n", memory->externalPhysical);
-	wrap_log("\t.externalSize = %lld,\n", memory->externalSize);
-	wrap_log("\t.contiguousPhysical = 0x%08lX,\n", memory->contiguousPhysical);
-	wrap_log("\t.contiguousSize = %lld,\n", memory->contiguousSize);
-	wrap_log("};\n");
+	__atomic_add_fetch(&wrap_frame, 1, __ATOMIC_RELAXED);
 
-	return 0;
+	if (wrap_timeline_enabled)
+		wrap_timeline_frame();
 }
 
-static int
-hook_QueryChipIdentity_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_QUERY_CHIP_IDENTITY *identity = data;
-
-	wrap_log("%s(%s) = {\n", command, hardware);
-	wrap_log("\t.chipModel = %d,\n", identity->chipModel);
-	wrap_log("\t.chipRevision = 0x%08lX,\n", identity->chipRevision);
-	wrap_log("\t.chipFeatures = 0x%08lX,\n", identity->chipFeatures);
-	wrap_log("\t.chipMinorFeatures = 0x%08lX,\n", identity->chipMinorFeatures);
-	wrap_log("\t.chipMinorFeatures1 = 0x%08lX,\n", identity->chipMinorFeatures1);
-	wrap_log("\t.chipMinorFeatures2 = 0x%08lX,\n", identity->chipMinorFeatures2);
-	wrap_log("\t.chipMinorFeatures3 = 0x%08lX,\n", identity->chipMinorFeatures3);
-	wrap_log("\t.chipMinorFeatures4 = 0x%08lX,\n", identity->chipMinorFeatures4);
-	wrap_log("\t.streamCount = 0x%08lX,\n", identity->streamCount);
-	wrap_log("\t.registerMax = 0x%08lX,\n", identity->registerMax);
-	wrap_log("\t.threadCount = 0x%08lX,\n", identity->threadCount);
-	wrap_log("\t.shaderCoreCount = 0x%08lX,\n", identity->shaderCoreCount);
-	wrap_log("\t.vertexCacheSize = 0x%08lX,\n", identity->vertexCacheSize);
-	wrap_log("\t.vertexOutputBufferSize = 0x%08lX,\n", identity->vertexOutputBufferSize);
-	wrap_log("\t.pixelPipes = 0x%08lX,\n", identity->pixelPipes);
-	wrap_log("\t.instructionCount = 0x%08lX,\n", identity->instructionCount);
-	wrap_log("\t.numConstants = 0x%08lX,\n", identity->numConstants);
-	wrap_log("\t.bufferSize = 0x%08lX,\n", identity->bufferSize);
-	wrap_log("\t.varyingsCount = 0x%08lX,\n", identity->varyingsCount);
-	wrap_log("\t.superTileMode = 0x%08lX,\n", identity->superTileMode);
-	wrap_log("\t.chip2DControl = 0x%08lX,\n", identity->chip2DControl);
-	wrap_log("};\n");
-
-	return 0;
-}
+static unsigned int (*orig_eglSwapBuffers)(void *display, void *surface);
 
-static int
-hook_Attach_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+unsigned int
+eglSwapBuffers(void *display, void *surface)
 {
-	struct _gcsHAL_ATTACH *attach = data;
-
-	wrap_log("%s(%s, context 0x%08lX, stateCount %lld) = %d;\n",
-		 command, hardware, attach->context, attach->stateCount, ioctl_ret);
+	unsigned int ret;
 
-	return 0;
-}
+	if (!orig_eglSwapBuffers) {
+		orig_eglSwapBuffers = dlsym(RTLD_NEXT, __func__);
+		if (!orig_eglSwapBuffers) {
+			printf("Failed to find %s: %s\n", __func__,
+			       dlerror());
+			exit(-1);
+		}
+	}
 
-static int
-hook_AllocateContiguousMemory_pre(const char *command, const char *hardware, void *data)
-{
-	struct  _gcsHAL_ALLOCATE_CONTIGUOUS_MEMORY *alloc = data;
+	ret = orig_eglSwapBuffers(display, surface);
 
-	wrap_log("%s(%s, bytes 0x%llX);\n", command, hardware, alloc->bytes);
+	viv_wrap_frame();
 
-	return 0;
+	return ret;
 }
 
-static int
-hook_AllocateContiguousMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct  _gcsHAL_ALLOCATE_CONTIGUOUS_MEMORY *alloc = data;
-
-	wrap_log("%s(%s, bytes 0x%llX, address 0x%08lX, physical 0x%08lX, logical 0x%08llX) = %d;\n",
-		 command, hardware, alloc->bytes, alloc->address, alloc->physical, alloc->logical, ioctl_ret);
-
-	return 0;
-}
+/*
+ *
+ */
+static int galcore_ioctl(int request, void *data);
+static int (*orig_ioctl)(int fd, unsigned long request, ...);
 
-static int
-hook_UserSignal_pre(const char *command, const char *hardware, void *data)
+int
+ioctl(int fd, unsigned long request, ...)
 {
-	struct  _gcsHAL_USER_SIGNAL *signal = data;
+	int ioc_size = _IOC_SIZE(request);
+	int ret;
 
-	switch(signal->command) {
-	case gcvUSER_SIGNAL_CREATE:
-		wrap_log("%s(%s, CREATE, manualreset %d);\n",
-			 command, hardware, signal->manualReset);
-		break;
-        case gcvUSER_SIGNAL_DESTROY:
-		wrap_log("%s(%s, DESTROY, id 0x%08lX);\n",
-			 command, hardware, signal->id);
-		break;
-        case gcvUSER_SIGNAL_SIGNAL:
-		wrap_log("%s(%s, SIGNAL, id 0x%08lX, state %d);\n",
-			 command, hardware, signal->id, signal->state);
-		break;
-        case gcvUSER_SIGNAL_WAIT:
-		wrap_log("%s(%s, WAIT, id 0x%08lX, wait %d);\n",
-			 command, hardware, signal->id, signal->wait);
-		break;
-        case gcvUSER_SIGNAL_MAP:
-		wrap_log("%s(%s, MAP, id 0x%08lX);\n",
-			 command, hardware, signal->id);
-		break;
-	case gcvUSER_SIGNAL_UNMAP:
-		wrap_log("%s(%s, UNMAP, id 0x%08lX);\n",
-			 command, hardware, signal->id);
-		break;
-	default:
-		fprintf(stderr, "%s: unknown signal %d\n", __func__, signal->command);
-		break;
-	}
+	if (!orig_ioctl)
+		orig_ioctl = libc_dlsym(__func__);
 
-	return 0;
-}
+	/* Vivante is soo broken, as is fbdev. */
+	if (ioc_size || ((fd != -1) && (fd == dev_galcore_fd)) ||
+	    ((request & 0xFFC8) == 0x4600)) {
+		va_list args;
+		void *ptr;
 
-static int
-hook_UserSignal_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct  _gcsHAL_USER_SIGNAL *signal = data;
+		va_start(args, request);
+		ptr = va_arg(args, void *);
+		va_end(args);
 
-	switch(signal->command) {
-	case gcvUSER_SIGNAL_CREATE:
-		wrap_log("%s(%s, CREATE, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-        case gcvUSER_SIGNAL_DESTROY:
-		wrap_log("%s(%s, DESTROY, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-        case gcvUSER_SIGNAL_SIGNAL:
-		wrap_log("%s(%s, SIGNAL, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-        case gcvUSER_SIGNAL_WAIT:
-		wrap_log("%s(%s, WAIT, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-        case gcvUSER_SIGNAL_MAP:
-		wrap_log("%s(%s, MAP, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-	case gcvUSER_SIGNAL_UNMAP:
-		wrap_log("%s(%s, UNMAP, id 0x%08lX) = %d;\n",
-			 command, hardware, signal->id, ioctl_ret);
-		break;
-	default:
-		fprintf(stderr, "%s: unknown signal %d\n", __func__, signal->command);
-		break;
+		if ((fd != -1) && (fd == dev_galcore_fd))
+			ret = galcore_ioctl(request, ptr);
+		else
+			ret = orig_ioctl(fd, request, ptr);
+	} else {
+		ret = orig_ioctl(fd, request);
 	}
 
-	return 0;
+	return ret;
 }
 
-static int
-hook_QueryCommandBuffer_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_QUERY_COMMAND_BUFFER *query = data;
-	struct _gcsCOMMAND_BUFFER_INFO *info = &query->information;
-
-	wrap_log("%s(%s) = {{\n", command, hardware);
-	wrap_log("\t.feBufferInt = 0x%08lX,\n", info->feBufferInt);
-	wrap_log("\t.tsOverflowInt = 0x%08lX,\n", info->tsOverflowInt);
-	wrap_log("\t.addressMask = 0x%08lX,\n", info->addressMask);
-	wrap_log("\t.addressAlignment = 0x%08lX,\n", info->addressAlignment);
-	wrap_log("\t.commandAlignment = 0x%08lX,\n", info->commandAlignment);
-	wrap_log("\t.stateCommandSize = 0x%08lX,\n", info->stateCommandSize);
-	wrap_log("\t.restartCommandSize = 0x%08lX,\n", info->restartCommandSize);
-	wrap_log("\t.fetchCommandSize = 0x%08lX,\n", info->fetchCommandSize);
-	wrap_log("\t.callCommandSize = 0x%08lX,\n", info->callCommandSize);
-	wrap_log("\t.returnCommandSize = 0x%08lX,\n", info->returnCommandSize);
-	wrap_log("\t.eventCommandSize = 0x%08lX,\n", info->eventCommandSize);
-	wrap_log("\t.endCommandSize = 0x%08lX,\n", info->endCommandSize);
-	wrap_log("\t.staticTailSize = 0x%08lX,\n", info->staticTailSize);
-	wrap_log("\t.dynamicTailSize = 0x%08lX,\n", info->dynamicTailSize);
-	wrap_log("}};\n");
+#define gcdENABLE_VG 1
+#include "gc_hal_base.h"
+#include "gc_hal_profiler.h"
+#include "gc_hal_driver.h"
 
-	return 0;
+typedef struct _DRIVER_ARGS
+{
+    gctUINT64               InputBuffer;
+    gctUINT64               InputBufferSize;
+    gctUINT64               OutputBuffer;
+    gctUINT64               OutputBufferSize;
 }
+DRIVER_ARGS;
 
+/*
+ * Binary counterparts of the pre and post hooks: no formatting, only
+ * the relevant part of the interface gets copied out.
+ */
 static int
-hook_AllocateLinearVideoMemory_pre(const char *command, const char *hardware, void *data)
+record_pre(gcsHAL_INTERFACE *input)
 {
-	struct _gcsHAL_ALLOCATE_LINEAR_VIDEO_MEMORY *alloc = data;
+	struct viv_record record = {
+		.size = command_table[input->command].size,
+		.type = VIV_RECORD_PRE,
+		.command = input->command,
+		.hardware = input->hardwareType,
+	};
 
-	wrap_log("%s(%s, bytes 0x%lX, alignment %d, type %d, pool %d);\n",
-		 command, hardware, alloc->bytes, alloc->alignment, alloc->type, alloc->pool);
+	if (!record.size)
+		return -1;
 
-	return 0;
+	return wrap_log_record(&record, &input->u);
 }
 
 static int
-hook_AllocateLinearVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+record_post(gcsHAL_INTERFACE *output, int ioctl_ret, uint64_t start,
+	    uint64_t duration)
 {
-	struct _gcsHAL_ALLOCATE_LINEAR_VIDEO_MEMORY *alloc = data;
+	struct viv_record record = {
+		.timestamp = start,
+		.duration = duration,
+		.size = command_table[output->command].size,
+		.type = VIV_RECORD_POST,
+		.command = output->command,
+		.hardware = output->hardwareType,
+		.ret = ioctl_ret,
+		.status = output->status,
+	};
 
-	wrap_log("%s(%s, bytes 0x%lX, type %d, pool %d, node 0x%08llX) = %d;\n",
-		 command, hardware, alloc->bytes, alloc->type, alloc->pool, alloc->node, ioctl_ret);
+	if (!record.size)
+		return -1;
 
-	return 0;
+	return wrap_log_record(&record, &output->u);
 }
 
-static int
-hook_LockVideoMemory_pre(const char *command, const char *hardware, void *data)
+/*
+ * The flight recorder also keeps what it does not understand.
+ */
+static void
+flight_pre(gcsHAL_INTERFACE *input)
 {
-	struct _gcsHAL_LOCK_VIDEO_MEMORY *lock = data;
+	struct viv_record record = {
+		.size = command_table[input->command].size,
+		.type = VIV_RECORD_PRE,
+		.command = input->command,
+		.hardware = input->hardwareType,
+	};
 
-	wrap_log("%s(%s, node 0x%llX, cacheable %d);\n",
-		 command, hardware, lock->node, lock->cacheable);
+	if (!record.size)
+		record.size = sizeof(input->u);
 
-	return 0;
+	wrap_flight_record(&record, &input->u);
 }
 
-static int
-hook_LockVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+static void
+flight_post(gcsHAL_INTERFACE *output, int ioctl_ret, uint64_t start,
+	    uint64_t duration)
 {
-	struct _gcsHAL_LOCK_VIDEO_MEMORY *lock = data;
+	struct viv_record record = {
+		.timestamp = start,
+		.duration = duration,
+		.size = command_table[output->command].size,
+		.type = VIV_RECORD_POST,
+		.command = output->command,
+		.hardware = output->hardwareType,
+		.ret = ioctl_ret,
+		.status = output->status,
+	};
 
-	wrap_log("%s(%s, node 0x%llX, address 0x%08lX, memory 0x%08llX) = %d\n",
-		 command, hardware, lock->node, lock->address, lock->memory, ioctl_ret);
+	if (!record.size)
+		record.size = sizeof(output->u);
 
-	return 0;
+	wrap_flight_record(&record, &output->u);
+
+	if (ioctl_ret || (output->status < 0))
+		wrap_flight_error(output->command, ioctl_ret, output->status);
 }
 
-static int
-hook_Commit_pre(const char *command, const char *hardware, void *data)
+static inline void
+galcore_stats(gcsHAL_INTERFACE *input, int subcommand, uint64_t duration)
 {
-	struct _gcsHAL_COMMIT *commit = data;
-
-	wrap_log("%s(%s, queue 0x%08llX);\n",
-		 command, hardware, commit->queue);
-
-	return 0;
+	if (wrap_stats_enabled)
+		wrap_stats_add(input->command, input->hardwareType, subcommand,
+			       duration);
 }
 
-static int
-hook_Commit_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_COMMIT *commit = data;
+/* hardware type the application talks to, for our own queries. */
+static int galcore_hardware;
 
-	wrap_log("%s(%s, queue 0x%08llX) = %d;\n",
-		 command, hardware, commit->queue, ioctl_ret);
+/*
+ * mmap() of galcore gets filtered and sampled as if it were a MAP_MEMORY,
+ * and never goes into the flight recorder, which only holds ioctls.
+ */
+static void
+galcore_mmap(void *address, size_t size, int prot, int flags, uint64_t offset)
+{
+	int traced = wrap_trace && !wrap_flight_size &&
+		wrap_filter_traced(gcvHAL_MAP_MEMORY, galcore_hardware);
 
-	return 0;
+	wrap_mapping_mmap(address, size, prot, flags, offset, traced);
 }
 
-static int
-hook_UnlockVideoMemory_pre(const char *command, const char *hardware, void *data)
+/*
+ * Issues a command on the application's galcore fd, bypassing all of the
+ * tracing. Returns -1 when either the ioctl or the command failed, and 1
+ * when there is nothing to issue it on yet: the application did not issue
+ * its first ioctl, or does not have galcore open right now.
+ */
+int
+wrap_galcore_query(void *data)
 {
-	struct _gcsHAL_UNLOCK_VIDEO_MEMORY *unlock = data;
-
-	wrap_log("%s(%s, node 0x%08llX, type %d, async %d);\n",
-		 command, hardware, unlock->node, unlock->type, unlock->asynchroneous);
+	gcsHAL_INTERFACE *interface = data;
+	int fd = dev_galcore_fd;
+	DRIVER_ARGS args;
 
-	return 0;
-}
+	if (!orig_ioctl)
+		orig_ioctl = libc_dlsym("ioctl");
 
-static int
-hook_UnlockVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_UNLOCK_VIDEO_MEMORY *unlock = data;
+	if ((fd == -1) || !galcore_hardware)
+		return 1;
 
-	wrap_log("%s(%s, node 0x%08llX) = %d;\n", command, hardware, unlock->node, ioctl_ret);
+	interface->hardwareType = galcore_hardware;
 
-	return 0;
-}
+	args.InputBuffer = (uintptr_t) interface;
+	args.InputBufferSize = sizeof(gcsHAL_INTERFACE);
+	args.OutputBuffer = (uintptr_t) interface;
+	args.OutputBufferSize = sizeof(gcsHAL_INTERFACE);
 
-static int
-hook_EventCommit_pre(const char *command, const char *hardware, void *data)
-{
-	struct _gcsHAL_EVENT_COMMIT *commit = data;
+	if (orig_ioctl(fd, IOCTL_GCHAL_INTERFACE, &args)) {
+		/* closed underneath us. */
+		if (errno == EBADF)
+			return 1;
+		return -1;
+	}
 
-	wrap_log("%s(%s, queue 0x%08llX);\n", command, hardware, commit->queue);
+	if (interface->status < 0)
+		return -1;
 
 	return 0;
 }
 
-static int
-hook_EventCommit_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+/*
+ * Frees and unlocks usually come through the event queue of a COMMIT or
+ * EVENT_COMMIT, and not as an ioctl of their own.
+ */
+static void
+galcore_deferred(void *data, void *private)
 {
-	struct _gcsHAL_EVENT_COMMIT *commit = data;
+	gcsHAL_INTERFACE *interface = data;
 
-	wrap_log("%s(%s, queue 0x%08llX) = %d;\n", command, hardware, commit->queue, ioctl_ret);
+	switch (interface->command) {
+	case gcvHAL_FREE_VIDEO_MEMORY:
+	case gcvHAL_UNLOCK_VIDEO_MEMORY:
+	case gcvHAL_FREE_CONTIGUOUS_MEMORY:
+	case gcvHAL_UNMAP_USER_MEMORY:
+		break;
+	default:
+		return;
+	}
 
-	return 0;
+	if (wrap_vidmem_size)
+		wrap_vidmem_deferred(interface);
+	if (wrap_address_enabled)
+		wrap_address_update(interface);
+	if (wrap_pin_enabled)
+		wrap_pin_post(interface);
+	if (wrap_timeline_enabled)
+		wrap_timeline_post(interface);
 }
 
+/*
+ * The actual ioctl, timed, and watched over.
+ */
 static int
-hook_Detach_pre(const char *command, const char *hardware, void *data)
+galcore_issue(int request, void *data, gcsHAL_INTERFACE *interface,
+	      uint64_t *start, uint64_t *duration)
 {
-	struct _gcsHAL_DETACH *detach = data;
+	int ret;
 
-	wrap_log("%s(%s, context 0x%08lX);\n", command, hardware, detach->context);
+	if (wrap_vidmem_size)
+		wrap_vidmem_pre(interface);
 
-	return 0;
-}
+	*start = wrap_time();
 
-static int
-hook_Detach_post(const char *command, const char *hardware, void *data, int ioctl_ret)
-{
-	struct _gcsHAL_DETACH *detach = data;
+	if (wrap_hang_ms) {
+		int size = command_table[interface->command].size;
 
-	wrap_log("%s(%s, context 0x%08lX) = %d;\n",
-		 command, hardware, detach->context, ioctl_ret);
+		if (!size)
+			size = sizeof(interface->u);
 
-	return 0;
-}
-
-static int
-hook_FreeVideoMemory_pre(const char *command, const char *hardware, void *data)
-{
-	struct _gcsHAL_FREE_VIDEO_MEMORY *free = data;
+		wrap_hang_enter(interface->command, interface->hardwareType,
+				&interface->u, size, *start);
+	}
 
-	wrap_log("%s(%s, node 0x%08llX);\n", command, hardware, free->node);
+	ret = orig_ioctl(dev_galcore_fd, request, data);
+	*duration = wrap_time() - *start;
+
+	if (wrap_hang_ms)
+		wrap_hang_leave(ret, interface->status, *duration);
+
+	if (!ret && (interface->status >= 0)) {
+		if (wrap_vidmem_size)
+			wrap_vidmem_post(interface);
+		if (wrap_address_enabled)
+			wrap_address_update(interface);
+		if (wrap_mapping_enabled)
+			wrap_mapping_post(interface);
+		if (wrap_pin_enabled)
+			wrap_pin_post(interface);
+		if (wrap_timeline_enabled)
+			wrap_timeline_post(interface);
+		if ((wrap_vidmem_size || wrap_address_enabled ||
+		     wrap_pin_enabled) &&
+		    ((interface->command == gcvHAL_COMMIT) ||
+		     (interface->command == gcvHAL_EVENT_COMMIT)))
+			wrap_queue_foreach(interface, galcore_deferred, NULL,
+					   NULL);
+	}
 
-	return 0;
+	return ret;
 }
 
-static int
-hook_FreeVideoMemory_post(const char *command, const char *hardware, void *data, int ioctl_ret)
+/*
+ * Command buffer capture, decoding and event queues. Untraced commits only
+ * get counted.
+ */
+static void
+galcore_commit(gcsHAL_INTERFACE *interface, int traced)
 {
-	struct _gcsHAL_FREE_VIDEO_MEMORY *free = data;
-
-	wrap_log("%s(%s, node 0x%08llX) = %d;\n", command, hardware, free->node, ioctl_ret);
-
-	return 0;
+	if ((wrap_capture_enabled || wrap_capture_opcodes ||
+	     wrap_delta_enabled) && (interface->command == gcvHAL_COMMIT))
+		wrap_capture_commit(interface, traced);
+	if (wrap_queue_enabled &&
+	    ((interface->command == gcvHAL_COMMIT) ||
+	     (interface->command == gcvHAL_EVENT_COMMIT)))
+		wrap_queue_walk(interface, traced);
 }
 
-struct {
-	int command;
-	char *name;
-	int (*pre) (const char *command, const char *hardware, void *data);
-	int (*post) (const char *command, const char *hardware, void *data, int ioctl_ret);
-} command_table[] = {
-	{gcvHAL_QUERY_VIDEO_MEMORY, "QUERY_VIDEO_MEMORY", hook_empty_pre, hook_QueryVideoMemory_post},
-	{gcvHAL_QUERY_CHIP_IDENTITY, "QUERY_CHIP_IDENTITY", hook_empty_pre, hook_QueryChipIdentity_post},
-	{gcvHAL_ALLOCATE_NON_PAGED_MEMORY, "ALLOCATE_NON_PAGED_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_FREE_NON_PAGED_MEMORY, "FREE_NON_PAGED_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_ALLOCATE_CONTIGUOUS_MEMORY, "ALLOCATE_CONTIGUOUS_MEMORY", hook_AllocateContiguousMemory_pre, hook_AllocateContiguousMemory_post},
-	{gcvHAL_FREE_CONTIGUOUS_MEMORY, "FREE_CONTIGUOUS_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_ALLOCATE_VIDEO_MEMORY, "ALLOCATE_VIDEO_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_ALLOCATE_LINEAR_VIDEO_MEMORY, "ALLOCATE_LINEAR_VIDEO_MEMORY", hook_AllocateLinearVideoMemory_pre, hook_AllocateLinearVideoMemory_post},
-	{gcvHAL_FREE_VIDEO_MEMORY, "FREE_VIDEO_MEMORY", hook_FreeVideoMemory_pre, hook_FreeVideoMemory_post},
-	{gcvHAL_MAP_MEMORY, "MAP_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_UNMAP_MEMORY, "UNMAP_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_MAP_USER_MEMORY, "MAP_USER_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_UNMAP_USER_MEMORY, "UNMAP_USER_MEMORY", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_LOCK_VIDEO_MEMORY, "LOCK_VIDEO_MEMORY", hook_LockVideoMemory_pre, hook_LockVideoMemory_post},
-	{gcvHAL_UNLOCK_VIDEO_MEMORY, "UNLOCK_VIDEO_MEMORY", hook_UnlockVideoMemory_pre, hook_UnlockVideoMemory_post},
-	{gcvHAL_EVENT_COMMIT, "EVENT_COMMIT", hook_EventCommit_pre, hook_EventCommit_post},
-	{gcvHAL_USER_SIGNAL, "USER_SIGNAL", hook_UserSignal_pre, hook_UserSignal_post},
-	{gcvHAL_SIGNAL, "SIGNAL", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_WRITE_DATA, "WRITE_DATA", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_COMMIT, "COMMIT", hook_Commit_pre, hook_Commit_post},
-	{gcvHAL_STALL, "STALL", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_READ_REGISTER, "READ_REGISTER", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_WRITE_REGISTER, "WRITE_REGISTER", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_GET_PROFILE_SETTING, "GET_PROFILE_SETTING", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_SET_PROFILE_SETTING, "SET_PROFILE_SETTING", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_READ_ALL_PROFILE_REGISTERS, "READ_ALL_PROFILE_REGISTERS", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_PROFILE_REGISTERS_2D, "PROFILE_REGISTERS_2D", hook_unknown_pre, hook_unknown_post},
-#if VIVANTE_PROFILER_PERDRAW
-	{gcvHAL_READ_PROFILER_REGISTER_SETTING, "READ_PROFILER_REGISTER_SETTING", hook_unknown_pre, hook_unknown_post},
-#endif
-	{gcvHAL_SET_POWER_MANAGEMENT_STATE, "SET_POWER_MANAGEMENT_STATE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_QUERY_POWER_MANAGEMENT_STATE, "QUERY_POWER_MANAGEMENT_STATE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_GET_BASE_ADDRESS, "GET_BASE_ADDRESS", hook_empty_pre, hook_GetBaseAddress_post},
-	{gcvHAL_SET_IDLE, "SET_IDLE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_QUERY_KERNEL_SETTINGS, "QUERY_KERNEL_SETTINGS", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_RESET, "RESET", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_MAP_PHYSICAL, "MAP_PHYSICAL", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_DEBUG, "DEBUG", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_CACHE, "CACHE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_TIMESTAMP, "TIMESTAMP", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_DATABASE, "DATABASE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_VERSION, "VERSION", hook_empty_pre, hook_Version_post},
-	{gcvHAL_CHIP_INFO, "CHIP_INFO", hook_empty_pre, hook_ChipInfo_post},
-	{gcvHAL_ATTACH, "ATTACH", hook_empty_pre, hook_Attach_post},
-	{gcvHAL_DETACH, "DETACH", hook_Detach_pre, hook_Detach_post},
-	{gcvHAL_COMPOSE, "COMPOSE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_SET_TIMEOUT, "SET_TIMEOUT", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_GET_FRAME_INFO, "GET_FRAME_INFO", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_GET_SHARED_INFO, "GET_SHARED_INFO", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_SET_SHARED_INFO, "SET_SHARED_INFO", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_QUERY_COMMAND_BUFFER, "QUERY_COMMAND_BUFFER", hook_empty_pre, hook_QueryCommandBuffer_post},
-	{gcvHAL_COMMIT_DONE, "COMMIT_DONE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_DUMP_GPU_STATE, "DUMP_GPU_STATE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_DUMP_EVENT, "DUMP_EVENT", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_ALLOCATE_VIRTUAL_COMMAND_BUFFER, "ALLOCATE_VIRTUAL_COMMAND_BUFFER", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_FREE_VIRTUAL_COMMAND_BUFFER, "FREE_VIRTUAL_COMMAND_BUFFER", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_SET_FSCALE_VALUE, "SET_FSCALE_VALUE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_GET_FSCALE_VALUE, "GET_FSCALE_VALUE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_QUERY_RESET_TIME_STAMP, "QUERY_RESET_TIME_STAMP", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_SYNC_POINT, "SYNC_POINT", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_CREATE_NATIVE_FENCE, "CREATE_NATIVE_FENCE", hook_unknown_pre, hook_unknown_post},
-	{gcvHAL_VIDMEM_DATABASE, "VIDMEM_DATABASE", hook_unknown_pre, hook_unknown_post},
-};
-
 static int
 galcore_ioctl(int request, void *data)
 {
 	DRIVER_ARGS *args = data;
 	gcsHAL_INTERFACE *input, *output;
 	const char *command_name, *hardware;
-	int ret, hook_ret;
+	uint64_t start, duration;
+	int ret, hook_ret, subcommand;
 
 	if (request != IOCTL_GCHAL_INTERFACE) {
 		fprintf(stderr, "%s: wrong request: 0x%X\n", __func__,
@@ -790,15 +673,59 @@ galcore_ioctl(int request, void *data)
 		return -1;
 	}
 
-	hook_ret = command_table[input->command].pre(command_name, hardware, (void *) &input->u);
+	/* for our own queries. */
+	if (!galcore_hardware)
+		galcore_hardware = input->hardwareType;
+
+	/* the kernel might not hand this back untouched. */
+	if (input->command == gcvHAL_USER_SIGNAL)
+		subcommand = input->u.UserSignal.command;
+	else
+		subcommand = 0;
+
+	if (!wrap_trace ||
+	    !wrap_filter_traced(input->command, input->hardwareType)) {
+		if (!galcore_observed)
+			return orig_ioctl(dev_galcore_fd, request, data);
+
+		galcore_commit(input, 0);
+		wrap_log_commit();
+		ret = galcore_issue(request, data, input, &start, &duration);
+		galcore_stats(input, subcommand, duration);
+		return ret;
+	}
+
+	if (wrap_flight_size) {
+		flight_pre(input);
+		galcore_commit(input, 0);
+		wrap_log_commit();
+		ret = galcore_issue(request, data, input, &start, &duration);
+		flight_post(output, ret, start, duration);
+		galcore_stats(input, subcommand, duration);
+		return ret;
+	}
+
+	if (wrap_log_binary)
+		hook_ret = record_pre(input);
+	else
+		hook_ret = command_table[input->command].pre(command_name, hardware, (void *) &input->u);
+	galcore_commit(input, 1);
+	wrap_log_commit();
 	if (hook_ret) {
 		fprintf(stderr, "pre hook for %s(%s) failed.\n", command_name, hardware);
 		return -1;
 	}
 
-	ret = orig_ioctl(dev_galcore_fd, request, data);
+	ret = galcore_issue(request, data, input, &start, &duration);
 
-	hook_ret = command_table[input->command].post(command_name, hardware, (void *) &output->u, ret);
+	if (wrap_log_binary)
+		hook_ret = record_post(output, ret, start, duration);
+	else {
+		hook_ret = command_table[input->command].post(command_name, hardware, (void *) &output->u, ret);
+		hook_timing(start, duration);
+	}
+	wrap_log_commit();
+	galcore_stats(input, subcommand, duration);
 	if (hook_ret) {
 		fprintf(stderr, "post hook for %s(%s) failed.\n", command_name, hardware);
 		return -1;
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2011-2015 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Shared between the different parts of the wrapper.
+ */
+#ifndef WRAP_H
+#define WRAP_H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Every thread which passes through one of our hooks gets one of these.
+ * They are never freed, they are handed over to the next new thread once
+ * their owner has exited.
+ */
+struct wrap_ring;
+struct wrap_flight;
+struct wrap_stats;
+struct wrap_hang;
+
+struct wrap_thread {
+	struct wrap_thread *next;
+
+	int used; /* owned by a live thread. */
+	pid_t tid;
+
+	struct wrap_ring *ring;
+	struct wrap_flight *flight;
+	struct wrap_stats *stats;
+	struct wrap_hang *hang;
+};
+
+struct wrap_thread *wrap_thread_get(void);
+struct wrap_thread *wrap_thread_first(void);
+void wrap_thread_atfork_child(void);
+
+/*
+ * wrap.c
+ */
+extern int wrap_trace;
+extern unsigned int wrap_frame;
+
+int wrap_getenv_int(const char *name, int value);
+void viv_wrap_frame(void);
+int wrap_galcore_query(void *interface);
+
+/*
+ * Monotonic time in ns. This gets called around every single ioctl, so on
+ * aarch64 we read the generic timer directly instead of going through
+ * clock_gettime(). The counter frequency is turned into a 32.32 fixed
+ * point multiplier once.
+ */
+#if defined(__aarch64__)
+static inline uint64_t
+wrap_time(void)
+{
+	static uint64_t mult;
+	uint64_t count;
+
+	if (!mult) {
+		uint64_t frequency;
+
+		asm volatile("mrs %0, cntfrq_el0" : "=r" (frequency));
+		mult = (1000000000ULL << 32) / frequency;
+	}
+
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r" (count) :: "memory");
+
+	return ((unsigned __int128) count * mult) >> 32;
+}
+#else
+static inline uint64_t
+wrap_time(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return (time.tv_sec * 1000000000ULL) + time.tv_nsec;
+}
+#endif
+
+/*
+ * hooks.c
+ */
+struct wrap_command {
+	int command;
+	char *name;
+	int (*pre) (const char *command, const char *hardware, void *data);
+	int (*post) (const char *command, const char *hardware, void *data, int ioctl_ret);
+	int size;
+};
+
+extern struct wrap_command command_table[];
+extern int command_table_count;
+
+const char *viv_hardware_type(int type);
+const char *viv_pool_type(int pool);
+const char *viv_surface_type(int type);
+void hook_timing(uint64_t timestamp, uint64_t duration);
+void hook_address_comment(const char *what, uint32_t address);
+uint32_t hook_command_buffer_length(uint32_t size);
+void hook_command_buffer(const void *data, uint32_t size);
+struct viv_blob_ref;
+void hook_command_buffer_ref(const struct viv_blob_ref *ref);
+
+/*
+ * filter.c
+ */
+struct wrap_sample;
+
+extern unsigned char *wrap_filter;
+extern struct wrap_sample *wrap_sample;
+
+void wrap_filter_init(void);
+void wrap_sample_init(void);
+int wrap_sample_traced(int command);
+void wrap_sample_report(void);
+
+/*
+ * Commands which the filter does not know about, always get traced.
+ */
+static inline int
+wrap_filter_traced(int command, int hardware)
+{
+	if (wrap_filter && (command < command_table_count) &&
+	    !(wrap_filter[command] & (1 << hardware)))
+		return 0;
+
+	if (wrap_sample)
+		return wrap_sample_traced(command);
+
+	return 1;
+}
+
+/*
+ * log.c
+ */
+struct viv_record;
+
+extern int wrap_log_binary;
+
+void wrap_log_init(void);
+void wrap_log_start(void);
+int wrap_log(const char *format, ...);
+int wrap_log_record(struct viv_record *record, const void *data);
+void wrap_log_commit(void);
+int wrap_log_room(unsigned int length);
+void wrap_log_flush(int signum);
+void wrap_log_close(void);
+
+/*
+ * flight.c
+ */
+extern int wrap_flight_size;
+
+void wrap_flight_init(void);
+void wrap_flight_record(struct viv_record *record, const void *data);
+void wrap_flight_error(int command, int ioctl_ret, int status);
+void viv_wrap_flight_dump(const char *reason);
+
+/*
+ * stats.c
+ */
+extern int wrap_stats_enabled;
+
+void wrap_stats_init(void);
+void wrap_stats_add(int command, int hardware, int signal, uint64_t duration);
+void viv_wrap_stats_dump(void);
+
+/*
+ * watchdog.c
+ */
+extern int wrap_hang_ms;
+
+void wrap_hang_init(void);
+void wrap_hang_enter(int command, int hardware, const void *args, int size,
+		     uint64_t start);
+void wrap_hang_leave(int ret, int status, uint64_t duration);
+void wrap_hang_close(void);
+
+/*
+ * vidmem.c
+ */
+extern int wrap_vidmem_size;
+
+void wrap_vidmem_init(void);
+void wrap_vidmem_pre(void *interface);
+void wrap_vidmem_post(void *interface);
+void wrap_vidmem_deferred(void *interface);
+void viv_wrap_vidmem_dump(void);
+void viv_wrap_vidmem_stats(void);
+void viv_wrap_vidmem_locks(void);
+void viv_wrap_vidmem_churn(void);
+void viv_wrap_vidmem_leaks(const char *reason);
+void wrap_vidmem_snapshot(uint64_t *pools, int *nodes, int *locked);
+
+/*
+ * database.c
+ */
+extern int wrap_database_ms;
+
+void wrap_database_init(void);
+void wrap_database_start(void);
+void wrap_database_close(void);
+
+/*
+ * mapping.c
+ */
+extern int wrap_mapping_enabled;
+
+void wrap_mapping_mmap(void *address, size_t size, int prot, int flags,
+		       uint64_t offset, int traced);
+void wrap_mapping_munmap(void *address, size_t size);
+void wrap_mapping_post(void *interface);
+void viv_wrap_mapping_dump(void);
+
+/*
+ * pin.c
+ */
+extern int wrap_pin_enabled;
+
+void wrap_pin_post(void *interface);
+uint64_t wrap_pin_bytes(void);
+void viv_wrap_pin_dump(void);
+
+/*
+ * capture.c
+ */
+extern int wrap_capture_enabled;
+extern int wrap_capture_opcodes;
+
+void wrap_capture_commit(void *interface, int traced);
+void viv_wrap_capture_stats(void);
+
+/*
+ * cmdstream.c
+ */
+#define CMDSTREAM_OPCODES 32
+
+struct wrap_cmdstream_stats {
+	uint64_t opcodes[CMDSTREAM_OPCODES];
+	uint64_t words;
+	uint64_t states; /* registers written. */
+	uint64_t draws;
+	uint64_t broken;
+};
+
+int wrap_cmdstream_decode(const void *data, uint32_t size,
+			  struct wrap_cmdstream_stats *stats);
+void wrap_cmdstream_add(struct wrap_cmdstream_stats *total,
+			struct wrap_cmdstream_stats *stats);
+void wrap_cmdstream_log(struct wrap_cmdstream_stats *stats);
+void wrap_cmdstream_addresses(const void *data, uint32_t size);
+void wrap_cmdstream_report(void);
+
+/*
+ * delta.c
+ */
+struct wrap_delta_record { /* gcsSTATE_DELTA_RECORD */
+	uint32_t address;
+	uint32_t mask;
+	uint32_t data;
+};
+
+extern int wrap_delta_enabled;
+
+int wrap_delta_apply(const struct wrap_delta_record *records, uint32_t count);
+void wrap_delta_log(const struct wrap_delta_record *records, uint32_t count);
+void wrap_delta_report(void);
+
+/*
+ * queue.c
+ */
+extern int wrap_queue_enabled;
+
+int wrap_queue_foreach(void *interface,
+		       void (*func)(void *entry, void *private),
+		       void *private, int *truncated);
+void wrap_queue_walk(void *interface, int traced);
+void viv_wrap_queue_stats(void);
+
+/*
+ * dedup.c
+ */
+extern int wrap_dedup_enabled;
+
+void wrap_dedup_init(void);
+int wrap_dedup_add(int hardware, const void *data, uint32_t size);
+void wrap_dedup_flush(void);
+void viv_wrap_dedup_stats(void);
+void wrap_dedup_close(void);
+
+/*
+ * timeline.c
+ */
+extern int wrap_timeline_enabled;
+
+void wrap_timeline_init(void);
+void wrap_timeline_frame(void);
+void wrap_timeline_post(void *interface);
+void wrap_timeline_flush(void);
+void wrap_timeline_close(void);
+
+/*
+ * address.c
+ */
+extern int wrap_address_enabled;
+
+void wrap_address_update(void *interface);
+void wrap_address_drain(void);
+int wrap_address_name(uint32_t address, char *buffer, int size);
+
+#endif /* WRAP_H */